@@ -7,9 +7,21 @@
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 #include <string>
+#include <string.h>
 #include <stdint.h>
 #include "ispi.h"
 
+// Dual and quad transfers need the nbits fields and the 32 bit mode ioctl
+#if defined(SPI_TX_DUAL) && defined(SPI_IOC_WR_MODE32)
+#define FS_SPI_MULTI_IO
+#endif
+
+enum FS_SPI_CONST
+{
+    FS_SPI_MAX_FRAMES = 64,     // Transfers submitted per SPI_IOC_MESSAGE
+    FS_SPI_BUFSIZ     = 4096    // spidev bufsiz if it cannot be read
+};
+
 /** @brief SPI implementation for Linux systems using file devices
  *
  *  This class implements an interface to the SPI buses provided via the /dev
@@ -24,6 +36,14 @@ protected:
     int 	    m_fd;
     std::string m_fname;
     uint16_t    m_spiDelay;             // Don't know what this is for
+    int         m_persist;              // Keep the device open between transfers
+    int         m_cfgSpeed;             // Settings last written to the device
+    int         m_cfgMode;
+    int         m_cfgBPW;
+    uint32_t    m_bufSize;              // Bytes spidev accepts per message
+    uint8_t     m_txWidth;              // Data lines for half duplex transfers
+    uint8_t     m_rxWidth;
+    int         m_cfgWidth;
 
 public:
     FS_SPI(const std::string& fn);
@@ -36,13 +56,23 @@ public:
     int setBPW(int val);
     int setSpeed(int val);
     int setMode(int val);
+    int setPersistent(int val);
+    int isPersistent();
+    int setWidth(int txWidth, int rxWidth);
 
     int      rwData(uint8_t *data, uint8_t len);
+    int      rwFrames(uint8_t *data, int len, uint8_t frameLen);
     uint8_t  rwByte(uint8_t bt);
     uint16_t rwWord(uint16_t wd);
+    int      rwSegments(const SPI_Segment* seg, int count);
+    int      writeData(const uint8_t* tx, int len);
+    int      readData(uint8_t* rx, int len);
 
 protected:
     void init(int speed, const std::string& fn);
+    int  configure();
+    uint32_t bufSize();
+    int  submit(struct spi_ioc_transfer* xfer, int count, int last);
 };
 
 
@@ -82,7 +112,10 @@ inline int FS_SPI::isReady()
 
 
 inline FS_SPI::~FS_SPI()
-{}
+{
+    m_persist = 0;
+    closeBus();
+}
 
 
 /** @brief init - Initialize the object with starting values.
@@ -101,19 +134,31 @@ inline void FS_SPI::init(int speed, const std::string& fn)
     m_spiBPW    = 8;
     m_spiDelay  = 0;
     m_fd        = 0;
+    m_persist   = 0;
+    m_cfgSpeed  = -1;
+    m_cfgMode   = -1;
+    m_cfgBPW    = -1;
+    m_bufSize   = 0;
+    m_txWidth   = 1;
+    m_rxWidth   = 1;
+    m_cfgWidth  = -1;
 }
 
 
 /** @brief Opens the device file for the bus and sets the parameters.
  *
  * Sets up the bus to do read/write operations using the current settings for
- * this object.
+ * this object.  In persistent mode a call on an already open bus only applies
+ * any settings that changed since the last transfer.
  *
  */
 inline int FS_SPI::openBus()
 {
     if (m_fd > 0)
     {
+        if (m_persist)
+            return configure();
+        
         printf("SPI::openBus: bus already opened - [%08X]\n", m_fd);
         return 0;
     }
@@ -126,52 +171,33 @@ inline int FS_SPI::openBus()
     }
     
     // Setup the SPI bus with our current parameters
-    if (ioctl (fd, SPI_IOC_WR_MODE, &m_spiMode)         < 0)
-    {
-        perror("SPI::openBus: ");
-        return -1 ;
-    }
-    
-    if (ioctl (fd, SPI_IOC_RD_MODE, &m_spiMode)         < 0)
-    {
-        perror("SPI::openBus: ");
-        return -1 ;
-    }
-    
-    if (ioctl (fd, SPI_IOC_WR_BITS_PER_WORD, &m_spiBPW) < 0)
-    {
-        perror("SPI::openBus: ");
-        return -1 ;
-    }
-    
-    if (ioctl (fd, SPI_IOC_RD_BITS_PER_WORD, &m_spiBPW) < 0)
-    {
-        perror("SPI::openBus: ");
-        return -1 ;
-    }
+    m_fd        = fd;
+    m_cfgSpeed  = -1;
+    m_cfgMode   = -1;
+    m_cfgBPW    = -1;
+    m_cfgWidth  = -1;
     
-    if (ioctl (fd, SPI_IOC_WR_MAX_SPEED_HZ, &m_speed)   < 0)
+    if (configure() < 0)
     {
-        perror("SPI::openBus: ");
-        return -1 ;
-    }
-    
-    if (ioctl (fd, SPI_IOC_RD_MAX_SPEED_HZ, &m_speed)   < 0)
-    {
-        perror("SPI::openBus: ");
-        return -1 ;
+        close(fd);
+        m_fd = 0;
+        return -1;
     }
     
-    m_fd = fd;
-    
     return 0;
 }
 
 
 /** @brief closeBus - Closes the device file and terminates the transfer of data.
+ *
+ * Does nothing while the bus is in persistent mode, the device stays open
+ * until persistent mode is turned off or the object is destroyed.
  */
 inline int FS_SPI::closeBus()
 {
+    if (m_persist)
+        return 0;
+    
     if (m_fd > 0)
     {
         close(m_fd);
@@ -184,6 +210,37 @@ inline int FS_SPI::closeBus()
 }
 
 
+/** @brief Keep the device open and configured across openBus/closeBus calls.
+ *
+ * With persistent mode enabled the first openBus() opens and configures the
+ * device and later openBus()/closeBus() pairs cost no system calls.  Changes
+ * to mode, BPW or speed are written to the device lazily on the next transfer
+ * and only when they differ from what the device already has.  Turning
+ * persistent mode off closes the device.
+ *
+ * @param val 1 - Enable persistent mode. 0 - Disable.
+ * @return int: The previous setting.
+ */
+inline int FS_SPI::setPersistent(int val)
+{
+    int result = m_persist;
+    m_persist = val ? 1 : 0;
+    
+    if (result && !m_persist)
+        closeBus();
+    
+    return result;
+}
+
+
+/** @brief Returns 1 if the bus is in persistent mode, 0 otherwise.
+ */
+inline int FS_SPI::isPersistent()
+{
+    return m_persist;
+}
+
+
 /** @brief setBPW - Sets the
  *
  * Sets the 'Bits per Word' parameter for subsequent SPI transfers.
@@ -235,6 +292,33 @@ inline int FS_SPI::setMode(int val)
 }
 
 
+/** @brief Sets the number of data lines used for send only and receive only
+ *  transfers.
+ *
+ *  Dual and quad transfers need a controller and device that support them
+ *  and kernel headers that define SPI_TX_DUAL and SPI_IOC_WR_MODE32.  Full
+ *  duplex transfers always use one line each way.  The setting is written
+ *  to the device with the mode on the next transfer.
+ *
+ *  @param txWidth 1, 2 or 4 lines for writeData().
+ *  @param rxWidth 1, 2 or 4 lines for readData().
+ *  @return int: 0 - Success.  -1 - Invalid or not supported.
+ */
+inline int FS_SPI::setWidth(int txWidth, int rxWidth)
+{
+    if ((txWidth != 1 && txWidth != 2 && txWidth != 4) ||
+        (rxWidth != 1 && rxWidth != 2 && rxWidth != 4))
+        return -1;
+#ifndef FS_SPI_MULTI_IO
+    if (txWidth != 1 || rxWidth != 1)
+        return -1;
+#endif
+    m_txWidth = txWidth;
+    m_rxWidth = rxWidth;
+    return 0;
+}
+
+
 /** @brief Shifts data out as well as in.
  *
  * Sends the data contained in the buffer to the bus and reads the incomming
@@ -247,6 +331,10 @@ inline int FS_SPI::rwData(uint8_t* data, uint8_t len)
 {
     struct spi_ioc_transfer spiCtrl;
     
+    if (m_persist && configure() < 0)
+        return -1;
+    
+    memset(&spiCtrl, 0, sizeof(spiCtrl));
     spiCtrl.tx_buf        = (unsigned long)data;
     spiCtrl.rx_buf        = (unsigned long)data;
     spiCtrl.len           = len;
@@ -258,6 +346,179 @@ inline int FS_SPI::rwData(uint8_t* data, uint8_t len)
 }
 
 
+/** @brief Shifts a buffer out as a series of chip-select framed transfers.
+ *
+ * Builds one spi_ioc_transfer per frame with cs_change set between frames so
+ * that chip-select is released after each one, and submits them with a single
+ * SPI_IOC_MESSAGE ioctl.  Buffers longer than FS_SPI_MAX_FRAMES frames are
+ * sent using one ioctl per FS_SPI_MAX_FRAMES frames.  The buffer is
+ * overwritten with the incoming data.
+ *
+ * @param data Pointer to a buffer of data to send.
+ * @param len Number of bytes to send from the buffer.
+ * @param frameLen Number of bytes sent per chip-select frame.
+ */
+inline int FS_SPI::rwFrames(uint8_t* data, int len, uint8_t frameLen)
+{
+    struct spi_ioc_transfer spiCtrl[FS_SPI_MAX_FRAMES];
+    int result = 0;
+    
+    if (frameLen == 0)
+        return -1;
+    
+    if (m_persist && configure() < 0)
+        return -1;
+    
+    while (len > 0)
+    {
+        int count = 0;
+        
+        memset(spiCtrl, 0, sizeof(spiCtrl));
+        while (len > 0 && count < FS_SPI_MAX_FRAMES)
+        {
+            int n = (len < frameLen) ? len : frameLen;
+            
+            spiCtrl[count].tx_buf        = (unsigned long)data;
+            spiCtrl[count].rx_buf        = (unsigned long)data;
+            spiCtrl[count].len           = n;
+            spiCtrl[count].delay_usecs   = m_spiDelay;
+            spiCtrl[count].speed_hz      = m_speed;
+            spiCtrl[count].bits_per_word = m_spiBPW;
+            spiCtrl[count].cs_change     = 1;
+            
+            data += n;
+            len  -= n;
+            count++;
+        }
+        
+        // Chip-select is released at the end of the message anyway. Setting
+        // cs_change on the final transfer would hold it asserted instead.
+        spiCtrl[count-1].cs_change = 0;
+        
+        result = ioctl(m_fd, SPI_IOC_MESSAGE(count), spiCtrl);
+        if (result < 0)
+            return result;
+    }
+    
+    return result;
+}
+
+
+/** @brief Shifts a list of segments in as few ioctls as possible.
+ *
+ * Each segment becomes one spi_ioc_transfer with its own buffers, clock,
+ * word size and delay, so headers and payloads are sent from where they lie
+ * without copying.  spidev limits a message to bufsiz bytes (read from
+ * /sys/module/spidev/parameters/bufsiz) and this class to FS_SPI_MAX_FRAMES
+ * transfers; longer lists and segments are split over several messages with
+ * chip-select held asserted across each split unless the segment asked for
+ * it to be released there.
+ *
+ * @param seg The segments, in order.
+ * @param count Number of segments.
+ * @return int: Number of bytes shifted, negative on failure.
+ */
+inline int FS_SPI::rwSegments(const SPI_Segment* seg, int count)
+{
+    struct spi_ioc_transfer xfer[FS_SPI_MAX_FRAMES];
+    uint32_t limit = bufSize();
+    uint32_t used  = 0;
+    int n = 0;
+    int total = 0;
+    
+    if (count <= 0)
+        return (count == 0) ? 0 : -1;
+    
+    if (m_persist && configure() < 0)
+        return -1;
+    
+    memset(xfer, 0, sizeof(xfer));
+    for (int i=0; i<count; i++)
+    {
+        uint32_t pos = 0;
+        
+        do
+        {
+            if (n == FS_SPI_MAX_FRAMES || (used == limit && seg[i].len > 0))
+            {
+                if (submit(xfer, n, 0) < 0)
+                    return -1;
+                memset(xfer, 0, sizeof(xfer));
+                n    = 0;
+                used = 0;
+            }
+            
+            uint32_t len = seg[i].len - pos;
+            if (len > limit - used)
+                len = limit - used;
+            int end = (pos + len == seg[i].len);
+            
+            if (seg[i].tx)
+                xfer[n].tx_buf    = (unsigned long)(seg[i].tx + pos);
+            if (seg[i].rx)
+                xfer[n].rx_buf    = (unsigned long)(seg[i].rx + pos);
+            xfer[n].len           = len;
+            xfer[n].speed_hz      = seg[i].speed ? seg[i].speed : m_speed;
+            xfer[n].bits_per_word = seg[i].bpw ? seg[i].bpw : m_spiBPW;
+            xfer[n].delay_usecs   = end ? seg[i].delay : 0;
+            xfer[n].cs_change     = end ? seg[i].csChange : 0;
+#ifdef FS_SPI_MULTI_IO
+            xfer[n].tx_nbits      = seg[i].txNbits;
+            xfer[n].rx_nbits      = seg[i].rxNbits;
+#endif
+            
+            pos   += len;
+            used  += len;
+            total += len;
+            n++;
+        }
+        while (pos < seg[i].len);
+    }
+    
+    if (submit(xfer, n, 1) < 0)
+        return -1;
+    return total;
+}
+
+
+/** @brief Sends from a buffer that is left untouched, discarding the input.
+ *
+ * Uses the data lines set with setWidth().  No length limit applies.
+ *
+ * @param tx Bytes to send.
+ * @param len Number of bytes.
+ * @return int: Number of bytes sent, negative on failure.
+ */
+inline int FS_SPI::writeData(const uint8_t* tx, int len)
+{
+    SPI_Segment seg;
+    memset(&seg, 0, sizeof(seg));
+    seg.tx      = tx;
+    seg.len     = len;
+    seg.txNbits = m_txWidth;
+    return rwSegments(&seg, 1);
+}
+
+
+/** @brief Receives into a buffer while sending zeros.
+ *
+ * Uses the data lines set with setWidth().  No length limit applies.
+ *
+ * @param rx Buffer for the bytes read.
+ * @param len Number of bytes.
+ * @return int: Number of bytes read, negative on failure.
+ */
+inline int FS_SPI::readData(uint8_t* rx, int len)
+{
+    SPI_Segment seg;
+    memset(&seg, 0, sizeof(seg));
+    seg.rx      = rx;
+    seg.len     = len;
+    seg.rxNbits = m_rxWidth;
+    return rwSegments(&seg, 1);
+}
+
+
 /** @brief Send and recieve one 8 bit byte of data.
  *
  * @param bt Data byte to send.
@@ -282,6 +543,141 @@ inline uint16_t FS_SPI::rwWord(uint16_t wd)
 }
 
 
+/** @brief Write any changed bus settings to the open device.
+ *
+ * Compares the current mode, BPW and speed against the values last written
+ * to the device and only issues the ioctls for the settings that differ.
+ *
+ * @return int: 0 - Success. -1 - An ioctl failed.
+ */
+inline int FS_SPI::configure()
+{
+    if (m_fd <= 0)
+        return -1;
+    
+    int width = (m_txWidth << 4) | m_rxWidth;
+    
+    if (m_cfgMode != m_spiMode || m_cfgWidth != width)
+    {
+#ifdef FS_SPI_MULTI_IO
+        // Always write all 32 bits.  The 8 bit mode ioctl cannot carry the
+        //  dual/quad flags, so it would leave them set after going back to
+        //  single line transfers.
+        uint32_t mode = m_spiMode;
+        if (m_txWidth == 2) mode |= SPI_TX_DUAL;
+        if (m_txWidth == 4) mode |= SPI_TX_QUAD;
+        if (m_rxWidth == 2) mode |= SPI_RX_DUAL;
+        if (m_rxWidth == 4) mode |= SPI_RX_QUAD;
+        if (ioctl (m_fd, SPI_IOC_WR_MODE32, &mode)            < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        
+        if (ioctl (m_fd, SPI_IOC_RD_MODE32, &mode)            < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        m_spiMode = mode & 0xFF;
+#else
+        if (ioctl (m_fd, SPI_IOC_WR_MODE, &m_spiMode)         < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        
+        if (ioctl (m_fd, SPI_IOC_RD_MODE, &m_spiMode)         < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+#endif
+        m_cfgMode  = m_spiMode;
+        m_cfgWidth = width;
+    }
+    
+    if (m_cfgBPW != m_spiBPW)
+    {
+        if (ioctl (m_fd, SPI_IOC_WR_BITS_PER_WORD, &m_spiBPW) < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        
+        if (ioctl (m_fd, SPI_IOC_RD_BITS_PER_WORD, &m_spiBPW) < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        m_cfgBPW = m_spiBPW;
+    }
+    
+    if (m_cfgSpeed != m_speed)
+    {
+        if (ioctl (m_fd, SPI_IOC_WR_MAX_SPEED_HZ, &m_speed)   < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        
+        if (ioctl (m_fd, SPI_IOC_RD_MAX_SPEED_HZ, &m_speed)   < 0)
+        {
+            perror("SPI::configure: ");
+            return -1 ;
+        }
+        m_cfgSpeed = m_speed;
+    }
+    
+    return 0;
+}
+
+
+/** @brief Returns the most bytes spidev accepts in one message.
+ *
+ * Read once from the module parameter, FS_SPI_BUFSIZ if it is unavailable.
+ */
+inline uint32_t FS_SPI::bufSize()
+{
+    if (m_bufSize == 0)
+    {
+        unsigned int val = 0;
+        FILE* f = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+        if (f)
+        {
+            if (fscanf(f, "%u", &val) != 1)
+                val = 0;
+            fclose(f);
+        }
+        m_bufSize = (val > 0) ? val : (unsigned int)FS_SPI_BUFSIZ;
+    }
+    return m_bufSize;
+}
+
+
+/** @brief Submit a list of transfers as one message.
+ *
+ * On the final transfer of a message cs_change means "keep chip-select
+ * asserted", the opposite of its meaning between transfers.  When a list is
+ * split (last = 0) the flag is inverted so chip-select behaves as asked at
+ * the split; at the real end of the list it is cleared to release it.
+ *
+ * @return int: ioctl result, negative on failure.
+ */
+inline int FS_SPI::submit(struct spi_ioc_transfer* xfer, int count, int last)
+{
+    if (count == 0)
+        return 0;
+    
+    if (last)
+        xfer[count-1].cs_change = 0;
+    else
+        xfer[count-1].cs_change = !xfer[count-1].cs_change;
+    
+    return ioctl(m_fd, SPI_IOC_MESSAGE(count), xfer);
+}
+
+
 
 
 
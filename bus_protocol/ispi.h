@@ -2,6 +2,27 @@
 #define __SFL6470__ISPI__
 
 #include <stdint.h>
+#include <string.h>
+
+/** @brief One piece of a scatter-gather SPI transfer.
+ *
+ *  Chip-select stays asserted from one segment to the next unless csChange
+ *  is set, so a header and a payload in separate buffers go out as one
+ *  frame.  Chip-select is always released after the last segment.
+ */
+typedef struct SPI_Segment
+{
+    const uint8_t*  tx;         // Bytes to send, NULL to send zeros
+    uint8_t*        rx;         // Buffer for the bytes read, NULL to discard
+    uint32_t        len;        // Number of bytes
+    uint32_t        speed;      // Clock in Hz, 0 for the bus setting
+    uint16_t        delay;      // usecs to wait after the segment
+    uint8_t         bpw;        // Bits per word, 0 for the bus setting
+    uint8_t         csChange;   // Release chip-select after the segment
+    uint8_t         txNbits;    // Data lines for tx: 0/1, 2 (dual), 4 (quad)
+    uint8_t         rxNbits;    // Data lines for rx: 0/1, 2 (dual), 4 (quad)
+} SPI_Segment;
+
 
 /** @brief Interface for SPI communication.
  *
@@ -28,6 +49,113 @@ public:
     virtual int      rwData(uint8_t *data, uint8_t len)=0;
     virtual uint8_t  rwByte(uint8_t bt)=0;
     virtual uint16_t rwWord(uint16_t wd)=0;
+    
+    // Optional overides
+    
+    /** @brief Keep the bus open and configured between openBus/closeBus pairs.
+     *
+     *  Implementations that support a persistent session keep the device open
+     *  once opened and only reconfigure it when mode/BPW/speed change.
+     *  @param val 1 - Enable persistent session. 0 - Disable.
+     *  @return int: The previous setting.
+     */
+    virtual int setPersistent(int val) {return 0;};
+    virtual int isPersistent() {return 0;};
+    
+    /** @brief Shift a buffer as a series of chip-select framed transfers.
+     *
+     *  The buffer is split into frames of frameLen bytes and chip-select is
+     *  released between frames.  Implementations should submit the whole
+     *  buffer as a single bus operation where possible.  The buffer is
+     *  overwritten with the incoming data.
+     *  @param data Pointer to the buffer of data to send.
+     *  @param len Number of bytes in the buffer.
+     *  @param frameLen Number of bytes per chip-select frame.
+     *  @return int: Negative on failure.
+     */
+    virtual int rwFrames(uint8_t *data, int len, uint8_t frameLen)
+    {
+        int result = 0;
+        if (frameLen == 0)
+            return -1;
+        for (int i=0; i<len; i+=frameLen)
+        {
+            uint8_t n = (len-i < frameLen) ? len-i : frameLen;
+            result = rwData(data+i, n);
+            if (result < 0)
+                return result;
+        }
+        return result;
+    };
+    
+    /** @brief Shift a list of segments as one scatter-gather operation.
+     *
+     *  Implementations should submit every segment in one bus operation with
+     *  per-segment clock, word size, delay and chip-select handling.  This
+     *  fallback sends each segment through rwData() in pieces of at most 255
+     *  bytes using a scratch buffer, releasing chip-select after every piece
+     *  and ignoring the per-segment settings.
+     *  @param seg The segments, in order.
+     *  @param count Number of segments.
+     *  @return int: Number of bytes shifted, negative on failure.
+     */
+    virtual int rwSegments(const SPI_Segment* seg, int count)
+    {
+        uint8_t buf[255];
+        int total = 0;
+        for (int i=0; i<count; i++)
+        {
+            for (uint32_t pos=0; pos<seg[i].len; )
+            {
+                uint32_t n = seg[i].len - pos;
+                if (n > sizeof(buf))
+                    n = sizeof(buf);
+                if (seg[i].tx)
+                    memcpy(buf, seg[i].tx + pos, n);
+                else
+                    memset(buf, 0, n);
+                if (rwData(buf, n) < 0)
+                    return -1;
+                if (seg[i].rx)
+                    memcpy(seg[i].rx + pos, buf, n);
+                pos   += n;
+                total += n;
+            }
+        }
+        return total;
+    };
+    
+    /** @brief Full duplex transfer with separate send and receive buffers.
+     *
+     *  The outgoing data is not overwritten so it may live in const memory.
+     *  @param tx Bytes to send, NULL to send zeros.
+     *  @param rx Buffer for the bytes read, NULL to discard them.
+     *  @param len Number of bytes.
+     *  @return int: Number of bytes shifted, negative on failure.
+     */
+    virtual int xferData(const uint8_t* tx, uint8_t* rx, int len)
+    {
+        SPI_Segment seg;
+        memset(&seg, 0, sizeof(seg));
+        seg.tx  = tx;
+        seg.rx  = rx;
+        seg.len = len;
+        return rwSegments(&seg, 1);
+    };
+    
+    /** @brief Send only, the incoming data is discarded.
+     */
+    virtual int writeData(const uint8_t* tx, int len)
+    {
+        return xferData(tx, NULL, len);
+    };
+    
+    /** @brief Receive only, zeros are sent.
+     */
+    virtual int readData(uint8_t* rx, int len)
+    {
+        return xferData(NULL, rx, len);
+    };
 };
 
 /*
@@ -0,0 +1,488 @@
+#ifndef SPI_ASYNC_H
+#define SPI_ASYNC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <vector>
+#include "ispi.h"
+
+enum SPI_ASYNC_CONST
+{
+    SPI_ASYNC_DEPTH = 64,       // Default queue depth, rounded up to 2^n
+    SPI_ASYNC_SEGS  = 4,        // Most segments in one request
+    SPI_ASYNC_MERGE = 32        // Most segments merged into one bus operation
+};
+
+
+/** @brief Callback invoked by the worker thread when a request completes.
+ *
+ *  @param seq The ticket returned by submit().
+ *  @param result Bytes shifted for the request, negative on failure.
+ *  @param ctx The context pointer given to submit().
+ */
+typedef void (*SPI_DoneCallback)(uint32_t seq, int result, void* ctx);
+
+
+/** @brief Asynchronous transfer queue for one or more SPI buses
+ *
+ *  Transfers are queued by any thread and performed on a worker thread, so
+ *  a sensor poll and a motor command from different loops no longer wait on
+ *  each other's ioctls.  Each request is a short list of SPI_Segment that is
+ *  shifted as one chip-select transaction with rwSegments().  The buffers the
+ *  segments point to must stay valid until the request completes.
+ *
+ *  Requests are performed in the order they were queued.  Consecutive
+ *  requests for the same bus object are merged into a single rwSegments()
+ *  call with chip-select released between them, so a burst of small
+ *  transfers costs one ioctl (and one lock of an SPI_Handle) instead of one
+ *  each.
+ *
+ *      uint32_t seq = queue.submit(bus, seg, 2, done, this);
+ *      ...
+ *      queue.wait(seq);
+ *
+ *  The worker can be pinned to a CPU and run SCHED_FIFO, which needs
+ *  CAP_SYS_NICE (or root).  Completion is reported to the request callback
+ *  on the worker thread and can be waited for with wait() or checked with
+ *  isDone().  The buses must not be used directly from other threads while
+ *  the queue is running, unless they are SPI_Handles of one SPI_BusMgr.
+ *  Programs using this class must link with -lpthread.
+ */
+class SPI_AsyncQueue
+{
+protected:
+    struct Request
+    {
+        uint32_t            seq;
+        ISPI*               bus;
+        int                 count;
+        SPI_Segment         seg[SPI_ASYNC_SEGS];
+        SPI_DoneCallback    cb;
+        void*               ctx;
+    };
+
+    std::vector<Request>    m_ring;
+    uint32_t                m_mask;
+    uint32_t                m_head;     // Next slot written by a producer
+    uint32_t                m_tail;     // Next slot read by the consumer
+    uint32_t                m_seq;      // Last ticket handed out
+    uint32_t                m_done;     // Last ticket completed
+    uint32_t                m_calls;
+    uint32_t                m_merged;
+    int                     m_run;
+    int                     m_started;
+    pthread_t               m_thread;
+    sem_t                   m_work;
+    pthread_mutex_t         m_submit;   // Serializes producers
+    pthread_mutex_t         m_lock;
+    pthread_cond_t          m_cond;
+
+public:
+    SPI_AsyncQueue(int depth = SPI_ASYNC_DEPTH);
+    virtual ~SPI_AsyncQueue();
+
+    int         start(int cpu = -1, int priority = 0);
+    void        stop();
+    int         isRunning();
+
+    uint32_t    submit(ISPI& bus, const SPI_Segment* seg, int count,
+                       SPI_DoneCallback cb = NULL, void* ctx = NULL);
+    uint32_t    submit(ISPI& bus, const uint8_t* tx, uint8_t* rx, int len,
+                       SPI_DoneCallback cb = NULL, void* ctx = NULL);
+
+    int         pending();
+    int         isDone(uint32_t seq);
+    int         wait(uint32_t seq, int timeout_ms = -1);
+    int         dispatch();
+    uint32_t    callCount();
+    uint32_t    mergeCount();
+
+protected:
+    static void* threadMain(void* arg);
+
+private:
+    SPI_AsyncQueue(const SPI_AsyncQueue&);
+    SPI_AsyncQueue& operator=(const SPI_AsyncQueue&);
+};
+
+
+
+
+
+/** @brief Creates a stopped queue.
+ *
+ *  @param depth Number of requests the queue holds, rounded up to a power of 2.
+ */
+inline SPI_AsyncQueue::SPI_AsyncQueue(int depth)
+{
+    uint32_t size = 2;
+    while ((int)size < depth)
+        size <<= 1;
+
+    m_ring.resize(size);
+    m_mask      = size - 1;
+    m_head      = 0;
+    m_tail      = 0;
+    m_seq       = 0;
+    m_done      = 0;
+    m_calls     = 0;
+    m_merged    = 0;
+    m_run       = 0;
+    m_started   = 0;
+    sem_init(&m_work, 0, 0);
+    pthread_mutex_init(&m_submit, NULL);
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+
+/** @brief Stops the worker thread, performing anything still queued.
+ */
+inline SPI_AsyncQueue::~SPI_AsyncQueue()
+{
+    stop();
+    sem_destroy(&m_work);
+    pthread_mutex_destroy(&m_submit);
+    pthread_mutex_destroy(&m_lock);
+    pthread_cond_destroy(&m_cond);
+}
+
+
+/** @brief Start the worker thread.
+ *
+ *  @param cpu CPU to pin the worker to, -1 for any.
+ *  @param priority SCHED_FIFO priority (1-99), 0 for the normal scheduler.
+ *  @return int: 0 - Success. Negative on failure, e.g. no permission for
+ *               SCHED_FIFO or no such CPU.
+ */
+inline int SPI_AsyncQueue::start(int cpu, int priority)
+{
+    pthread_attr_t attr;
+    int result = 0;
+
+    if (m_started)
+        return 0;
+
+    pthread_attr_init(&attr);
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        result = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    if (priority > 0 and result == 0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        result = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (result == 0)
+            result = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        if (result == 0)
+            result = pthread_attr_setschedparam(&attr, &param);
+    }
+
+    if (result == 0)
+    {
+        __atomic_store_n(&m_run, 1, __ATOMIC_RELEASE);
+        result = pthread_create(&m_thread, &attr, threadMain, this);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (result != 0)
+    {
+        m_run = 0;
+        return -1;
+    }
+
+    m_started = 1;
+    return 0;
+}
+
+
+/** @brief Stop the worker thread once the queue is empty.
+ */
+inline void SPI_AsyncQueue::stop()
+{
+    if (!m_started)
+        return;
+
+    __atomic_store_n(&m_run, 0, __ATOMIC_RELEASE);
+    sem_post(&m_work);
+    pthread_join(m_thread, NULL);
+    m_started = 0;
+}
+
+
+/** @brief Returns 1 if the worker thread is running.
+ */
+inline int SPI_AsyncQueue::isRunning()
+{
+    return m_started;
+}
+
+
+/** @brief Queue a list of segments as one transaction.
+ *
+ *  The segment descriptors are copied, the buffers they point to are not.
+ *
+ *  @param bus The bus to shift the segments on.
+ *  @param seg The segments, in order.
+ *  @param count Number of segments, 1 to SPI_ASYNC_SEGS.
+ *  @param cb Called on the worker thread when the transfer is done.
+ *  @param ctx Pointer passed back to the callback.
+ *  @return uint32_t: Ticket for the request, 0 if the queue is full or the
+ *                    request is invalid.
+ */
+inline uint32_t SPI_AsyncQueue::submit(ISPI& bus, const SPI_Segment* seg,
+                                       int count, SPI_DoneCallback cb,
+                                       void* ctx)
+{
+    if (count < 1 or count > SPI_ASYNC_SEGS)
+        return 0;
+
+    pthread_mutex_lock(&m_submit);
+
+    uint32_t head = m_head;
+    uint32_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+    if (head - tail > m_mask)
+    {
+        pthread_mutex_unlock(&m_submit);
+        return 0;
+    }
+
+    Request& req = m_ring[head & m_mask];
+    req.seq   = ++m_seq;
+    if (req.seq == 0)
+        req.seq = ++m_seq;
+    req.bus   = &bus;
+    req.count = count;
+    req.cb    = cb;
+    req.ctx   = ctx;
+    memcpy(req.seg, seg, count * sizeof(SPI_Segment));
+
+    uint32_t seq = req.seq;
+    __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&m_submit);
+
+    sem_post(&m_work);
+    return seq;
+}
+
+
+/** @brief Queue a full duplex transfer with separate buffers.
+ *
+ *  @param bus The bus to shift the data on.
+ *  @param tx Bytes to send, NULL to send zeros.
+ *  @param rx Buffer for the bytes read, NULL to discard them.
+ *  @param len Number of bytes.
+ *  @param cb Called on the worker thread when the transfer is done.
+ *  @param ctx Pointer passed back to the callback.
+ *  @return uint32_t: Ticket for the request, 0 if the queue is full.
+ */
+inline uint32_t SPI_AsyncQueue::submit(ISPI& bus, const uint8_t* tx,
+                                       uint8_t* rx, int len,
+                                       SPI_DoneCallback cb, void* ctx)
+{
+    SPI_Segment seg;
+    memset(&seg, 0, sizeof(seg));
+    seg.tx  = tx;
+    seg.rx  = rx;
+    seg.len = len;
+    return submit(bus, &seg, 1, cb, ctx);
+}
+
+
+/** @brief Returns the number of requests waiting to be performed.
+ */
+inline int SPI_AsyncQueue::pending()
+{
+    return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+}
+
+
+/** @brief Returns 1 if the request with the given ticket has been performed.
+ */
+inline int SPI_AsyncQueue::isDone(uint32_t seq)
+{
+    uint32_t done = __atomic_load_n(&m_done, __ATOMIC_ACQUIRE);
+    return ((int32_t)(done - seq) >= 0) ? 1 : 0;
+}
+
+
+/** @brief Wait for a request to be performed.
+ *
+ *  @param seq The ticket returned by submit().
+ *  @param timeout_ms Longest time to wait in ms, -1 waits forever.
+ *  @return int: 0 - Done. -1 - Timed out.
+ */
+inline int SPI_AsyncQueue::wait(uint32_t seq, int timeout_ms)
+{
+    struct timespec until;
+
+    if (isDone(seq))
+        return 0;
+
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec  += timeout_ms / 1000;
+        until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&m_lock);
+    while (!isDone(seq) and result == 0)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&m_cond, &m_lock);
+        else if (pthread_cond_timedwait(&m_cond, &m_lock, &until) == ETIMEDOUT)
+            result = -1;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return isDone(seq) ? 0 : -1;
+}
+
+
+/** @brief Perform the requests at the head of the queue for one bus.
+ *
+ *  Takes the first queued request and every request after it for the same
+ *  bus, up to SPI_ASYNC_MERGE segments, and shifts them with one
+ *  rwSegments() call.  Used by the worker thread.  May be called directly
+ *  when no worker has been started.
+ *
+ *  @return int: Number of requests performed, negative on bus failure.
+ */
+inline int SPI_AsyncQueue::dispatch()
+{
+    uint32_t    tail = m_tail;
+    uint32_t    head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+    SPI_Segment seg[SPI_ASYNC_MERGE];
+    int         segs = 0;
+    int         count = 0;
+
+    if (head == tail)
+        return 0;
+
+    ISPI* bus = m_ring[tail & m_mask].bus;
+    while (tail + count != head)
+    {
+        Request& req = m_ring[(tail + count) & m_mask];
+        if (req.bus != bus or segs + req.count > SPI_ASYNC_MERGE)
+            break;
+
+        memcpy(seg + segs, req.seg, req.count * sizeof(SPI_Segment));
+        segs += req.count;
+        // Each request is its own transaction
+        seg[segs-1].csChange = 1;
+        count++;
+    }
+
+    int result = bus->rwSegments(seg, segs);
+    m_calls++;
+    m_merged += count - 1;
+
+    for (int i=0; i<count; i++)
+    {
+        Request& req = m_ring[(tail + i) & m_mask];
+        if (req.cb)
+        {
+            int len = 0;
+            for (int j=0; j<req.count; j++)
+                len += req.seg[j].len;
+            req.cb(req.seq, (result < 0) ? result : len, req.ctx);
+        }
+    }
+
+    uint32_t last = m_ring[(tail + count - 1) & m_mask].seq;
+    __atomic_store_n(&m_tail, tail + count, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&m_lock);
+    __atomic_store_n(&m_done, last, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    return (result < 0) ? result : count;
+}
+
+
+/** @brief Returns the number of rwSegments() calls made by dispatch().
+ */
+inline uint32_t SPI_AsyncQueue::callCount()
+{
+    return m_calls;
+}
+
+
+/** @brief Returns the number of requests that shared a call with the one
+ *  before them.
+ */
+inline uint32_t SPI_AsyncQueue::mergeCount()
+{
+    return m_merged;
+}
+
+
+/*
+ *  Worker thread.  Sleeps until a request is queued and then performs
+ *  requests until the queue is empty.  Drains the queue before exiting on
+ *  stop().
+ */
+inline void* SPI_AsyncQueue::threadMain(void* arg)
+{
+    SPI_AsyncQueue* self = (SPI_AsyncQueue*)arg;
+
+    while (1)
+    {
+        while (sem_wait(&self->m_work) != 0 and errno == EINTR)
+            ;
+
+        while (self->pending())
+            self->dispatch();
+
+        if (!__atomic_load_n(&self->m_run, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    return NULL;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // SPI_ASYNC_H
@@ -0,0 +1,668 @@
+#ifndef SPI_BUSMGR_H
+#define SPI_BUSMGR_H
+
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <string>
+#include <vector>
+#include "ispi.h"
+#include "fs_spi.h"
+
+enum SPI_BUSMGR_CONST
+{
+    SPI_BUSMGR_SPIN  = 200      // Lock polls before sleeping
+};
+
+
+class SPI_BusMgr;
+class SPI_Handle;
+
+
+/** @brief One bus device shared by the handles attached to it.
+ */
+typedef struct SPI_BusPort
+{
+    ISPI*       bus;
+    FS_SPI*     fs;             // Same as bus when created from a file name
+    int         own;            // Deleted with the manager
+    std::string name;
+    SPI_Handle* owner;          // Handle whose settings the bus has
+} SPI_BusPort;
+
+
+/** @brief Per-device view of a bus shared through an SPI_BusMgr
+ *
+ *  Implements ISPI so any driver can use it in place of its own bus object.
+ *  Mode, word size, clock and data line widths belong to the handle; they
+ *  are applied to the shared bus only when this handle takes the bus over
+ *  from another one, or after they were changed.  Every transfer holds the
+ *  manager's lock for its duration.
+ *
+ *  lock() and unlock() hold the bus across several transfers, e.g. for a
+ *  read-modify-write that another device must not split.  They nest, and
+ *  transfers inside them do not take the lock again.
+ *
+ *  A handle belongs to its manager.  Pass it to drivers by reference, a
+ *  driver given a pointer would delete it.  One handle is meant for one
+ *  thread; give each thread its own handle.
+ */
+class SPI_Handle : public ISPI
+{
+    friend class SPI_BusMgr;
+
+protected:
+    SPI_BusMgr*     m_mgr;
+    SPI_BusPort*    m_port;
+    int             m_open;
+    int             m_persist;
+    int             m_depth;        // lock() nesting
+    int             m_dirty;        // Settings changed since last applied
+    uint8_t         m_txWidth;
+    uint8_t         m_rxWidth;
+
+    SPI_Handle(SPI_BusMgr* mgr, SPI_BusPort* port, int speed, int mode);
+
+public:
+    virtual ~SPI_Handle();
+
+    void        lock();
+    void        unlock();
+    int         setWidth(int txWidth, int rxWidth);
+    const std::string& getName();
+
+    // ISPI interface
+    int         openBus();
+    int         closeBus();
+    int         isReady();
+    int         setBPW(int val);
+    int         setSpeed(int val);
+    int         setMode(int val);
+    int         setPersistent(int val);
+    int         isPersistent();
+    int         rwData(uint8_t *data, uint8_t len);
+    uint8_t     rwByte(uint8_t bt);
+    uint16_t    rwWord(uint16_t wd);
+    int         rwFrames(uint8_t *data, int len, uint8_t frameLen);
+    int         rwSegments(const SPI_Segment* seg, int count);
+    int         xferData(const uint8_t* tx, uint8_t* rx, int len);
+    int         writeData(const uint8_t* tx, int len);
+    int         readData(uint8_t* rx, int len);
+
+protected:
+    void        apply();
+};
+
+
+/** @brief Arbitrates SPI buses between several device drivers
+ *
+ *  FS_SPI keeps its settings in the object and writes them to the device on
+ *  open, so two drivers on one spidev node (e.g. with GPIO chip-selects)
+ *  overwrite each other's mode and clock, and drivers on different nodes of
+ *  one controller interleave their messages freely.  The manager owns one
+ *  bus object per spidev node and hands out an SPI_Handle per device.
+ *
+ *  - All buses attached to one manager share a ticket lock, so devices are
+ *    served strictly in the order they asked for the bus.  A waiter polls
+ *    the lock briefly and then sleeps on a futex until the holder releases
+ *    it, so a real-time waiter never keeps a lower priority holder off the
+ *    CPU.  No system call is made when the bus is free or nobody waits.
+ *    Use one manager per controller.
+ *
+ *  - A bus remembers which handle last used it.  Settings are copied from
+ *    the handle to the bus only when a different handle takes over, and
+ *    FS_SPI then issues ioctls only for the settings that actually differ.
+ *    Devices with the same mode and clock switch with no ioctls at all.
+ *
+ *  Buses created from a file name are opened persistent on the first
+ *  openBus() of any of their handles and closed with the manager.
+ */
+class SPI_BusMgr
+{
+    friend class SPI_Handle;
+
+protected:
+    std::vector<SPI_BusPort*>   m_ports;
+    std::vector<SPI_Handle*>    m_handles;
+    uint32_t    m_next;             // Ticket lock
+    uint32_t    m_serving;
+    uint32_t    m_sleepers;         // Waiters asleep on m_serving
+    uint32_t    m_switches;
+    uint32_t    m_acquires;
+    uint32_t    m_contended;
+    int64_t     m_maxWait;
+
+public:
+    SPI_BusMgr();
+    virtual ~SPI_BusMgr();
+
+    SPI_Handle* attach(const std::string& fn, int speed = 500000, int mode = 0);
+    SPI_Handle* attach(ISPI& bus, int speed = 500000, int mode = 0);
+
+    uint32_t    switchCount();
+    uint32_t    acquireCount();
+    uint32_t    contendedCount();
+    int64_t     maxWait_ns();
+    void        resetCounters();
+
+protected:
+    void        acquire();
+    void        release();
+    SPI_BusPort* port(ISPI* bus, const std::string& name);
+    static int64_t now();
+};
+
+
+
+
+
+/*
+ *  Handles are created by SPI_BusMgr::attach().
+ */
+inline SPI_Handle::SPI_Handle(SPI_BusMgr* mgr, SPI_BusPort* port, int speed,
+                              int mode)
+{
+    m_mgr       = mgr;
+    m_port      = port;
+    m_speed     = speed;
+    m_spiMode   = (mode < 0) ? 0 : (mode > 3) ? 3 : mode;
+    m_spiBPW    = 8;
+    m_open      = 0;
+    m_persist   = 0;
+    m_depth     = 0;
+    m_dirty     = 1;
+    m_txWidth   = 1;
+    m_rxWidth   = 1;
+}
+
+
+inline SPI_Handle::~SPI_Handle()
+{}
+
+
+/** @brief Take the bus for this device.
+ *
+ *  Blocks until earlier requests from other handles are done.  Calls nest,
+ *  each must be matched by unlock().
+ */
+inline void SPI_Handle::lock()
+{
+    if (m_depth++ == 0)
+    {
+        m_mgr->acquire();
+        if (m_port->owner != this or m_dirty)
+            apply();
+    }
+}
+
+
+/** @brief Release the bus after the matching lock().
+ */
+inline void SPI_Handle::unlock()
+{
+    if (m_depth > 0 and --m_depth == 0)
+        m_mgr->release();
+}
+
+
+/** @brief Sets the data lines used by writeData() and readData().
+ *
+ *  Only applies to buses created from a file name, see FS_SPI::setWidth().
+ *
+ *  @return int: 0 - Success.  -1 - Invalid or not supported.
+ */
+inline int SPI_Handle::setWidth(int txWidth, int rxWidth)
+{
+    if ((txWidth != 1 or rxWidth != 1) and !m_port->fs)
+        return -1;
+    if ((txWidth != 1 and txWidth != 2 and txWidth != 4) or
+        (rxWidth != 1 and rxWidth != 2 and rxWidth != 4))
+        return -1;
+    m_txWidth = txWidth;
+    m_rxWidth = rxWidth;
+    m_dirty   = 1;
+    return 0;
+}
+
+
+/** @brief Returns the name of the bus this handle uses.
+ */
+inline const std::string& SPI_Handle::getName()
+{
+    return m_port->name;
+}
+
+
+/** @brief Opens the shared bus if it is not open yet.
+ *
+ *  The bus stays open for the other handles when this one is closed.
+ */
+inline int SPI_Handle::openBus()
+{
+    int result = 0;
+
+    lock();
+    if (!m_port->bus->isReady())
+    {
+        m_port->bus->setPersistent(1);
+        result = m_port->bus->openBus();
+    }
+    unlock();
+
+    if (result == 0)
+        m_open = 1;
+    return result;
+}
+
+
+inline int SPI_Handle::closeBus()
+{
+    if (!m_persist)
+        m_open = 0;
+    return 0;
+}
+
+
+inline int SPI_Handle::isReady()
+{
+    return (m_open and m_port->bus->isReady()) ? 1 : 0;
+}
+
+
+/** @brief Sets the word size for this device's transfers.
+ */
+inline int SPI_Handle::setBPW(int val)
+{
+    int result = m_spiBPW;
+    if (val != m_spiBPW)
+    {
+        m_spiBPW = val;
+        m_dirty  = 1;
+    }
+    return result;
+}
+
+
+/** @brief Sets the clock for this device's transfers.
+ */
+inline int SPI_Handle::setSpeed(int val)
+{
+    int result = m_speed;
+    if (val != m_speed)
+    {
+        m_speed = val;
+        m_dirty = 1;
+    }
+    return result;
+}
+
+
+/** @brief Sets the SPI mode for this device's transfers.
+ */
+inline int SPI_Handle::setMode(int val)
+{
+    if (val<0)
+        val = 0;
+    if (val>3)
+        val = 3;
+    int result = m_spiMode;
+    if (val != m_spiMode)
+    {
+        m_spiMode = val;
+        m_dirty   = 1;
+    }
+    return result;
+}
+
+
+/** @brief Keep the handle open across openBus/closeBus pairs.
+ *
+ *  The shared bus itself is always persistent.
+ */
+inline int SPI_Handle::setPersistent(int val)
+{
+    int result = m_persist;
+    m_persist = val ? 1 : 0;
+    return result;
+}
+
+
+inline int SPI_Handle::isPersistent()
+{
+    return m_persist;
+}
+
+
+inline int SPI_Handle::rwData(uint8_t *data, uint8_t len)
+{
+    lock();
+    int result = m_port->bus->rwData(data, len);
+    unlock();
+    return result;
+}
+
+
+inline uint8_t SPI_Handle::rwByte(uint8_t bt)
+{
+    setBPW(8);
+    rwData(&bt, 1);
+    return bt;
+}
+
+
+inline uint16_t SPI_Handle::rwWord(uint16_t wd)
+{
+    setBPW(8);
+    rwData((uint8_t*)&wd, 2);
+    return wd;
+}
+
+
+inline int SPI_Handle::rwFrames(uint8_t *data, int len, uint8_t frameLen)
+{
+    lock();
+    int result = m_port->bus->rwFrames(data, len, frameLen);
+    unlock();
+    return result;
+}
+
+
+inline int SPI_Handle::rwSegments(const SPI_Segment* seg, int count)
+{
+    lock();
+    int result = m_port->bus->rwSegments(seg, count);
+    unlock();
+    return result;
+}
+
+
+inline int SPI_Handle::xferData(const uint8_t* tx, uint8_t* rx, int len)
+{
+    lock();
+    int result = m_port->bus->xferData(tx, rx, len);
+    unlock();
+    return result;
+}
+
+
+inline int SPI_Handle::writeData(const uint8_t* tx, int len)
+{
+    lock();
+    int result = m_port->bus->writeData(tx, len);
+    unlock();
+    return result;
+}
+
+
+inline int SPI_Handle::readData(uint8_t* rx, int len)
+{
+    lock();
+    int result = m_port->bus->readData(rx, len);
+    unlock();
+    return result;
+}
+
+
+/*
+ *  Copy this handle's settings to the shared bus.  Called with the lock held.
+ *  A persistent FS_SPI writes only the ones that differ on its next transfer.
+ */
+inline void SPI_Handle::apply()
+{
+    ISPI* bus = m_port->bus;
+
+    bus->setMode(m_spiMode);
+    bus->setBPW(m_spiBPW);
+    bus->setSpeed(m_speed);
+    if (m_port->fs)
+        m_port->fs->setWidth(m_txWidth, m_rxWidth);
+
+    if (m_port->owner != this)
+        m_mgr->m_switches++;
+    m_port->owner = this;
+    m_dirty = 0;
+}
+
+
+
+
+
+inline SPI_BusMgr::SPI_BusMgr()
+{
+    m_next      = 0;
+    m_serving   = 0;
+    m_sleepers  = 0;
+    resetCounters();
+}
+
+
+/** @brief Deletes every handle and closes the buses created from file names.
+ */
+inline SPI_BusMgr::~SPI_BusMgr()
+{
+    for (unsigned int i=0; i<m_handles.size(); i++)
+        delete m_handles[i];
+
+    for (unsigned int i=0; i<m_ports.size(); i++)
+    {
+        if (m_ports[i]->own)
+        {
+            m_ports[i]->bus->setPersistent(0);
+            delete m_ports[i]->bus;
+        }
+        delete m_ports[i];
+    }
+}
+
+
+/** @brief Returns a handle for a device on a spidev node.
+ *
+ *  Handles attached with the same file name share one open device.
+ *
+ *  @param fn Device file, e.g. /dev/spidev1.0.
+ *  @param speed Clock for this device in Hz.
+ *  @param mode SPI mode for this device.
+ *  @return SPI_Handle*: Owned by the manager.
+ */
+inline SPI_Handle* SPI_BusMgr::attach(const std::string& fn, int speed,
+                                      int mode)
+{
+    SPI_BusPort* p = port(NULL, fn);
+    if (!p)
+    {
+        FS_SPI* fs = new FS_SPI(speed, fn);
+        p = new SPI_BusPort;
+        p->bus   = fs;
+        p->fs    = fs;
+        p->own   = 1;
+        p->name  = fn;
+        p->owner = NULL;
+        m_ports.push_back(p);
+    }
+
+    SPI_Handle* h = new SPI_Handle(this, p, speed, mode);
+    m_handles.push_back(h);
+    return h;
+}
+
+
+/** @brief Returns a handle for a device on an existing bus object.
+ *
+ *  The bus is not owned by the manager and must outlive it.  It must not
+ *  be used directly while handles are in use.
+ *
+ *  @param bus Bus object shared by the handles attached to it.
+ *  @param speed Clock for this device in Hz.
+ *  @param mode SPI mode for this device.
+ *  @return SPI_Handle*: Owned by the manager.
+ */
+inline SPI_Handle* SPI_BusMgr::attach(ISPI& bus, int speed, int mode)
+{
+    SPI_BusPort* p = port(&bus, "");
+    if (!p)
+    {
+        p = new SPI_BusPort;
+        p->bus   = &bus;
+        p->fs    = dynamic_cast<FS_SPI*>(&bus);
+        p->own   = 0;
+        p->name  = "";
+        p->owner = NULL;
+        m_ports.push_back(p);
+    }
+
+    SPI_Handle* h = new SPI_Handle(this, p, speed, mode);
+    m_handles.push_back(h);
+    return h;
+}
+
+
+/** @brief Returns the number of times a bus changed hands between devices.
+ */
+inline uint32_t SPI_BusMgr::switchCount()
+{
+    return m_switches;
+}
+
+
+/** @brief Returns the number of times the lock was taken.
+ */
+inline uint32_t SPI_BusMgr::acquireCount()
+{
+    return m_acquires;
+}
+
+
+/** @brief Returns the number of times a device had to wait for the lock.
+ */
+inline uint32_t SPI_BusMgr::contendedCount()
+{
+    return m_contended;
+}
+
+
+/** @brief Returns the longest wait for the lock in ns.
+ */
+inline int64_t SPI_BusMgr::maxWait_ns()
+{
+    return m_maxWait;
+}
+
+
+/** @brief Zero the counters.  Call with no transfers in progress.
+ */
+inline void SPI_BusMgr::resetCounters()
+{
+    m_switches  = 0;
+    m_acquires  = 0;
+    m_contended = 0;
+    m_maxWait   = 0;
+}
+
+
+/*
+ *  Take a ticket and wait for it to be served, polling briefly and then
+ *  sleeping until release() changes m_serving.  The clock is only read when
+ *  the lock was not free.
+ */
+inline void SPI_BusMgr::acquire()
+{
+    uint32_t ticket = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&m_serving, __ATOMIC_ACQUIRE) != ticket)
+    {
+        int64_t start = now();
+        int spin = 0;
+
+        while (__atomic_load_n(&m_serving, __ATOMIC_ACQUIRE) != ticket)
+        {
+            if (++spin < SPI_BUSMGR_SPIN)
+                continue;
+
+            // Count ourselves before the last look so release() either
+            //  sees us or we see its new value.  The kernel returns at once
+            //  if m_serving has moved on since.
+            __atomic_add_fetch(&m_sleepers, 1, __ATOMIC_SEQ_CST);
+            uint32_t serving = __atomic_load_n(&m_serving, __ATOMIC_SEQ_CST);
+            if (serving != ticket)
+                syscall(SYS_futex, &m_serving, FUTEX_WAIT_PRIVATE, serving,
+                        NULL, NULL, 0);
+            __atomic_sub_fetch(&m_sleepers, 1, __ATOMIC_SEQ_CST);
+        }
+
+        // Counters are only written with the lock held
+        int64_t wait = now() - start;
+        if (wait > m_maxWait)
+            m_maxWait = wait;
+        m_contended++;
+    }
+    m_acquires++;
+}
+
+
+/*
+ *  Serve the next ticket.  Every sleeper is woken since only the one holding
+ *  the next ticket can tell it is its turn.
+ */
+inline void SPI_BusMgr::release()
+{
+    __atomic_store_n(&m_serving, m_serving + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m_sleepers, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &m_serving, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+}
+
+
+/*
+ *  Find the port for a bus object or file name, NULL if there is none.
+ */
+inline SPI_BusPort* SPI_BusMgr::port(ISPI* bus, const std::string& name)
+{
+    for (unsigned int i=0; i<m_ports.size(); i++)
+    {
+        if (bus ? (m_ports[i]->bus == bus)
+                : (m_ports[i]->own and m_ports[i]->name == name))
+            return m_ports[i];
+    }
+    return NULL;
+}
+
+
+/*
+ *  Current CLOCK_MONOTONIC time in ns.
+ */
+inline int64_t SPI_BusMgr::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // SPI_BUSMGR_H
@@ -0,0 +1,763 @@
+#ifndef SPI_TRACE_H
+#define SPI_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "ispi.h"
+
+/*
+ *  Tracing is compiled in only when SPI_TRACE is defined (e.g. -DSPI_TRACE).
+ *  Drivers are given their bus through SPI_TRACE_BUS() and the results read
+ *  with SPI_TRACE_PRINT() / SPI_TRACE_SAVE():
+ *
+ *      FS_SPI spi(5000000, "/dev/spidev1.0");
+ *      L6470  axis(SPI_TRACE_BUS(spi, "axis"));
+ *      ...
+ *      SPI_TRACE_PRINT(stderr);
+ *
+ *  Without SPI_TRACE the macros expand to the bus itself and to nothing and
+ *  the classes below are not defined, so the driver talks to the bus
+ *  directly and no trace code is compiled.
+ */
+#ifdef SPI_TRACE
+#define SPI_TRACE_BUS(bus, name)    (*SPI_Trace::attach((bus), (name)))
+#define SPI_TRACE_PRINT(file)       SPI_Trace::printAll(file)
+#define SPI_TRACE_SAVE(file)        SPI_Trace::saveAll(file)
+#define SPI_TRACE_RESET()           SPI_Trace::resetAll()
+#else
+#define SPI_TRACE_BUS(bus, name)    (bus)
+#define SPI_TRACE_PRINT(file)       ((void)0)
+#define SPI_TRACE_SAVE(file)        ((void)0)
+#define SPI_TRACE_RESET()           ((void)0)
+#endif
+
+
+#ifdef SPI_TRACE
+
+enum SPI_TRACE_CONST
+{
+    SPI_TRACE_DEPTH     = 4096,     // Default ring size in records, 2^n
+    SPI_TRACE_SUB_BITS  = 4,        // Histogram sub-buckets per power of 2
+    SPI_TRACE_SUB       = 1 << SPI_TRACE_SUB_BITS,
+    SPI_TRACE_MAX_BITS  = 40,       // Largest value kept exactly, ~18 min in ns
+    SPI_TRACE_BUCKETS   = (SPI_TRACE_MAX_BITS - SPI_TRACE_SUB_BITS + 1)
+                          * SPI_TRACE_SUB,
+    SPI_TRACE_VERSION   = 1         // Binary trace format
+};
+
+
+enum SPI_TRACE_OP
+{
+    SPI_TRACE_OPEN      = 0,
+    SPI_TRACE_CLOSE     = 1,
+    SPI_TRACE_RW_DATA   = 2,        // rwData, rwByte, rwWord
+    SPI_TRACE_RW_FRAMES = 3,
+    SPI_TRACE_SEGMENTS  = 4,
+    SPI_TRACE_XFER      = 5,
+    SPI_TRACE_WRITE     = 6,
+    SPI_TRACE_READ      = 7,
+    SPI_TRACE_SET_MODE  = 8,        // Settings changes, bytes holds the value
+    SPI_TRACE_SET_SPEED = 9,
+    SPI_TRACE_SET_BPW   = 10,
+    SPI_TRACE_OPS       = 11
+};
+
+
+/** @brief One traced bus call, as stored in the ring and the binary dump.
+ */
+typedef struct SPI_TraceRecord
+{
+    uint64_t    time;       // CLOCK_MONOTONIC ns when the call started
+    uint32_t    latency;    // ns spent in the call, saturates at 2^32-1
+    int32_t     result;     // Value the call returned
+    uint32_t    bytes;      // Bytes requested, or the new setting
+    uint8_t     op;         // SPI_TRACE_OP
+    uint8_t     pad[3];
+} SPI_TraceRecord;
+
+
+/** @brief Latency histogram with log-linear buckets
+ *
+ *  Values are kept in SPI_TRACE_SUB buckets per power of two, in the manner
+ *  of an HDR histogram, so any percentile is within 1/SPI_TRACE_SUB (6%) of
+ *  the true value from nanoseconds up to minutes with a fixed, small table.
+ *  Recording is a few shifts and an increment.  Count, sum, min and max are
+ *  exact.
+ */
+class SPI_Histogram
+{
+protected:
+    uint64_t    m_bucket[SPI_TRACE_BUCKETS];
+    uint64_t    m_count;
+    uint64_t    m_sum;
+    uint64_t    m_min;
+    uint64_t    m_max;
+
+public:
+    SPI_Histogram();
+
+    void        record(uint64_t val);
+    void        reset();
+
+    uint64_t    count();
+    uint64_t    min();
+    uint64_t    max();
+    double      mean();
+    uint64_t    percentile(double pct);
+
+protected:
+    static int      index(uint64_t val);
+    static uint64_t highest(int idx);
+};
+
+
+/** @brief ISPI wrapper that traces every call made through it
+ *
+ *  Forwards each call to the wrapped bus and records its start time,
+ *  duration, byte count and result into a ring of SPI_TraceRecord, and the
+ *  duration into a histogram per kind of call.  Changes of mode, speed and
+ *  word size are recorded as events; FS_SPI writes them to the device in
+ *  the next openBus() or transfer, so their ioctl time shows up there.
+ *
+ *  The ring keeps the latest records and can be printed or written out in
+ *  binary (a header of magic "SPITRACE", version, record size and count,
+ *  then the records oldest first) while tracing continues.  A record being
+ *  written during a dump may come out torn.
+ *
+ *  Wrappers are normally made with SPI_TRACE_BUS(), which keeps them in a
+ *  list for printAll()/saveAll() and removes them from the build when
+ *  SPI_TRACE is not defined.  Like the bus, a wrapper must be used from one
+ *  thread at a time.
+ */
+class SPI_Trace : public ISPI
+{
+protected:
+    ISPI*           m_bus;
+    std::string     m_name;
+    std::vector<SPI_TraceRecord> m_ring;
+    uint32_t        m_mask;
+    uint32_t        m_head;         // Records written since reset
+    SPI_Histogram   m_hist[SPI_TRACE_OPS];
+    uint64_t        m_bytes[SPI_TRACE_OPS];
+
+public:
+    SPI_Trace(ISPI& bus, const std::string& name, int depth = SPI_TRACE_DEPTH);
+    virtual ~SPI_Trace();
+
+    static SPI_Trace* attach(ISPI& bus, const std::string& name);
+    static void printAll(FILE* f);
+    static void saveAll(FILE* f);
+    static void resetAll();
+
+    ISPI*       getBus();
+    const std::string& getName();
+    SPI_Histogram& histogram(int op);
+    uint64_t    byteCount(int op);
+    uint32_t    recordCount();
+    int         getRecords(SPI_TraceRecord* buf, int max);
+
+    void        print(FILE* f);
+    int         save(FILE* f);
+    void        reset();
+
+    // ISPI interface
+    int         openBus();
+    int         closeBus();
+    int         isReady();
+    int         setBPW(int val);
+    int         setSpeed(int val);
+    int         setMode(int val);
+    int         setPersistent(int val);
+    int         isPersistent();
+    int         rwData(uint8_t *data, uint8_t len);
+    uint8_t     rwByte(uint8_t bt);
+    uint16_t    rwWord(uint16_t wd);
+    int         rwFrames(uint8_t *data, int len, uint8_t frameLen);
+    int         rwSegments(const SPI_Segment* seg, int count);
+    int         xferData(const uint8_t* tx, uint8_t* rx, int len);
+    int         writeData(const uint8_t* tx, int len);
+    int         readData(uint8_t* rx, int len);
+
+protected:
+    void        record(int op, uint64_t start, uint32_t bytes, int result);
+    static std::vector<SPI_Trace*>& registry();
+    static const char* opName(int op);
+    static uint64_t now();
+
+private:
+    SPI_Trace(const SPI_Trace&);
+    SPI_Trace& operator=(const SPI_Trace&);
+};
+
+
+
+
+
+inline SPI_Histogram::SPI_Histogram()
+{
+    reset();
+}
+
+
+/** @brief Add a value.
+ */
+inline void SPI_Histogram::record(uint64_t val)
+{
+    m_bucket[index(val)]++;
+    m_count++;
+    m_sum += val;
+    if (val < m_min)
+        m_min = val;
+    if (val > m_max)
+        m_max = val;
+}
+
+
+/** @brief Remove every value.
+ */
+inline void SPI_Histogram::reset()
+{
+    memset(m_bucket, 0, sizeof(m_bucket));
+    m_count = 0;
+    m_sum   = 0;
+    m_min   = ~(uint64_t)0;
+    m_max   = 0;
+}
+
+
+/** @brief Returns the number of values recorded.
+ */
+inline uint64_t SPI_Histogram::count()
+{
+    return m_count;
+}
+
+
+/** @brief Returns the smallest value, 0 if none.
+ */
+inline uint64_t SPI_Histogram::min()
+{
+    return m_count ? m_min : 0;
+}
+
+
+/** @brief Returns the largest value, 0 if none.
+ */
+inline uint64_t SPI_Histogram::max()
+{
+    return m_max;
+}
+
+
+/** @brief Returns the mean value, 0 if none.
+ */
+inline double SPI_Histogram::mean()
+{
+    return m_count ? (double)m_sum / m_count : 0;
+}
+
+
+/** @brief Returns the value below or at which a percentage of values fall.
+ *
+ *  The result is the top of the bucket holding that value, clamped to the
+ *  largest value recorded.
+ *
+ *  @param pct Percentage, 0 to 100.
+ */
+inline uint64_t SPI_Histogram::percentile(double pct)
+{
+    if (!m_count)
+        return 0;
+
+    uint64_t want = (uint64_t)(pct / 100 * m_count + 0.5);
+    if (want < 1)
+        want = 1;
+    if (want > m_count)
+        want = m_count;
+
+    uint64_t seen = 0;
+    for (int i=0; i<SPI_TRACE_BUCKETS; i++)
+    {
+        seen += m_bucket[i];
+        if (seen >= want)
+        {
+            uint64_t val = highest(i);
+            return (val > m_max) ? m_max : val;
+        }
+    }
+    return m_max;
+}
+
+
+/*
+ *  Bucket for a value.  Values below SPI_TRACE_SUB have a bucket each, above
+ *  that each power of two is split into SPI_TRACE_SUB equal buckets.
+ */
+inline int SPI_Histogram::index(uint64_t val)
+{
+    if (val < (uint64_t)SPI_TRACE_SUB)
+        return (int)val;
+    if (val >> SPI_TRACE_MAX_BITS)
+        return SPI_TRACE_BUCKETS - 1;
+
+    int msb = 63 - __builtin_clzll(val);
+    int shift = msb - SPI_TRACE_SUB_BITS;
+    return (shift + 1) * SPI_TRACE_SUB +
+           (int)((val >> shift) & (SPI_TRACE_SUB - 1));
+}
+
+
+/*
+ *  Largest value that falls in a bucket.
+ */
+inline uint64_t SPI_Histogram::highest(int idx)
+{
+    if (idx < SPI_TRACE_SUB)
+        return idx;
+
+    int shift = idx / SPI_TRACE_SUB - 1;
+    uint64_t low = (uint64_t)(SPI_TRACE_SUB + idx % SPI_TRACE_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+
+
+
+
+/** @brief Wrap a bus.
+ *
+ *  @param bus The bus to trace, must outlive the wrapper.
+ *  @param name Shown in the printed report.
+ *  @param depth Number of records kept, rounded up to a power of 2.
+ */
+inline SPI_Trace::SPI_Trace(ISPI& bus, const std::string& name, int depth)
+{
+    uint32_t size = 2;
+    while ((int)size < depth)
+        size <<= 1;
+
+    m_bus   = &bus;
+    m_name  = name;
+    m_ring.resize(size);
+    m_mask  = size - 1;
+    m_speed   = 0;
+    m_spiMode = 0;
+    m_spiBPW  = 0;
+    reset();
+}
+
+
+inline SPI_Trace::~SPI_Trace()
+{}
+
+
+/** @brief Returns a wrapper for a bus, kept in the list used by printAll().
+ *
+ *  The same wrapper is returned for the same bus.  Wrappers in the list
+ *  are never deleted.  Call during setup, not while other threads trace.
+ */
+inline SPI_Trace* SPI_Trace::attach(ISPI& bus, const std::string& name)
+{
+    std::vector<SPI_Trace*>& list = registry();
+    for (unsigned int i=0; i<list.size(); i++)
+    {
+        if (list[i]->m_bus == &bus)
+            return list[i];
+    }
+
+    SPI_Trace* t = new SPI_Trace(bus, name);
+    list.push_back(t);
+    return t;
+}
+
+
+/** @brief Print the report of every wrapper made by attach().
+ */
+inline void SPI_Trace::printAll(FILE* f)
+{
+    std::vector<SPI_Trace*>& list = registry();
+    for (unsigned int i=0; i<list.size(); i++)
+        list[i]->print(f);
+}
+
+
+/** @brief Write the binary trace of every wrapper made by attach().
+ */
+inline void SPI_Trace::saveAll(FILE* f)
+{
+    std::vector<SPI_Trace*>& list = registry();
+    for (unsigned int i=0; i<list.size(); i++)
+        list[i]->save(f);
+}
+
+
+/** @brief Reset every wrapper made by attach().
+ */
+inline void SPI_Trace::resetAll()
+{
+    std::vector<SPI_Trace*>& list = registry();
+    for (unsigned int i=0; i<list.size(); i++)
+        list[i]->reset();
+}
+
+
+/** @brief Returns the wrapped bus.
+ */
+inline ISPI* SPI_Trace::getBus()
+{
+    return m_bus;
+}
+
+
+/** @brief Returns the name given to the wrapper.
+ */
+inline const std::string& SPI_Trace::getName()
+{
+    return m_name;
+}
+
+
+/** @brief Returns the latency histogram (ns) for a kind of call.
+ *
+ *  @param op SPI_TRACE_OP, out of range values give the rwData histogram.
+ */
+inline SPI_Histogram& SPI_Trace::histogram(int op)
+{
+    if (op < 0 or op >= SPI_TRACE_OPS)
+        op = SPI_TRACE_RW_DATA;
+    return m_hist[op];
+}
+
+
+/** @brief Returns the bytes moved by a kind of call.
+ */
+inline uint64_t SPI_Trace::byteCount(int op)
+{
+    if (op < 0 or op >= SPI_TRACE_OPS)
+        return 0;
+    return m_bytes[op];
+}
+
+
+/** @brief Returns the number of records written since the last reset.
+ *
+ *  Only the latest ring size records are kept.
+ */
+inline uint32_t SPI_Trace::recordCount()
+{
+    return m_head;
+}
+
+
+/** @brief Copy the kept records, oldest first.
+ *
+ *  @param buf Destination.
+ *  @param max Most records to copy, the latest are copied if there are more.
+ *  @return int: Number of records copied.
+ */
+inline int SPI_Trace::getRecords(SPI_TraceRecord* buf, int max)
+{
+    uint32_t head  = m_head;
+    uint32_t count = (head > m_mask + 1) ? m_mask + 1 : head;
+    if (max < 0)
+        max = 0;
+    if (count > (uint32_t)max)
+        count = max;
+
+    for (uint32_t i=0; i<count; i++)
+        buf[i] = m_ring[(head - count + i) & m_mask];
+    return count;
+}
+
+
+/** @brief Print latency percentiles and byte counts for each kind of call.
+ */
+inline void SPI_Trace::print(FILE* f)
+{
+    fprintf(f, "SPI trace %s: %u records\n", m_name.c_str(), m_head);
+    fprintf(f, "  %-10s %8s %10s %8s %8s %8s %8s %8s %8s (us)\n", "op",
+            "count", "bytes", "min", "p50", "p90", "p99", "p99.9", "max");
+
+    for (int op=0; op<SPI_TRACE_OPS; op++)
+    {
+        SPI_Histogram& h = m_hist[op];
+        if (!h.count())
+            continue;
+
+        fprintf(f, "  %-10s %8llu %10llu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+                opName(op), (unsigned long long)h.count(),
+                (unsigned long long)m_bytes[op], h.min() / 1000.0,
+                h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+                h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+                h.max() / 1000.0);
+    }
+}
+
+
+/** @brief Write the kept records in binary, oldest first.
+ *
+ *  @return int: Number of records written, -1 on a write failure.
+ */
+inline int SPI_Trace::save(FILE* f)
+{
+    std::vector<SPI_TraceRecord> buf(m_mask + 1);
+    uint32_t hdr[3];
+
+    int count = getRecords(&buf[0], buf.size());
+    hdr[0] = SPI_TRACE_VERSION;
+    hdr[1] = sizeof(SPI_TraceRecord);
+    hdr[2] = count;
+
+    if (fwrite("SPITRACE", 8, 1, f) != 1 or
+        fwrite(hdr, sizeof(hdr), 1, f) != 1)
+        return -1;
+    if (count and fwrite(&buf[0], sizeof(SPI_TraceRecord), count, f) !=
+                  (size_t)count)
+        return -1;
+    return count;
+}
+
+
+/** @brief Clear the records, histograms and byte counts.
+ */
+inline void SPI_Trace::reset()
+{
+    m_head = 0;
+    for (int op=0; op<SPI_TRACE_OPS; op++)
+    {
+        m_hist[op].reset();
+        m_bytes[op] = 0;
+    }
+}
+
+
+inline int SPI_Trace::openBus()
+{
+    uint64_t start = now();
+    int result = m_bus->openBus();
+    record(SPI_TRACE_OPEN, start, 0, result);
+    return result;
+}
+
+
+inline int SPI_Trace::closeBus()
+{
+    uint64_t start = now();
+    int result = m_bus->closeBus();
+    record(SPI_TRACE_CLOSE, start, 0, result);
+    return result;
+}
+
+
+inline int SPI_Trace::isReady()
+{
+    return m_bus->isReady();
+}
+
+
+inline int SPI_Trace::setBPW(int val)
+{
+    int result = m_bus->setBPW(val);
+    if (val != m_spiBPW)
+        record(SPI_TRACE_SET_BPW, now(), val, result);
+    m_spiBPW = val;
+    return result;
+}
+
+
+inline int SPI_Trace::setSpeed(int val)
+{
+    int result = m_bus->setSpeed(val);
+    if (val != m_speed)
+        record(SPI_TRACE_SET_SPEED, now(), val, result);
+    m_speed = val;
+    return result;
+}
+
+
+inline int SPI_Trace::setMode(int val)
+{
+    int result = m_bus->setMode(val);
+    if (val != m_spiMode)
+        record(SPI_TRACE_SET_MODE, now(), val, result);
+    m_spiMode = val;
+    return result;
+}
+
+
+inline int SPI_Trace::setPersistent(int val)
+{
+    return m_bus->setPersistent(val);
+}
+
+
+inline int SPI_Trace::isPersistent()
+{
+    return m_bus->isPersistent();
+}
+
+
+inline int SPI_Trace::rwData(uint8_t *data, uint8_t len)
+{
+    uint64_t start = now();
+    int result = m_bus->rwData(data, len);
+    record(SPI_TRACE_RW_DATA, start, len, result);
+    return result;
+}
+
+
+inline uint8_t SPI_Trace::rwByte(uint8_t bt)
+{
+    uint64_t start = now();
+    uint8_t result = m_bus->rwByte(bt);
+    record(SPI_TRACE_RW_DATA, start, 1, result);
+    return result;
+}
+
+
+inline uint16_t SPI_Trace::rwWord(uint16_t wd)
+{
+    uint64_t start = now();
+    uint16_t result = m_bus->rwWord(wd);
+    record(SPI_TRACE_RW_DATA, start, 2, result);
+    return result;
+}
+
+
+inline int SPI_Trace::rwFrames(uint8_t *data, int len, uint8_t frameLen)
+{
+    uint64_t start = now();
+    int result = m_bus->rwFrames(data, len, frameLen);
+    record(SPI_TRACE_RW_FRAMES, start, len, result);
+    return result;
+}
+
+
+inline int SPI_Trace::rwSegments(const SPI_Segment* seg, int count)
+{
+    uint32_t len = 0;
+    for (int i=0; i<count; i++)
+        len += seg[i].len;
+
+    uint64_t start = now();
+    int result = m_bus->rwSegments(seg, count);
+    record(SPI_TRACE_SEGMENTS, start, len, result);
+    return result;
+}
+
+
+inline int SPI_Trace::xferData(const uint8_t* tx, uint8_t* rx, int len)
+{
+    uint64_t start = now();
+    int result = m_bus->xferData(tx, rx, len);
+    record(SPI_TRACE_XFER, start, len, result);
+    return result;
+}
+
+
+inline int SPI_Trace::writeData(const uint8_t* tx, int len)
+{
+    uint64_t start = now();
+    int result = m_bus->writeData(tx, len);
+    record(SPI_TRACE_WRITE, start, len, result);
+    return result;
+}
+
+
+inline int SPI_Trace::readData(uint8_t* rx, int len)
+{
+    uint64_t start = now();
+    int result = m_bus->readData(rx, len);
+    record(SPI_TRACE_READ, start, len, result);
+    return result;
+}
+
+
+/*
+ *  Store a record and add its latency to the histogram for its kind.
+ */
+inline void SPI_Trace::record(int op, uint64_t start, uint32_t bytes,
+                              int result)
+{
+    uint64_t lat = now() - start;
+    SPI_TraceRecord& r = m_ring[m_head & m_mask];
+
+    r.time    = start;
+    r.latency = (lat > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : (uint32_t)lat;
+    r.result  = result;
+    r.bytes   = bytes;
+    r.op      = op;
+    memset(r.pad, 0, sizeof(r.pad));
+    __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELEASE);
+
+    m_hist[op].record(lat);
+    m_bytes[op] += bytes;
+}
+
+
+/*
+ *  Wrappers made by attach().  A function static so the list is shared by
+ *  every file that includes this header.
+ */
+inline std::vector<SPI_Trace*>& SPI_Trace::registry()
+{
+    static std::vector<SPI_Trace*> list;
+    return list;
+}
+
+
+/*
+ *  Name of a kind of call for the report.
+ */
+inline const char* SPI_Trace::opName(int op)
+{
+    static const char* names[SPI_TRACE_OPS] =
+    {
+        "open", "close", "rwData", "rwFrames", "segments", "xfer",
+        "write", "read", "mode", "speed", "bpw"
+    };
+    return (op >= 0 and op < SPI_TRACE_OPS) ? names[op] : "?";
+}
+
+
+/*
+ *  Current CLOCK_MONOTONIC time in ns.
+ */
+inline uint64_t SPI_Trace::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif // SPI_TRACE
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // SPI_TRACE_H
@@ -0,0 +1,295 @@
+#ifndef L6470_CHAIN_H
+#define L6470_CHAIN_H
+
+#include <stdint.h>
+#include <vector>
+#include "l6470-support.h"
+#include "ispi.h"
+
+enum L6470_CHAIN_CONST
+{
+    L6470_CHAIN_SLOT_RESERVE = 64   // Bytes reserved per slot up front
+};
+
+
+/** @brief Transport for a group of L6470 chips daisy-chained on one chip-select
+ *
+ *  When several L6470 chips share a chip-select in a daisy chain every byte
+ *  time on the bus is a frame of one byte per chip.  This class owns the SPI
+ *  object for the chain and keeps a staging buffer for each device slot.
+ *  Commands for any number of slots are staged and then shifted out together
+ *  by transfer(), with slots that have nothing (or less) to send padded with
+ *  NOP bytes.  The replies from each chip are returned in the slot buffers.
+ *
+ *  Slot 0 is the chip whose SDI is wired to the master MOSI, slot count()-1 is
+ *  the chip whose SDO is wired to the master MISO.
+ *
+ *  L6470 objects are attached to a slot with the L6470(L6470Chain&, int)
+ *  constructor, in which case their commands are sent through the chain with
+ *  NOPs for the other devices.
+ */
+class L6470Chain
+{
+protected:
+    ISPI*   m_bus;
+    int     m_ownBus;
+    int     m_busPersist;
+    int     m_count;
+    int     m_sent;
+    std::vector< std::vector<uint8_t> > m_slots;
+    std::vector<uint8_t>                m_frame;
+
+public:
+    L6470Chain(ISPI& bus, int count);
+    L6470Chain(ISPI* p_bus, int count);
+    virtual ~L6470Chain();
+
+    int         count();
+    int         stage(int slot, const uint8_t* buf, int len);
+    int         transfer();
+    int         xfer(int slot, uint8_t* buf, int len);
+    void        clear();
+    uint8_t*    response(int slot);
+    int         responseLen(int slot);
+
+protected:
+    void        init(int count);
+
+private:
+    L6470Chain(const L6470Chain&);              // Disable copy constructor
+    L6470Chain& operator=(const L6470Chain&);   // Disable assignment operator
+};
+
+
+
+
+
+/** @brief Creates a chain using an already created SPI bus object.
+ *
+ *  The SPI object is owned elsewhere and must remain valid for the life of
+ *  the chain.
+ *
+ *  @param bus A reference to an existing object implementing ISPI interface
+ *  @param count The number of L6470 chips in the chain.
+ */
+inline L6470Chain::L6470Chain(ISPI& bus, int count)
+{
+    m_bus       = &bus;
+    m_ownBus    = 0;
+    init(count);
+}
+
+
+/** @brief Creates a chain using a dynamicly created SPI bus object.
+ *
+ *  The chain takes ownership of the SPI object and deletes it when destroyed.
+ *
+ *  @param p_bus A pointer to dynamic object implementing ISPI interface.
+ *  @param count The number of L6470 chips in the chain.
+ */
+inline L6470Chain::L6470Chain(ISPI* p_bus, int count)
+{
+    m_bus       = p_bus;
+    m_ownBus    = p_bus ? 1 : 0;
+    init(count);
+}
+
+
+/** @brief Destroys the chain and cleans up a dynamically created SPI bus.
+ */
+inline L6470Chain::~L6470Chain()
+{
+    if (m_ownBus)
+        delete m_bus;
+    else if (m_bus)
+        m_bus->setPersistent(m_busPersist);
+}
+
+
+/** @brief Returns the number of device slots in the chain.
+ */
+inline int L6470Chain::count()
+{
+    return m_count;
+}
+
+
+/** @brief Append command bytes to a device slot for the next transfer.
+ *
+ *  Staging after a transfer discards the replies of that transfer.
+ *
+ *  @param slot The device position in the chain.
+ *  @param buf The bytes to send to the device.
+ *  @param len Number of bytes in buf.
+ *  @return int: 0 - Success. -1 - Invalid slot.
+ */
+inline int L6470Chain::stage(int slot, const uint8_t* buf, int len)
+{
+    if (slot < 0 or slot >= m_count)
+        return -1;
+
+    if (m_sent)
+        clear();
+
+    m_slots[slot].insert(m_slots[slot].end(), buf, buf+len);
+    return 0;
+}
+
+
+/** @brief Shift the staged bytes of all slots to the chain.
+ *
+ *  Byte n of every slot is sent in the same chip-select frame.  Slots shorter
+ *  than the longest one are padded with NOPs.  The slot buffers are replaced
+ *  with the bytes each chip returned and can be read with response().
+ *
+ *  @return int: Negative on bus failure.
+ */
+inline int L6470Chain::transfer()
+{
+    int result  = 0;
+    int frames  = 0;
+
+    if (!m_bus)
+        return -1;
+
+    for (int i=0; i<m_count; i++)
+    {
+        if ((int)m_slots[i].size() > frames)
+            frames = m_slots[i].size();
+    }
+
+    if (frames == 0)
+        return 0;
+
+    // The first byte of a frame is shifted through to the last chip in the
+    //  chain so slots are packed in reverse order.
+    m_frame.assign(frames * m_count, dSPIN_NOP);
+    for (int i=0; i<m_count; i++)
+    {
+        int pos = m_count - 1 - i;
+        for (unsigned int n=0; n<m_slots[i].size(); n++)
+            m_frame[n*m_count + pos] = m_slots[i][n];
+    }
+
+    m_bus->openBus();
+    result = m_bus->rwFrames(&m_frame[0], frames * m_count, m_count);
+    m_bus->closeBus();
+
+    for (int i=0; i<m_count; i++)
+    {
+        int pos = m_count - 1 - i;
+        m_slots[i].resize(frames);
+        for (int n=0; n<frames; n++)
+            m_slots[i][n] = m_frame[n*m_count + pos];
+    }
+
+    m_sent = 1;
+    return result;
+}
+
+
+/** @brief Send a command to a single device with NOPs for the rest.
+ *
+ *  Anything already staged for other slots goes out in the same transfer.
+ *  The buffer is overwritten with the bytes the device returned.
+ *
+ *  @param slot The device position in the chain.
+ *  @param buf The bytes to send to the device.
+ *  @param len Number of bytes in buf.
+ *  @return int: Negative on failure.
+ */
+inline int L6470Chain::xfer(int slot, uint8_t* buf, int len)
+{
+    int result = stage(slot, buf, len);
+    if (result < 0)
+        return result;
+
+    result = transfer();
+    for (int n=0; n<len; n++)
+        buf[n] = m_slots[slot][n];
+
+    return result;
+}
+
+
+/** @brief Discard all staged bytes and replies.
+ */
+inline void L6470Chain::clear()
+{
+    for (int i=0; i<m_count; i++)
+        m_slots[i].clear();
+    m_sent = 0;
+}
+
+
+/** @brief Returns the bytes a device returned in the last transfer.
+ *
+ *  @param slot The device position in the chain.
+ *  @return uint8_t*: Pointer to responseLen(slot) bytes or NULL.
+ */
+inline uint8_t* L6470Chain::response(int slot)
+{
+    if (slot < 0 or slot >= m_count or m_slots[slot].empty())
+        return NULL;
+    return &m_slots[slot][0];
+}
+
+
+/** @brief Returns the number of bytes available from response().
+ */
+inline int L6470Chain::responseLen(int slot)
+{
+    if (slot < 0 or slot >= m_count)
+        return 0;
+    return m_slots[slot].size();
+}
+
+
+/*
+ *  Common construction.  Sets the bus up for the L6470 and sizes the slots.
+ */
+inline void L6470Chain::init(int count)
+{
+    m_count      = (count > 0) ? count : 1;
+    m_sent       = 0;
+    m_busPersist = 0;
+    m_slots.resize(m_count);
+    for (int i=0; i<m_count; i++)
+        m_slots[i].reserve(L6470_CHAIN_SLOT_RESERVE);
+    m_frame.reserve(L6470_CHAIN_SLOT_RESERVE * m_count);
+
+    if (m_bus)
+    {
+        m_bus->setMode(3);
+        m_bus->setBPW(8);
+        m_busPersist = m_bus->setPersistent(1);
+        m_bus->openBus();
+    }
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_CHAIN_H
@@ -0,0 +1,450 @@
+#ifndef L6470_DISPATCH_H
+#define L6470_DISPATCH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <vector>
+#include "l6470.h"
+#include "l6470-chain.h"
+
+enum L6470_DISPATCH_CONST
+{
+    L6470_DISPATCH_DEPTH = 64,  // Default queue depth, rounded up to 2^n
+    L6470_DISPATCH_BATCH = 32   // Most requests coalesced into one transfer
+};
+
+
+/** @brief Callback invoked by the dispatch thread when a request completes.
+ *
+ *  @param seq The ticket returned by submit().
+ *  @param result Result of the transfer, negative on failure.
+ *  @param rsp The bytes the device returned for the request.
+ *  @param len Number of bytes in rsp.
+ *  @param ctx The context pointer given to submit().
+ */
+typedef void (*L6470DoneCallback)(uint32_t seq, int result, const uint8_t* rsp,
+                                  int len, void* ctx);
+
+
+/** @brief Asynchronous command queue for the L6470 chips of one chain
+ *
+ *  Commands are queued by the control loop and shifted out on a dedicated
+ *  dispatch thread so the loop never waits on the bus.  The queue is a
+ *  lock-free single producer / single consumer ring: only one thread may call
+ *  submit() and only the dispatch thread (or dispatch() when no thread is
+ *  running) removes requests.
+ *
+ *  Each time the dispatch thread wakes it takes up to L6470_DISPATCH_BATCH
+ *  queued requests and stages them on the chain.  Requests for different
+ *  devices share chip-select frames and requests for the same device are sent
+ *  back to back in queue order, all in a single chained transfer.
+ *
+ *  Commands for an axis are captured with the axis staging buffer:
+ *
+ *      axis.beginStage();
+ *      axis.run(dSPIN_FWD, 200);
+ *      uint32_t seq = queue.submit(axis, done, this);
+ *
+ *  Completion is reported to the request callback on the dispatch thread and
+ *  can be waited for with wait() or checked with isDone().  Commands queued
+ *  from an axis are fed to its position estimate on the dispatch thread once
+ *  they have been sent, so read estPosition() of that axis only after its
+ *  requests are done.  While a queue is running the chain and its axes must
+ *  not be used directly from other threads.  Programs using this class must
+ *  link with -lpthread.
+ */
+class L6470Dispatcher
+{
+protected:
+    struct Request
+    {
+        uint32_t            seq;
+        L6470*              axis;       // Fed the bytes once sent, may be NULL
+        int                 slot;
+        int                 len;
+        uint8_t             data[L6470_STAGE_LEN];
+        L6470DoneCallback   cb;
+        void*               ctx;
+    };
+
+    L6470Chain*             m_chain;
+    std::vector<Request>    m_ring;
+    uint32_t                m_mask;
+    uint32_t                m_head;     // Next slot written by the producer
+    uint32_t                m_tail;     // Next slot read by the consumer
+    uint32_t                m_seq;      // Last ticket handed out
+    uint32_t                m_done;     // Last ticket completed
+    uint32_t                m_batches;
+    int                     m_run;
+    int                     m_started;
+    pthread_t               m_thread;
+    sem_t                   m_work;
+    pthread_mutex_t         m_lock;
+    pthread_cond_t          m_cond;
+
+public:
+    L6470Dispatcher(L6470Chain& chain, int depth = L6470_DISPATCH_DEPTH);
+    virtual ~L6470Dispatcher();
+
+    int         start();
+    void        stop();
+    int         isRunning();
+
+    uint32_t    submit(L6470& axis, L6470DoneCallback cb = NULL,
+                       void* ctx = NULL);
+    uint32_t    submit(int slot, const uint8_t* buf, int len,
+                       L6470DoneCallback cb = NULL, void* ctx = NULL);
+
+    int         pending();
+    int         isDone(uint32_t seq);
+    int         wait(uint32_t seq, int timeout_ms = -1);
+    int         dispatch();
+    uint32_t    batchCount();
+
+protected:
+    uint32_t    push(L6470* axis, int slot, const uint8_t* buf, int len,
+                     L6470DoneCallback cb, void* ctx);
+    static void* threadMain(void* arg);
+
+private:
+    L6470Dispatcher(const L6470Dispatcher&);
+    L6470Dispatcher& operator=(const L6470Dispatcher&);
+};
+
+
+
+
+
+/** @brief Creates a stopped queue for a chain.
+ *
+ *  @param chain The chain to send the queued commands on.
+ *  @param depth Number of requests the queue holds, rounded up to a power of 2.
+ */
+inline L6470Dispatcher::L6470Dispatcher(L6470Chain& chain, int depth)
+{
+    uint32_t size = 2;
+    while ((int)size < depth)
+        size <<= 1;
+
+    m_chain     = &chain;
+    m_ring.resize(size);
+    m_mask      = size - 1;
+    m_head      = 0;
+    m_tail      = 0;
+    m_seq       = 0;
+    m_done      = 0;
+    m_batches   = 0;
+    m_run       = 0;
+    m_started   = 0;
+    sem_init(&m_work, 0, 0);
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+
+/** @brief Stops the dispatch thread, sending anything still queued.
+ */
+inline L6470Dispatcher::~L6470Dispatcher()
+{
+    stop();
+    sem_destroy(&m_work);
+    pthread_mutex_destroy(&m_lock);
+    pthread_cond_destroy(&m_cond);
+}
+
+
+/** @brief Start the dispatch thread.
+ *
+ *  @return int: 0 - Success. Negative on failure.
+ */
+inline int L6470Dispatcher::start()
+{
+    if (m_started)
+        return 0;
+
+    __atomic_store_n(&m_run, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&m_thread, NULL, threadMain, this) != 0)
+    {
+        m_run = 0;
+        return -1;
+    }
+
+    m_started = 1;
+    return 0;
+}
+
+
+/** @brief Stop the dispatch thread once the queue is empty.
+ */
+inline void L6470Dispatcher::stop()
+{
+    if (!m_started)
+        return;
+
+    __atomic_store_n(&m_run, 0, __ATOMIC_RELEASE);
+    sem_post(&m_work);
+    pthread_join(m_thread, NULL);
+    m_started = 0;
+}
+
+
+/** @brief Returns 1 if the dispatch thread is running.
+ */
+inline int L6470Dispatcher::isRunning()
+{
+    return m_started;
+}
+
+
+/** @brief Queue the commands staged on an axis.
+ *
+ *  The staged bytes are moved into the queue and the axis stops staging.  The
+ *  axis position estimate is fed the bytes once the dispatch thread has sent
+ *  them.
+ *
+ *  @param axis An axis attached to this queue's chain with staged commands.
+ *  @param cb Called on the dispatch thread when the commands have been sent.
+ *  @param ctx Pointer passed back to the callback.
+ *  @return uint32_t: Ticket for the request, 0 if the queue is full or the
+ *                    axis is not on this chain.
+ */
+inline uint32_t L6470Dispatcher::submit(L6470& axis, L6470DoneCallback cb,
+                                        void* ctx)
+{
+    if (axis.getChain() != m_chain)
+        return 0;
+
+    uint32_t seq = push(&axis, axis.getSlot(), axis.stagedData(),
+                        axis.stagedLen(), cb, ctx);
+    if (seq)
+        axis.cancelStage();
+    return seq;
+}
+
+
+/** @brief Queue raw command bytes for a device slot.
+ *
+ *  @param slot The device position in the chain.
+ *  @param buf The bytes to send.
+ *  @param len Number of bytes, at most L6470_STAGE_LEN.
+ *  @param cb Called on the dispatch thread when the bytes have been sent.
+ *  @param ctx Pointer passed back to the callback.
+ *  @return uint32_t: Ticket for the request, 0 if the queue is full or the
+ *                    request is invalid.
+ */
+inline uint32_t L6470Dispatcher::submit(int slot, const uint8_t* buf, int len,
+                                        L6470DoneCallback cb, void* ctx)
+{
+    return push(NULL, slot, buf, len, cb, ctx);
+}
+
+
+/** @brief Returns the number of requests waiting to be sent.
+ */
+inline int L6470Dispatcher::pending()
+{
+    return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+}
+
+
+/** @brief Returns 1 if the request with the given ticket has been sent.
+ */
+inline int L6470Dispatcher::isDone(uint32_t seq)
+{
+    uint32_t done = __atomic_load_n(&m_done, __ATOMIC_ACQUIRE);
+    return ((int32_t)(done - seq) >= 0) ? 1 : 0;
+}
+
+
+/** @brief Wait for a request to be sent.
+ *
+ *  @param seq The ticket returned by submit().
+ *  @param timeout_ms Longest time to wait in ms, -1 waits forever.
+ *  @return int: 0 - Sent. -1 - Timed out.
+ */
+inline int L6470Dispatcher::wait(uint32_t seq, int timeout_ms)
+{
+    struct timespec until;
+
+    if (isDone(seq))
+        return 0;
+
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec  += timeout_ms / 1000;
+        until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&m_lock);
+    while (!isDone(seq) and result == 0)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&m_cond, &m_lock);
+        else if (pthread_cond_timedwait(&m_cond, &m_lock, &until) == ETIMEDOUT)
+            result = -1;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return isDone(seq) ? 0 : -1;
+}
+
+
+/** @brief Send one batch of queued requests on the calling thread.
+ *
+ *  Used by the dispatch thread.  May be called directly when no dispatch
+ *  thread has been started.
+ *
+ *  @return int: Number of requests sent, negative on bus failure.
+ */
+inline int L6470Dispatcher::dispatch()
+{
+    uint32_t    tail = m_tail;
+    uint32_t    head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+    int         count = head - tail;
+    int         offset[L6470_DISPATCH_BATCH];
+    std::vector<int> slotLen(m_chain->count(), 0);
+
+    if (count == 0)
+        return 0;
+    if (count > L6470_DISPATCH_BATCH)
+        count = L6470_DISPATCH_BATCH;
+
+    m_chain->clear();
+    for (int i=0; i<count; i++)
+    {
+        Request& req = m_ring[(tail + i) & m_mask];
+        offset[i] = slotLen[req.slot];
+        slotLen[req.slot] += req.len;
+        m_chain->stage(req.slot, req.data, req.len);
+    }
+
+    int result = m_chain->transfer();
+    m_batches++;
+
+    for (int i=0; i<count; i++)
+    {
+        Request& req = m_ring[(tail + i) & m_mask];
+        if (req.axis and result >= 0)
+            req.axis->commandsSent(req.data, req.len);
+        if (req.cb)
+        {
+            uint8_t* rsp = m_chain->response(req.slot);
+            req.cb(req.seq, result, rsp ? rsp + offset[i] : NULL,
+                   rsp ? req.len : 0, req.ctx);
+        }
+    }
+
+    uint32_t last = m_ring[(tail + count - 1) & m_mask].seq;
+    __atomic_store_n(&m_tail, tail + count, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&m_lock);
+    __atomic_store_n(&m_done, last, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    return (result < 0) ? result : count;
+}
+
+
+/** @brief Returns the number of chained transfers made by dispatch().
+ */
+inline uint32_t L6470Dispatcher::batchCount()
+{
+    return m_batches;
+}
+
+
+/*
+ *  Adds a request to the ring.  Only the producer thread calls this.
+ */
+inline uint32_t L6470Dispatcher::push(L6470* axis, int slot, const uint8_t* buf,
+                                      int len, L6470DoneCallback cb, void* ctx)
+{
+    if (slot < 0 or slot >= m_chain->count() or len < 0 or
+        len > L6470_STAGE_LEN)
+        return 0;
+
+    uint32_t head = m_head;
+    uint32_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+    if (head - tail > m_mask)
+        return 0;
+
+    Request& req = m_ring[head & m_mask];
+    req.seq  = ++m_seq;
+    if (req.seq == 0)
+        req.seq = ++m_seq;
+    req.axis = axis;
+    req.slot = slot;
+    req.len  = len;
+    req.cb   = cb;
+    req.ctx  = ctx;
+    if (len)
+        memcpy(req.data, buf, len);
+
+    __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+    sem_post(&m_work);
+    return req.seq;
+}
+
+
+/*
+ *  Dispatch thread.  Sleeps until a request is queued and then sends batches
+ *  until the queue is empty.  Drains the queue before exiting on stop().
+ */
+inline void* L6470Dispatcher::threadMain(void* arg)
+{
+    L6470Dispatcher* self = (L6470Dispatcher*)arg;
+
+    while (1)
+    {
+        while (sem_wait(&self->m_work) != 0 and errno == EINTR)
+            ;
+
+        while (self->pending())
+            self->dispatch();
+
+        if (!__atomic_load_n(&self->m_run, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    return NULL;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_DISPATCH_H
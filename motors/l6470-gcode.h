@@ -0,0 +1,799 @@
+#ifndef L6470_GCODE_H
+#define L6470_GCODE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <vector>
+#include "l6470.h"
+#include "l6470-group.h"
+#include "l6470-kinematics.h"
+
+enum L6470_GCODE_CONST
+{
+    L6470_GCODE_DEPTH = 16,     // Default depth of each pipeline queue
+    L6470_GCODE_LINE  = 256,    // Longest line accepted
+    L6470_GCODE_AXES  = 6       // Coordinate words X Y Z A B C
+};
+
+
+enum L6470_GCODE_OP
+{
+    L6470_GC_NONE  = 0,         // Nothing but modal words
+    L6470_GC_G0    = 1,         // Rapid move
+    L6470_GC_G1    = 2,         // Linear move at the feed rate
+    L6470_GC_G4    = 3,         // Dwell, P ms or S sec
+    L6470_GC_G28   = 4,         // Return to the zero position
+    L6470_GC_G92   = 5,         // Set the current position
+    L6470_GC_M2    = 6,         // End of program (also M30)
+    L6470_GC_M17   = 7,         // Energise the motors
+    L6470_GC_M18   = 8,         // Release the motors (also M84)
+    L6470_GC_M400  = 9,         // Wait for motion to finish
+    L6470_GC_END   = 10         // End of input, internal
+};
+
+
+/** @brief One parsed line of G-code.
+ */
+typedef struct L6470GCodeBlock
+{
+    int         op;             // L6470_GCODE_OP
+    uint32_t    line;           // Line number in the input
+    uint32_t    mask;           // Bit n set when coordinate n was given
+    double      coord[L6470_GCODE_AXES];
+    double      feed;           // F word, units/min, 0 if not given
+    double      dwell;          // G4 time in seconds
+    int8_t      absolute;       // G90 = 1, G91 = 0, -1 if not given
+    int8_t      metric;         // G21 = 1, G20 = 0, -1 if not given
+} L6470GCodeBlock;
+
+
+/** @brief Streaming G-code interpreter for L6470 axes
+ *
+ *  G-code is read a line at a time from a file or pipe and executed through
+ *  an L6470Kinematics.  Work is split over three threads joined by bounded
+ *  queues so a slow read never holds up motion and memory use does not grow
+ *  with the length of the program:
+ *
+ *      parse     Reads lines into L6470GCodeBlocks.
+ *      plan      Applies the modal state (G90/G91, G20/G21, F) and turns
+ *                each block into an absolute move in machine units.
+ *      dispatch  Waits for the axes to finish the previous move and sends
+ *                the next one.
+ *
+ *  There is no lookahead: every block waits for the axes to stop before it
+ *  is sent, so a path made of short G1 segments stops at each vertex.  Use
+ *  L6470Planner on each axis where moves must blend.
+ *
+ *  Supported: G0, G1, G4, G20, G21, G28, G90, G91, G92, M2, M17, M18, M30,
+ *  M84 and M400 with the coordinate words X Y Z A B C (mapped to machine
+ *  coordinates 0-5), F, P and S.  Comments in ( ) or after ; are skipped
+ *  as are N line numbers and * checksums.  Unsupported codes are counted as
+ *  errors and skipped.
+ *
+ *  Machine units are millimetres; G20 scales inches by 25.4.  G0 moves at
+ *  the rate set with setRapid(), or at each axis' own MAX_SPEED if it is 0.
+ *  G28 moves every axis (or the axes named) to machine zero at the rapid
+ *  rate; home the machine first, e.g. with L6470Homing.
+ *
+ *  While a program runs the axes and their bus must not be used from other
+ *  threads.  Programs using this class must link with -lpthread.
+ */
+class L6470GCode
+{
+protected:
+    struct Queue
+    {
+        std::vector<L6470GCodeBlock> ring;
+        uint32_t    head;
+        uint32_t    tail;
+        sem_t       free;
+        sem_t       used;
+    };
+
+    L6470Kinematics*    m_kin;
+    FILE*               m_in;
+    Queue               m_parsed;
+    Queue               m_planned;
+    double              m_rapid;
+    double              m_maxFeed;
+    int                 m_run;
+    int                 m_started;
+    pthread_t           m_thread[3];
+
+    // Planner state, only touched by the plan thread
+    double              m_pos[L6470_GCODE_AXES];
+    double              m_feed;
+    int                 m_absolute;
+    int                 m_metric;
+
+    uint32_t            m_lines;
+    uint32_t            m_moves;
+    uint32_t            m_errors;
+    uint32_t            m_errLine;
+
+public:
+    L6470GCode(L6470Kinematics& kin, int depth = L6470_GCODE_DEPTH);
+    virtual ~L6470GCode();
+
+    void        setRapid(double unitsPerSec);
+    void        setMaxFeed(double unitsPerSec);
+
+    int         start(FILE* in);
+    int         wait();
+    void        stop();
+    int         isRunning();
+
+    uint32_t    lineCount();
+    uint32_t    moveCount();
+    uint32_t    errorCount();
+    uint32_t    lastErrorLine();
+
+    static int  parseLine(const char* text, L6470GCodeBlock& blk);
+
+protected:
+    void        parse();
+    void        plan();
+    void        dispatch();
+    int         execute(const L6470GCodeBlock& blk);
+    int         waitIdle();
+    void        error(uint32_t line);
+    void        push(Queue& q, const L6470GCodeBlock& blk);
+    int         pop(Queue& q, L6470GCodeBlock& blk);
+    void        resetQueues();
+    static void* parseMain(void* arg);
+    static void* planMain(void* arg);
+    static void* dispatchMain(void* arg);
+
+private:
+    L6470GCode(const L6470GCode&);
+    L6470GCode& operator=(const L6470GCode&);
+};
+
+
+
+
+
+/** @brief Creates a stopped interpreter.
+ *
+ *  @param kin The kinematics of the machine to drive.
+ *  @param depth Number of blocks each pipeline queue holds.
+ */
+inline L6470GCode::L6470GCode(L6470Kinematics& kin, int depth)
+{
+    if (depth < 1)
+        depth = 1;
+
+    m_kin       = &kin;
+    m_in        = NULL;
+    m_rapid     = 0;
+    m_maxFeed   = 0;
+    m_run       = 0;
+    m_started   = 0;
+    m_lines     = 0;
+    m_moves     = 0;
+    m_errors    = 0;
+    m_errLine   = 0;
+
+    Queue* q[2] = {&m_parsed, &m_planned};
+    for (int i=0; i<2; i++)
+    {
+        q[i]->ring.resize(depth);
+        q[i]->head = 0;
+        q[i]->tail = 0;
+        sem_init(&q[i]->free, 0, depth);
+        sem_init(&q[i]->used, 0, 0);
+    }
+}
+
+
+/** @brief Stops a running program.
+ */
+inline L6470GCode::~L6470GCode()
+{
+    stop();
+    sem_destroy(&m_parsed.free);
+    sem_destroy(&m_parsed.used);
+    sem_destroy(&m_planned.free);
+    sem_destroy(&m_planned.used);
+}
+
+
+/** @brief Set the speed of G0 and G28 moves.
+ *
+ *  @param unitsPerSec Speed along the path, 0 to let every axis move at its
+ *                     own MAX_SPEED.
+ */
+inline void L6470GCode::setRapid(double unitsPerSec)
+{
+    m_rapid = (unitsPerSec > 0) ? unitsPerSec : 0;
+}
+
+
+/** @brief Limit the feed rate of G1 moves.
+ *
+ *  @param unitsPerSec Highest feed rate accepted, 0 for no limit.
+ */
+inline void L6470GCode::setMaxFeed(double unitsPerSec)
+{
+    m_maxFeed = (unitsPerSec > 0) ? unitsPerSec : 0;
+}
+
+
+/** @brief Start running a program.
+ *
+ *  The planner starts from the current machine position in absolute metric
+ *  mode with no feed rate.
+ *
+ *  @param in Stream to read the program from.  It is not closed.
+ *  @return int: 0 - Success. Negative on failure or if already running.
+ */
+inline int L6470GCode::start(FILE* in)
+{
+    if (m_started or !in)
+        return -1;
+
+    for (int i=0; i<L6470_GCODE_AXES; i++)
+        m_pos[i] = 0;
+    if (m_kin->count() > L6470_GCODE_AXES or m_kin->getPosition(m_pos) < 0)
+        return -1;
+
+    // A stopped program leaves blocks and extra semaphore counts behind
+    resetQueues();
+
+    m_in       = in;
+    m_feed     = 0;
+    m_absolute = 1;
+    m_metric   = 1;
+    m_lines    = 0;
+    m_moves    = 0;
+    m_errors   = 0;
+    m_errLine  = 0;
+    __atomic_store_n(&m_run, 1, __ATOMIC_RELEASE);
+
+    void* (*entry[3])(void*) = {dispatchMain, planMain, parseMain};
+    for (int i=0; i<3; i++)
+    {
+        if (pthread_create(&m_thread[i], NULL, entry[i], this) != 0)
+        {
+            __atomic_store_n(&m_run, 0, __ATOMIC_RELEASE);
+            sem_post(&m_parsed.used);
+            sem_post(&m_planned.used);
+            while (i--)
+                pthread_join(m_thread[i], NULL);
+            resetQueues();
+            return -1;
+        }
+    }
+
+    m_started = 1;
+    return 0;
+}
+
+
+/** @brief Wait for the program to finish.
+ *
+ *  @return int: Number of errors, -1 if no program was started.
+ */
+inline int L6470GCode::wait()
+{
+    if (!m_started)
+        return -1;
+
+    for (int i=0; i<3; i++)
+        pthread_join(m_thread[i], NULL);
+    m_started = 0;
+    return m_errors;
+}
+
+
+/** @brief Abandon the program and soft stop the axes.
+ *
+ *  Blocks still queued are discarded.  A parse thread blocked reading the
+ *  input only sees the request when the read returns.
+ */
+inline void L6470GCode::stop()
+{
+    if (!m_started)
+        return;
+
+    __atomic_store_n(&m_run, 0, __ATOMIC_RELEASE);
+    sem_post(&m_parsed.free);
+    sem_post(&m_parsed.used);
+    sem_post(&m_planned.free);
+    sem_post(&m_planned.used);
+    wait();
+    m_kin->stop();
+}
+
+
+/** @brief Returns 1 while a program is started and not yet waited for.
+ */
+inline int L6470GCode::isRunning()
+{
+    return m_started;
+}
+
+
+/** @brief Returns the number of lines read.
+ */
+inline uint32_t L6470GCode::lineCount()
+{
+    return __atomic_load_n(&m_lines, __ATOMIC_RELAXED);
+}
+
+
+/** @brief Returns the number of moves sent to the axes.
+ */
+inline uint32_t L6470GCode::moveCount()
+{
+    return __atomic_load_n(&m_moves, __ATOMIC_RELAXED);
+}
+
+
+/** @brief Returns the number of lines that could not be executed.
+ */
+inline uint32_t L6470GCode::errorCount()
+{
+    return __atomic_load_n(&m_errors, __ATOMIC_RELAXED);
+}
+
+
+/** @brief Returns the line number of the last error, 0 if none.
+ */
+inline uint32_t L6470GCode::lastErrorLine()
+{
+    return __atomic_load_n(&m_errLine, __ATOMIC_RELAXED);
+}
+
+
+/** @brief Parse one line of G-code.
+ *
+ *  @param text The line, with or without its line end.
+ *  @param blk Receives the block.  blk.line is left unchanged.
+ *  @return int: 1 - A block was parsed.  0 - Blank or comment only.
+ *               -1 - Not understood.
+ */
+inline int L6470GCode::parseLine(const char* text, L6470GCodeBlock& blk)
+{
+    const char* axes = "XYZABC";
+    const char* p = text;
+    int words = 0;
+    int op = -1;
+
+    blk.op       = L6470_GC_NONE;
+    blk.mask     = 0;
+    blk.feed     = 0;
+    blk.dwell    = 0;
+    blk.absolute = -1;
+    blk.metric   = -1;
+    for (int i=0; i<L6470_GCODE_AXES; i++)
+        blk.coord[i] = 0;
+
+    while (*p)
+    {
+        char c = toupper(*p);
+
+        if (isspace(c))
+        {
+            p++;
+            continue;
+        }
+        if (c == ';' or c == '*')
+            break;
+        if (c == '(')
+        {
+            while (*p and *p != ')')
+                p++;
+            if (*p)
+                p++;
+            continue;
+        }
+        if (!isalpha(c))
+            return -1;
+
+        char* end;
+        double val = strtod(p+1, &end);
+        if (end == p+1)
+            return -1;
+        p = end;
+        words++;
+
+        const char* ax = strchr(axes, c);
+        if (ax)
+        {
+            blk.mask |= 1 << (ax - axes);
+            blk.coord[ax - axes] = val;
+            continue;
+        }
+
+        int code = (int)val;
+        switch (c)
+        {
+            case 'N':
+                break;
+            case 'F':
+                blk.feed = val;
+                break;
+            case 'P':
+                blk.dwell = val / 1000;
+                break;
+            case 'S':
+                blk.dwell = val;
+                break;
+            case 'G':
+                if (code != val)
+                    return -1;
+                switch (code)
+                {
+                    case 0:  op = L6470_GC_G0;  break;
+                    case 1:  op = L6470_GC_G1;  break;
+                    case 4:  op = L6470_GC_G4;  break;
+                    case 28: op = L6470_GC_G28; break;
+                    case 92: op = L6470_GC_G92; break;
+                    case 20: blk.metric = 0;    break;
+                    case 21: blk.metric = 1;    break;
+                    case 90: blk.absolute = 1;  break;
+                    case 91: blk.absolute = 0;  break;
+                    default: return -1;
+                }
+                break;
+            case 'M':
+                if (code != val)
+                    return -1;
+                switch (code)
+                {
+                    case 2:
+                    case 30:  op = L6470_GC_M2;   break;
+                    case 17:  op = L6470_GC_M17;  break;
+                    case 18:
+                    case 84:  op = L6470_GC_M18;  break;
+                    case 400: op = L6470_GC_M400; break;
+                    default:  return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (op >= 0)
+        blk.op = op;
+    return words ? 1 : 0;
+}
+
+
+/*
+ *  Parse thread.  Reads the input a line at a time into a fixed buffer and
+ *  queues the blocks.  Lines longer than the buffer are errors.
+ */
+inline void L6470GCode::parse()
+{
+    char text[L6470_GCODE_LINE];
+    uint32_t line = 0;
+    L6470GCodeBlock blk;
+
+    while (__atomic_load_n(&m_run, __ATOMIC_ACQUIRE) and
+           fgets(text, sizeof(text), m_in))
+    {
+        line++;
+        __atomic_store_n(&m_lines, line, __ATOMIC_RELAXED);
+
+        int len = strlen(text);
+        if (len == (int)sizeof(text)-1 and text[len-1] != '\n' and !feof(m_in))
+        {
+            int c;
+            while ((c = fgetc(m_in)) != EOF and c != '\n')
+                ;
+            error(line);
+            continue;
+        }
+
+        int result = parseLine(text, blk);
+        if (result < 0)
+            error(line);
+        if (result <= 0)
+            continue;
+
+        blk.line = line;
+        push(m_parsed, blk);
+        if (blk.op == L6470_GC_M2)
+            break;
+    }
+
+    blk.op   = L6470_GC_END;
+    blk.line = line;
+    push(m_parsed, blk);
+}
+
+
+/*
+ *  Plan thread.  Applies the modal state and converts every block to
+ *  absolute machine coordinates and a feed rate in units/sec.
+ */
+inline void L6470GCode::plan()
+{
+    L6470GCodeBlock blk;
+    int n = m_kin->count();
+
+    while (pop(m_parsed, blk) == 0)
+    {
+        if (blk.absolute >= 0)
+            m_absolute = blk.absolute;
+        if (blk.metric >= 0)
+            m_metric = blk.metric;
+
+        double scale = m_metric ? 1.0 : 25.4;
+        if (blk.feed > 0)
+            m_feed = blk.feed * scale / 60;
+
+        switch (blk.op)
+        {
+            case L6470_GC_NONE:
+                continue;
+
+            case L6470_GC_G0:
+            case L6470_GC_G1:
+            case L6470_GC_G92:
+                if (blk.mask >> n)
+                {
+                    error(blk.line);
+                    continue;
+                }
+                for (int i=0; i<n; i++)
+                {
+                    if (!(blk.mask & (1 << i)))
+                        blk.coord[i] = m_pos[i];
+                    else if (m_absolute or blk.op == L6470_GC_G92)
+                        blk.coord[i] *= scale;
+                    else
+                        blk.coord[i] = m_pos[i] + blk.coord[i] * scale;
+                    m_pos[i] = blk.coord[i];
+                }
+                if (blk.op == L6470_GC_G0)
+                    blk.feed = m_rapid;
+                else if (blk.op == L6470_GC_G1)
+                {
+                    if (m_feed <= 0)
+                    {
+                        error(blk.line);
+                        continue;
+                    }
+                    blk.feed = (m_maxFeed > 0 and m_feed > m_maxFeed) ?
+                               m_maxFeed : m_feed;
+                }
+                break;
+
+            case L6470_GC_G28:
+                // No axis words sends every axis home
+                if (!blk.mask)
+                    blk.mask = (1 << n) - 1;
+                for (int i=0; i<n; i++)
+                {
+                    if (blk.mask & (1 << i))
+                        m_pos[i] = 0;
+                    blk.coord[i] = m_pos[i];
+                }
+                blk.feed = m_rapid;
+                break;
+
+            default:
+                break;
+        }
+
+        push(m_planned, blk);
+        if (blk.op == L6470_GC_END)
+            return;
+    }
+}
+
+
+/*
+ *  Dispatch thread.  Sends each planned block once the axes are free.
+ */
+inline void L6470GCode::dispatch()
+{
+    L6470GCodeBlock blk;
+
+    while (pop(m_planned, blk) == 0)
+    {
+        if (blk.op == L6470_GC_END)
+            return;
+        if (execute(blk) < 0)
+            error(blk.line);
+    }
+}
+
+
+/*
+ *  Carry out one planned block.  The chip refuses a GoTo while the previous
+ *  one is running so every block first waits for the axes to be idle.
+ */
+inline int L6470GCode::execute(const L6470GCodeBlock& blk)
+{
+    L6470Group* group = m_kin->getGroup();
+
+    if (waitIdle() < 0)
+        return -1;
+
+    switch (blk.op)
+    {
+        case L6470_GC_G0:
+        case L6470_GC_G1:
+        case L6470_GC_G28:
+            __atomic_add_fetch(&m_moves, 1, __ATOMIC_RELAXED);
+            return m_kin->moveTo(blk.coord, blk.feed);
+
+        case L6470_GC_G4:
+            usleep((useconds_t)(blk.dwell * 1000000));
+            return 0;
+
+        case L6470_GC_G92:
+        {
+            std::vector<int32_t> steps(group->count());
+            if (steps.empty() or m_kin->toSteps(blk.coord, &steps[0]) < 0)
+                return -1;
+            for (unsigned int i=0; i<steps.size(); i++)
+                group->getAxis(i)->setPosition(steps[i]);
+            return 0;
+        }
+
+        case L6470_GC_M17:
+            group->stage();
+            for (int i=0; i<group->count(); i++)
+                group->getAxis(i)->hardStop();
+            return group->release();
+
+        case L6470_GC_M18:
+            group->stage();
+            for (int i=0; i<group->count(); i++)
+                group->getAxis(i)->softHiZ();
+            return group->release();
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+
+/*
+ *  Wait for every axis to finish its move.  Returns -1 if stopped.
+ */
+inline int L6470GCode::waitIdle()
+{
+    L6470Group* group = m_kin->getGroup();
+
+    for (int i=0; i<group->count(); i++)
+    {
+        while (group->getAxis(i)->waitIdle(100) < 0)
+        {
+            if (!__atomic_load_n(&m_run, __ATOMIC_ACQUIRE))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  Count an error on a line.
+ */
+inline void L6470GCode::error(uint32_t line)
+{
+    __atomic_add_fetch(&m_errors, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_errLine, line, __ATOMIC_RELAXED);
+}
+
+
+/*
+ *  Add a block to a queue, waiting for room.  Each queue has one producer
+ *  and one consumer; the semaphores order the ring accesses.
+ */
+inline void L6470GCode::push(Queue& q, const L6470GCodeBlock& blk)
+{
+    while (sem_wait(&q.free) != 0 and errno == EINTR)
+        ;
+    if (!__atomic_load_n(&m_run, __ATOMIC_ACQUIRE))
+    {
+        sem_post(&q.free);
+        return;
+    }
+
+    q.ring[q.head] = blk;
+    q.head = (q.head + 1) % q.ring.size();
+    sem_post(&q.used);
+}
+
+
+/*
+ *  Take the next block from a queue, waiting for one.  Returns -1 once the
+ *  interpreter is stopped.
+ */
+inline int L6470GCode::pop(Queue& q, L6470GCodeBlock& blk)
+{
+    while (sem_wait(&q.used) != 0 and errno == EINTR)
+        ;
+    if (!__atomic_load_n(&m_run, __ATOMIC_ACQUIRE))
+    {
+        sem_post(&q.used);
+        return -1;
+    }
+
+    blk = q.ring[q.tail];
+    q.tail = (q.tail + 1) % q.ring.size();
+    sem_post(&q.free);
+    return 0;
+}
+
+
+/*
+ *  Empty both queues.  Only called with no pipeline threads running.
+ */
+inline void L6470GCode::resetQueues()
+{
+    Queue* q[2] = {&m_parsed, &m_planned};
+    for (int i=0; i<2; i++)
+    {
+        sem_destroy(&q[i]->free);
+        sem_destroy(&q[i]->used);
+        q[i]->head = 0;
+        q[i]->tail = 0;
+        sem_init(&q[i]->free, 0, q[i]->ring.size());
+        sem_init(&q[i]->used, 0, 0);
+    }
+}
+
+
+inline void* L6470GCode::parseMain(void* arg)
+{
+    ((L6470GCode*)arg)->parse();
+    return NULL;
+}
+
+
+inline void* L6470GCode::planMain(void* arg)
+{
+    ((L6470GCode*)arg)->plan();
+    return NULL;
+}
+
+
+inline void* L6470GCode::dispatchMain(void* arg)
+{
+    ((L6470GCode*)arg)->dispatch();
+    return NULL;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_GCODE_H
@@ -0,0 +1,347 @@
+#ifndef L6470_GROUP_H
+#define L6470_GROUP_H
+
+#include <stdint.h>
+#include <vector>
+#include "l6470.h"
+#include "gpio_pin.h"
+
+enum L6470_GROUP_CONST
+{
+    L6470_GROUP_START_MS = 10       // Default wait for BUSY in measureSkew()
+};
+
+
+/** @brief Coordinated command release for a set of L6470 axes
+ *
+ *  Motion commands for several axes are staged and then released together so
+ *  that the axes start moving at the same time.  Axes attached to the same
+ *  L6470Chain are released in a single chained transfer.  Axes on their own
+ *  chip-select are released back to back from pre-built command buffers.
+ *
+ *  Typical use:
+ *
+ *      group.stage();
+ *      x.gotoPosABS(1000);
+ *      y.gotoPosABS(-250);
+ *      group.release();
+ *
+ *  After release the skew between the first and last command leaving the bus
+ *  is available from getSkew().  Axes on one chain leave in the same frames,
+ *  so between them this skew is 0 by construction.
+ *
+ *  If BUSY pins are bound to the axes (see L6470::bindBusyPin) the actual
+ *  start skew can be measured by calling measureSkew() right after release().
+ *  It polls the pins on the calling thread until every axis reports busy, so
+ *  it is left to the caller; release() itself never waits.
+ */
+class L6470Group
+{
+protected:
+    std::vector<L6470*>     m_axes;
+    std::vector<int64_t>    m_relTime;
+    int64_t                 m_skew;
+    int64_t                 m_startSkew;
+
+public:
+    L6470Group();
+    virtual ~L6470Group();
+
+    int         addAxis(L6470& axis);
+    int         count();
+    L6470*      getAxis(int idx);
+
+    void        stage();
+    int         release();
+    void        cancel();
+
+    int64_t     measureSkew(int timeout_ms = L6470_GROUP_START_MS);
+
+    int64_t     getSkew();
+    int64_t     getStartSkew();
+    int64_t     getReleaseTime(int idx);
+
+protected:
+    int64_t     now();
+};
+
+
+
+
+
+/** @brief Creates an empty group.
+ */
+inline L6470Group::L6470Group()
+{
+    m_skew      = 0;
+    m_startSkew = -1;
+}
+
+
+inline L6470Group::~L6470Group()
+{}
+
+
+/** @brief Add an axis to the group.
+ *
+ *  The axis is not owned by the group and must remain valid for the life of
+ *  the group.
+ *
+ *  @param axis The axis to add.
+ *  @return int: Index of the axis in the group.
+ */
+inline int L6470Group::addAxis(L6470& axis)
+{
+    m_axes.push_back(&axis);
+    m_relTime.push_back(0);
+    return m_axes.size() - 1;
+}
+
+
+/** @brief Returns the number of axes in the group.
+ */
+inline int L6470Group::count()
+{
+    return m_axes.size();
+}
+
+
+/** @brief Returns the axis at the given index or NULL.
+ */
+inline L6470* L6470Group::getAxis(int idx)
+{
+    if (idx < 0 or idx >= (int)m_axes.size())
+        return NULL;
+    return m_axes[idx];
+}
+
+
+/** @brief Start staging commands on every axis in the group.
+ */
+inline void L6470Group::stage()
+{
+    for (unsigned int i=0; i<m_axes.size(); i++)
+        m_axes[i]->beginStage();
+}
+
+
+/** @brief Send the staged commands of every axis.
+ *
+ *  Staged commands of axes sharing a chain are packed into one chained
+ *  transfer.  The remaining axes are flushed one after the other.
+ *
+ *  @return int: Negative if any transfer failed.
+ */
+inline int L6470Group::release()
+{
+    int result = 0;
+    int err = 0;
+    std::vector<L6470Chain*> chains;
+
+    // Pack each chain's axes into its slots
+    for (unsigned int i=0; i<m_axes.size(); i++)
+    {
+        L6470Chain* chain = m_axes[i]->getChain();
+        if (!chain)
+            continue;
+
+        unsigned int c = 0;
+        while (c < chains.size() and chains[c] != chain)
+            c++;
+        if (c == chains.size())
+        {
+            chain->clear();
+            chains.push_back(chain);
+        }
+
+        chain->stage(m_axes[i]->getSlot(), m_axes[i]->stagedData(),
+                     m_axes[i]->stagedLen());
+    }
+
+    for (unsigned int c=0; c<chains.size(); c++)
+    {
+        result = chains[c]->transfer();
+        if (result < 0)
+            err = result;
+
+        int64_t t = now();
+        for (unsigned int i=0; i<m_axes.size(); i++)
+        {
+            if (m_axes[i]->getChain() != chains[c])
+                continue;
+            m_relTime[i] = t;
+            if (result < 0)
+                m_axes[i]->cancelStage();
+            else
+                m_axes[i]->stageSent();
+        }
+    }
+
+    // Axes on their own chip-select
+    for (unsigned int i=0; i<m_axes.size(); i++)
+    {
+        if (m_axes[i]->getChain())
+            continue;
+
+        result = m_axes[i]->flushStage();
+        if (result < 0)
+            err = result;
+        m_relTime[i] = now();
+    }
+
+    m_skew = 0;
+    if (!m_axes.empty())
+    {
+        int64_t first = m_relTime[0];
+        int64_t last  = m_relTime[0];
+        for (unsigned int i=1; i<m_axes.size(); i++)
+        {
+            if (m_relTime[i] < first) first = m_relTime[i];
+            if (m_relTime[i] > last)  last  = m_relTime[i];
+        }
+        m_skew = last - first;
+    }
+
+    m_startSkew = -1;
+    return err;
+}
+
+
+/** @brief Discard the staged commands on every axis.
+ */
+inline void L6470Group::cancel()
+{
+    for (unsigned int i=0; i<m_axes.size(); i++)
+        m_axes[i]->cancelStage();
+}
+
+
+/** @brief Measure the start skew of the last release() from the BUSY pins.
+ *
+ *  Waits on the calling thread for the BUSY output of every axis to go low
+ *  and records when each one did.  Every axis needs a BUSY pin.  Axes that
+ *  share a pin (chained chips often share one open-drain BUSY line) are
+ *  timed once, so the pins must be distinct for the figure to mean anything.
+ *  An axis whose move is empty never goes busy, so the call then takes the
+ *  whole timeout and fails.
+ *
+ *  @param timeout_ms Longest time to wait for all the axes to start.
+ *  @return int64_t: Skew in ns between the first and last pin reporting
+ *                   busy, -1 if a pin is missing, fewer than two distinct
+ *                   pins are bound, or an axis did not start in time.
+ */
+inline int64_t L6470Group::measureSkew(int timeout_ms)
+{
+    std::vector<GPIO_Pin*> pins;
+
+    m_startSkew = -1;
+    for (unsigned int i=0; i<m_axes.size(); i++)
+    {
+        GPIO_Pin* pin = m_axes[i]->getBusyPin();
+        if (!pin)
+            return -1;
+
+        unsigned int p = 0;
+        while (p < pins.size() and pins[p] != pin)
+            p++;
+        if (p == pins.size())
+            pins.push_back(pin);
+    }
+    if (pins.size() < 2)
+        return -1;
+
+    std::vector<int64_t> start(pins.size(), 0);
+    unsigned int pending = pins.size();
+    int64_t deadline = now() + (int64_t)timeout_ms * 1000000;
+
+    while (pending and now() < deadline)
+    {
+        for (unsigned int p=0; p<pins.size(); p++)
+        {
+            // BUSY is open-drain and active low
+            if (!start[p] and pins[p]->get() == GPIO_LOW)
+            {
+                start[p] = now();
+                pending--;
+            }
+        }
+    }
+
+    if (pending)
+        return -1;
+
+    int64_t first = start[0];
+    int64_t last  = start[0];
+    for (unsigned int p=1; p<pins.size(); p++)
+    {
+        if (start[p] < first) first = start[p];
+        if (start[p] > last)  last  = start[p];
+    }
+    m_startSkew = last - first;
+    return m_startSkew;
+}
+
+
+/** @brief Returns the time in ns between the first and last axis release.
+ */
+inline int64_t L6470Group::getSkew()
+{
+    return m_skew;
+}
+
+
+/** @brief Returns the start skew found by the last measureSkew() in ns.
+ *
+ *  @return int64_t: -1 if it was not measured since the last release().
+ */
+inline int64_t L6470Group::getStartSkew()
+{
+    return m_startSkew;
+}
+
+
+/** @brief Returns the CLOCK_MONOTONIC time in ns an axis was released.
+ */
+inline int64_t L6470Group::getReleaseTime(int idx)
+{
+    if (idx < 0 or idx >= (int)m_relTime.size())
+        return 0;
+    return m_relTime[idx];
+}
+
+
+/*
+ *  Current CLOCK_MONOTONIC time in ns.
+ */
+inline int64_t L6470Group::now()
+{
+    return L6470::monotonic();
+}
+
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_GROUP_H
@@ -0,0 +1,397 @@
+#ifndef L6470_HOMING_H
+#define L6470_HOMING_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+#include "l6470.h"
+
+enum L6470_HOMING_RESULT
+{
+    L6470_HOME_OK       = 0,
+    L6470_HOME_TIMEOUT  = -1,   // No stall seen within the time limit
+    L6470_HOME_FAULT    = -2,   // Overcurrent, thermal or UVLO during homing
+    L6470_HOME_FALSE    = -3    // Stall seen during a free run
+};
+
+
+/** @brief Settings for one sensorless homing run.
+ */
+typedef struct L6470HomingConfig
+{
+    uint8_t     dir;            // dSPIN_FWD or dSPIN_REV toward the hard stop
+    float       speed;          // Homing speed in steps/sec
+    uint8_t     stallTh;        // STALL_TH, 31.25mA per count
+    uint8_t     kval;           // KVAL_RUN and KVAL_ACC while homing
+    int32_t     backoff;        // Microsteps to move away after the stall
+    int         blankMs;        // Ignore stalls this long after reaching speed
+    int         timeoutMs;      // Give up after this long
+    int         pollMs;         // STATUS read interval
+} L6470HomingConfig;
+
+
+/** @brief Candidate values tried by L6470Homing::tune().
+ */
+typedef struct L6470HomingSweep
+{
+    std::vector<float>      speeds;     // In order, list fastest first
+    std::vector<uint8_t>    kvals;      // In order, list lowest first
+    std::vector<uint8_t>    stallThs;   // In order, list lowest first
+    int                     freeRunMs;  // Free run used to reject false stalls
+    int                     repeats;    // Homing runs to check repeatability
+    int32_t                 tolerance;  // Allowed spread of the home position
+} L6470HomingSweep;
+
+
+/** @brief Sensorless homing against a hard stop using L6470 stall detection
+ *
+ *  The axis is run toward a hard stop at the homing speed with the stall
+ *  threshold and drive voltage from the config.  When the chip reports step
+ *  loss the motor is hard stopped, the position is reset to zero and the axis
+ *  backs off.  Stalls reported while the motor is still accelerating, and for
+ *  blankMs after reaching speed, are ignored.  STALL_TH, KVAL_RUN and KVAL_ACC
+ *  are put back to their previous values afterwards.
+ *
+ *  tune() sweeps speeds, KVALs and stall thresholds to find the fastest speed
+ *  that homes reliably.  For each speed and KVAL the lowest stall threshold
+ *  that survives a free run away from the stop without a false stall is
+ *  selected and then checked by homing several times and comparing the
+ *  positions found.  The axis must have room to move freeRunMs at each speed
+ *  away from the stop.
+ *
+ *  Step loss is only detected reliably at speeds where the back EMF is large,
+ *  so the homing speed should be well above a few hundred steps/sec.
+ */
+class L6470Homing
+{
+protected:
+    L6470*              m_axis;
+    L6470HomingConfig   m_cfg;
+    int64_t             m_lastTime;
+    int32_t             m_stallPos;
+
+public:
+    L6470Homing(L6470& axis);
+    virtual ~L6470Homing();
+
+    static L6470HomingConfig defaults();
+
+    void        setConfig(const L6470HomingConfig& cfg);
+    const L6470HomingConfig& getConfig();
+
+    int         home();
+    int         home(const L6470HomingConfig& cfg);
+    int         freeRun(const L6470HomingConfig& cfg, int ms);
+    int         tune(const L6470HomingSweep& sweep, L6470HomingConfig& best);
+    int64_t     lastTime();
+    int32_t     stallPosition();
+
+protected:
+    int         runUntilStall(const L6470HomingConfig& cfg, int ms);
+    void        apply(const L6470HomingConfig& cfg);
+};
+
+
+
+
+
+/** @brief Creates a homing routine for an axis using defaults().
+ *
+ *  @param axis The axis to home.  Not owned by this object.
+ */
+inline L6470Homing::L6470Homing(L6470& axis)
+{
+    m_axis     = &axis;
+    m_cfg      = defaults();
+    m_lastTime = 0;
+    m_stallPos = 0;
+}
+
+
+inline L6470Homing::~L6470Homing()
+{}
+
+
+/** @brief Returns a conservative starting configuration.
+ */
+inline L6470HomingConfig L6470Homing::defaults()
+{
+    L6470HomingConfig cfg;
+    cfg.dir       = dSPIN_REV;
+    cfg.speed     = 400;
+    cfg.stallTh   = 0x40;
+    cfg.kval      = 0x29;
+    cfg.backoff   = 0;
+    cfg.blankMs   = 50;
+    cfg.timeoutMs = 10000;
+    cfg.pollMs    = 2;
+    return cfg;
+}
+
+
+/** @brief Set the configuration used by home().
+ */
+inline void L6470Homing::setConfig(const L6470HomingConfig& cfg)
+{
+    m_cfg = cfg;
+}
+
+
+/** @brief Returns the configuration used by home().
+ */
+inline const L6470HomingConfig& L6470Homing::getConfig()
+{
+    return m_cfg;
+}
+
+
+/** @brief Home using the current configuration.
+ *
+ *  @return int: L6470_HOMING_RESULT.
+ */
+inline int L6470Homing::home()
+{
+    return home(m_cfg);
+}
+
+
+/** @brief Run toward the hard stop until a stall and zero the position there.
+ *
+ *  @param cfg Homing settings.
+ *  @return int: L6470_HOMING_RESULT.
+ */
+inline int L6470Homing::home(const L6470HomingConfig& cfg)
+{
+    uint32_t stallTh = m_axis->getParam<dSPIN_STALL_TH>();
+    uint32_t kvalRun = m_axis->getParam<dSPIN_KVAL_RUN>();
+    uint32_t kvalAcc = m_axis->getParam<dSPIN_KVAL_ACC>();
+    int64_t  start   = L6470::monotonic();
+
+    apply(cfg);
+    int result = runUntilStall(cfg, cfg.timeoutMs);
+    m_axis->hardStop();
+
+    m_axis->setParam<dSPIN_STALL_TH>(stallTh);
+    m_axis->setParam<dSPIN_KVAL_RUN>(kvalRun);
+    m_axis->setParam<dSPIN_KVAL_ACC>(kvalAcc);
+
+    if (result == 1)
+    {
+        m_axis->waitIdle(100);
+        m_stallPos = m_axis->getPosition();
+        m_axis->resetPos();
+        if (cfg.backoff)
+        {
+            int32_t away = (cfg.dir == dSPIN_FWD) ? -cfg.backoff : cfg.backoff;
+            m_axis->move(away);
+            m_axis->waitIdle(cfg.timeoutMs);
+        }
+        m_lastTime = L6470::monotonic() - start;
+        return L6470_HOME_OK;
+    }
+
+    m_lastTime = L6470::monotonic() - start;
+    return (result < 0) ? L6470_HOME_FAULT : L6470_HOME_TIMEOUT;
+}
+
+
+/** @brief Run away from the hard stop with homing settings to test for false
+ *  stalls.
+ *
+ *  @param cfg Homing settings.  The run is in the opposite direction.
+ *  @param ms Length of the run after the blanking time.
+ *  @return int: L6470_HOME_OK if no stall was seen, otherwise
+ *               L6470_HOME_FALSE or L6470_HOME_FAULT.
+ */
+inline int L6470Homing::freeRun(const L6470HomingConfig& cfg, int ms)
+{
+    L6470HomingConfig away = cfg;
+    away.dir = (cfg.dir == dSPIN_FWD) ? dSPIN_REV : dSPIN_FWD;
+
+    uint32_t stallTh = m_axis->getParam<dSPIN_STALL_TH>();
+    uint32_t kvalRun = m_axis->getParam<dSPIN_KVAL_RUN>();
+    uint32_t kvalAcc = m_axis->getParam<dSPIN_KVAL_ACC>();
+
+    apply(away);
+    int result = runUntilStall(away, ms + away.blankMs);
+    m_axis->softStop();
+    m_axis->waitIdle(away.timeoutMs);
+
+    m_axis->setParam<dSPIN_STALL_TH>(stallTh);
+    m_axis->setParam<dSPIN_KVAL_RUN>(kvalRun);
+    m_axis->setParam<dSPIN_KVAL_ACC>(kvalAcc);
+
+    if (result < 0)
+        return L6470_HOME_FAULT;
+    return (result == 1) ? L6470_HOME_FALSE : L6470_HOME_OK;
+}
+
+
+/** @brief Find the fastest reliable homing settings.
+ *
+ *  Speeds, KVALs and thresholds are tried in the order given.  For each
+ *  speed and KVAL the stall thresholds are tried until a free run shows no
+ *  false stall.  That combination is then homed sweep.repeats times and
+ *  accepted if the home positions agree within sweep.tolerance.  The first
+ *  accepted combination is returned.
+ *
+ *  @param sweep The candidate values.
+ *  @param best Receives the accepted settings.  Fields not swept are taken
+ *              from the current configuration.
+ *  @return int: L6470_HOME_OK if settings were found, L6470_HOME_TIMEOUT if
+ *               none worked, L6470_HOME_FAULT on a chip fault.
+ */
+inline int L6470Homing::tune(const L6470HomingSweep& sweep,
+                             L6470HomingConfig& best)
+{
+    for (unsigned int s=0; s<sweep.speeds.size(); s++)
+    {
+        for (unsigned int k=0; k<sweep.kvals.size(); k++)
+        {
+            L6470HomingConfig cfg = m_cfg;
+            cfg.speed = sweep.speeds[s];
+            cfg.kval  = sweep.kvals[k];
+
+            // Most sensitive threshold that does not trip in free air
+            int found = 0;
+            for (unsigned int t=0; t<sweep.stallThs.size() and !found; t++)
+            {
+                cfg.stallTh = sweep.stallThs[t];
+                int result = freeRun(cfg, sweep.freeRunMs);
+                if (result == L6470_HOME_FAULT)
+                    return result;
+                found = (result == L6470_HOME_OK);
+            }
+            if (!found)
+                continue;
+
+            // Check the stop is found, and found in the same place each time.
+            //  After the first run each stall position is relative to the
+            //  previous home and should be close to zero.
+            int     ok = 1;
+            int32_t spread = 0;
+            int32_t ret = (int32_t)(cfg.speed * m_axis->getMicroSteps() / 4);
+            for (int r=0; r<sweep.repeats and ok; r++)
+            {
+                if (r > 0)
+                {
+                    m_axis->move((cfg.dir == dSPIN_FWD) ? -ret : ret);
+                    m_axis->waitIdle(cfg.timeoutMs);
+                }
+
+                L6470HomingConfig run = cfg;
+                run.backoff = 0;
+                int result = home(run);
+                if (result == L6470_HOME_FAULT)
+                    return result;
+                if (result != L6470_HOME_OK)
+                    ok = 0;
+                else if (r > 0 and abs(m_stallPos) > spread)
+                    spread = abs(m_stallPos);
+            }
+
+            if (ok and spread <= sweep.tolerance)
+            {
+                best = cfg;
+                return L6470_HOME_OK;
+            }
+        }
+    }
+
+    return L6470_HOME_TIMEOUT;
+}
+
+
+/** @brief Returns the time in ns the last home() took.
+ */
+inline int64_t L6470Homing::lastTime()
+{
+    return m_lastTime;
+}
+
+
+/** @brief Returns where the last home() stalled, relative to the position
+ *  zero before it was reset.
+ */
+inline int32_t L6470Homing::stallPosition()
+{
+    return m_stallPos;
+}
+
+
+/*
+ *  Start running and watch STATUS for step loss once at speed.
+ *  Returns 1 on a stall, 0 on timeout and -1 on a fault.
+ */
+inline int L6470Homing::runUntilStall(const L6470HomingConfig& cfg, int ms)
+{
+    int64_t deadline = L6470::monotonic() + (int64_t)ms * 1000000;
+    int64_t atSpeed  = 0;
+
+    m_axis->getStatus();        // Clear latched flags
+    m_axis->run(cfg.dir, cfg.speed);
+
+    while (L6470::monotonic() < deadline)
+    {
+        usleep(cfg.pollMs * 1000);
+        m_axis->getStatus();
+        const L6470Status& st = m_axis->lastStatus();
+
+        if (st.overCurrent or st.thShutdown or st.uvlo)
+            return -1;
+
+        if (st.motStatus != 3)
+        {
+            atSpeed = 0;
+            continue;
+        }
+        if (!atSpeed)
+            atSpeed = st.time;
+
+        if (st.time - atSpeed < (int64_t)cfg.blankMs * 1000000)
+            continue;
+
+        if (st.stallA or st.stallB)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ *  Load the stall threshold and drive voltage for a run.
+ */
+inline void L6470Homing::apply(const L6470HomingConfig& cfg)
+{
+    m_axis->setParam<dSPIN_STALL_TH>(cfg.stallTh);
+    m_axis->setParam<dSPIN_KVAL_RUN>(cfg.kval);
+    m_axis->setParam<dSPIN_KVAL_ACC>(cfg.kval);
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_HOMING_H
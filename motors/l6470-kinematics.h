@@ -0,0 +1,557 @@
+#ifndef L6470_KINEMATICS_H
+#define L6470_KINEMATICS_H
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "l6470.h"
+#include "l6470-group.h"
+
+enum L6470_KIN_TYPE
+{
+    L6470_KIN_CARTESIAN  = 0,   // Each coordinate drives its own axis
+    L6470_KIN_COREXY     = 1,   // Axes 0/1 are the A/B belts, others direct
+    L6470_KIN_DIFF_DRIVE = 2    // Axes 0/1 are the left/right wheels
+};
+
+enum L6470_KIN_SAVED
+{
+    L6470_KIN_SAVED_SPEED = 0x01,   // MAX_SPEED replaced by a feed rate
+    L6470_KIN_SAVED_ACC   = 0x02    // ACC and DEC replaced by a feed rate
+};
+
+
+/** @brief Maps machine coordinates onto the axes of an L6470Group
+ *
+ *  Targets are given in machine units (mm, inches, metres...) and turned
+ *  into per-axis step commands which are staged on every axis and released
+ *  together by the group, so axes on a shared L6470Chain receive them in one
+ *  transfer.  Each axis has a scale in full steps per unit; the axis'
+ *  microstep mode and invert() setting are taken into account when a
+ *  position is sent so machine coordinates stay the same whatever the step
+ *  mode or wiring.
+ *
+ *  Cartesian: coordinate i drives axis i.
+ *
+ *  CoreXY: axis 0 = X + Y and axis 1 = X - Y.  Any further coordinates
+ *  (Z, ...) drive their axes directly.
+ *
+ *  Differential drive: the group holds exactly the left and right wheels.
+ *  The two coordinates are the distance travelled along the path and the
+ *  heading in radians, so velocities are (linear, angular) and the wheels
+ *  move by d -/+ heading * track / 2.  Set the wheel separation with
+ *  setTrackWidth() in the same units as the wheel scales.
+ *
+ *  moveTo() and moveBy() scale each axis' speed and acceleration so every
+ *  axis arrives at the same time and the tool moves in a straight line in
+ *  machine coordinates.  The axis' own MAX_SPEED, ACC and DEC are saved the
+ *  first time a feed rate changes them and written back by the next move or
+ *  setVelocity() that does not use them, so without a feed rate the axes
+ *  move with their own settings.  ACC and DEC are only written while every
+ *  axis is stopped, as the chip refuses them while moving; a move that
+ *  needs them fails with -1 otherwise.
+ *
+ *  Positions are read back with estPosition(), so with enableEstimate()
+ *  called on each axis reading them causes no bus traffic beyond the axes'
+ *  resync interval.
+ */
+class L6470Kinematics
+{
+protected:
+    L6470Group*         m_group;
+    int                 m_type;
+    std::vector<double> m_scale;    // Full steps per unit for each axis
+    double              m_track;
+    double              m_accel;    // Path acceleration, 0 to leave as set
+    std::vector<L6470StepRate>  m_ownSpeed;     // Axis settings replaced by
+    std::vector<L6470StepAccel> m_ownAcc;       //  a feed rate
+    std::vector<L6470StepAccel> m_ownDec;
+    std::vector<int>    m_saved;    // L6470_KIN_SAVED bits per axis
+
+public:
+    L6470Kinematics(L6470Group& group, int type = L6470_KIN_CARTESIAN);
+    virtual ~L6470Kinematics();
+
+    L6470Group* getGroup();
+    int         getType();
+    int         count();
+    int         setScale(int axis, double stepsPerUnit);
+    double      getScale(int axis);
+    void        setTrackWidth(double width);
+    void        setAccel(double unitsPerSec2);
+
+    int         toJoints(const double* coord, double* joint);
+    int         fromJoints(const double* joint, double* coord);
+    int         toSteps(const double* coord, int32_t* steps);
+
+    int         moveTo(const double* coord, double feed = 0);
+    int         moveBy(const double* delta, double feed = 0);
+    int         setVelocity(const double* vel);
+    int         getPosition(double* coord);
+    int         stop();
+
+protected:
+    int         jointCount();
+    int         moveJoints(const double* from, const double* to, double feed);
+    int         allStopped();
+    void        ownSettings(int axis, int which);
+};
+
+
+
+
+
+/** @brief Creates the kinematics for a group of axes.
+ *
+ *  Every scale starts at 1 full step per unit.  Add the axes to the group
+ *  before creating this object.
+ *
+ *  @param group The axes to drive, in coordinate order.
+ *  @param type One of L6470_KIN_TYPE.
+ */
+inline L6470Kinematics::L6470Kinematics(L6470Group& group, int type)
+{
+    m_group = &group;
+    m_type  = type;
+    m_track = 1;
+    m_accel = 0;
+    m_scale.assign(group.count(), 1.0);
+    m_ownSpeed.resize(group.count());
+    m_ownAcc.resize(group.count());
+    m_ownDec.resize(group.count());
+    m_saved.assign(group.count(), 0);
+}
+
+
+inline L6470Kinematics::~L6470Kinematics()
+{}
+
+
+/** @brief Returns the group of axes driven.
+ */
+inline L6470Group* L6470Kinematics::getGroup()
+{
+    return m_group;
+}
+
+
+/** @brief Returns the kinematic type (L6470_KIN_TYPE).
+ */
+inline int L6470Kinematics::getType()
+{
+    return m_type;
+}
+
+
+/** @brief Returns the number of machine coordinates.
+ */
+inline int L6470Kinematics::count()
+{
+    return (m_type == L6470_KIN_DIFF_DRIVE) ? 2 : jointCount();
+}
+
+
+/** @brief Set the scale of one axis.
+ *
+ *  @param axis Index of the axis in the group.
+ *  @param stepsPerUnit Full steps of the motor per unit of axis travel.
+ *  @return int: 0 on success, -1 on a bad index or zero scale.
+ */
+inline int L6470Kinematics::setScale(int axis, double stepsPerUnit)
+{
+    if (axis < 0 or axis >= jointCount() or stepsPerUnit == 0)
+        return -1;
+    m_scale[axis] = stepsPerUnit;
+    return 0;
+}
+
+
+/** @brief Returns the full steps per unit of one axis, 0 on a bad index.
+ */
+inline double L6470Kinematics::getScale(int axis)
+{
+    if (axis < 0 or axis >= jointCount())
+        return 0;
+    return m_scale[axis];
+}
+
+
+/** @brief Set the wheel separation for differential drive.
+ *
+ *  @param width Distance between the wheel contact points.
+ */
+inline void L6470Kinematics::setTrackWidth(double width)
+{
+    if (width > 0)
+        m_track = width;
+}
+
+
+/** @brief Set the path acceleration used with a feed rate.
+ *
+ *  @param unitsPerSec2 Acceleration along the path, 0 to keep each axis'
+ *                      own ACC and DEC.
+ */
+inline void L6470Kinematics::setAccel(double unitsPerSec2)
+{
+    m_accel = (unitsPerSec2 > 0) ? unitsPerSec2 : 0;
+}
+
+
+/** @brief Convert machine coordinates to axis travel.
+ *
+ *  Also used for velocities since the mapping is linear.
+ *
+ *  @param coord count() machine coordinates.
+ *  @param joint Receives one travel per axis, in units.
+ *  @return int: 0 on success, -1 if the group does not fit the type.
+ */
+inline int L6470Kinematics::toJoints(const double* coord, double* joint)
+{
+    int n = jointCount();
+
+    switch (m_type)
+    {
+        case L6470_KIN_CARTESIAN:
+            for (int i=0; i<n; i++)
+                joint[i] = coord[i];
+            return 0;
+
+        case L6470_KIN_COREXY:
+            if (n < 2)
+                return -1;
+            joint[0] = coord[0] + coord[1];
+            joint[1] = coord[0] - coord[1];
+            for (int i=2; i<n; i++)
+                joint[i] = coord[i];
+            return 0;
+
+        case L6470_KIN_DIFF_DRIVE:
+            if (n != 2)
+                return -1;
+            joint[0] = coord[0] - coord[1] * m_track / 2;
+            joint[1] = coord[0] + coord[1] * m_track / 2;
+            return 0;
+    }
+    return -1;
+}
+
+
+/** @brief Convert axis travel to machine coordinates.
+ *
+ *  @param joint One travel per axis, in units.
+ *  @param coord Receives count() machine coordinates.
+ *  @return int: 0 on success, -1 if the group does not fit the type.
+ */
+inline int L6470Kinematics::fromJoints(const double* joint, double* coord)
+{
+    int n = jointCount();
+
+    switch (m_type)
+    {
+        case L6470_KIN_CARTESIAN:
+            for (int i=0; i<n; i++)
+                coord[i] = joint[i];
+            return 0;
+
+        case L6470_KIN_COREXY:
+            if (n < 2)
+                return -1;
+            coord[0] = (joint[0] + joint[1]) / 2;
+            coord[1] = (joint[0] - joint[1]) / 2;
+            for (int i=2; i<n; i++)
+                coord[i] = joint[i];
+            return 0;
+
+        case L6470_KIN_DIFF_DRIVE:
+            if (n != 2)
+                return -1;
+            coord[0] = (joint[0] + joint[1]) / 2;
+            coord[1] = (joint[1] - joint[0]) / m_track;
+            return 0;
+    }
+    return -1;
+}
+
+
+/** @brief Convert machine coordinates to ABS_POS values.
+ *
+ *  @param coord count() machine coordinates.
+ *  @param steps Receives the microstep position of each axis as the chip
+ *               counts it, allowing for invert().
+ *  @return int: 0 on success, -1 if the group does not fit the type.
+ */
+inline int L6470Kinematics::toSteps(const double* coord, int32_t* steps)
+{
+    int n = jointCount();
+    std::vector<double> joint(n);
+
+    if (toJoints(coord, &joint[0]) < 0)
+        return -1;
+
+    for (int i=0; i<n; i++)
+    {
+        L6470* axis = m_group->getAxis(i);
+        double ms   = floor(joint[i] * m_scale[i] * axis->getMicroSteps() + 0.5);
+        steps[i]    = axis->isInverted() ? -(int32_t)ms : (int32_t)ms;
+    }
+    return 0;
+}
+
+
+/** @brief Move to an absolute position in machine coordinates.
+ *
+ *  @param coord count() machine coordinates.
+ *  @param feed Speed along the path in units/sec, 0 to let every axis move
+ *              at its own MAX_SPEED.
+ *  @return int: Negative on failure.
+ */
+inline int L6470Kinematics::moveTo(const double* coord, double feed)
+{
+    int n = jointCount();
+    std::vector<double> from(count());
+
+    if (n == 0 or getPosition(&from[0]) < 0)
+        return -1;
+    return moveJoints(&from[0], coord, feed);
+}
+
+
+/** @brief Move by a distance in machine coordinates.
+ *
+ *  @param delta count() distances.
+ *  @param feed Speed along the path in units/sec, 0 to let every axis move
+ *              at its own MAX_SPEED.
+ *  @return int: Negative on failure.
+ */
+inline int L6470Kinematics::moveBy(const double* delta, double feed)
+{
+    int c = count();
+    std::vector<double> from(c);
+    std::vector<double> to(c);
+
+    if (jointCount() == 0 or getPosition(&from[0]) < 0)
+        return -1;
+    for (int i=0; i<c; i++)
+        to[i] = from[i] + delta[i];
+    return moveJoints(&from[0], &to[0], feed);
+}
+
+
+/** @brief Run every axis at a velocity given in machine coordinates.
+ *
+ *  The axes keep running until stop() or another command.
+ *
+ *  @param vel count() velocities in units/sec (rad/sec for a heading).
+ *  @return int: Negative on failure.
+ */
+inline int L6470Kinematics::setVelocity(const double* vel)
+{
+    int n = jointCount();
+    std::vector<double> joint(n);
+
+    if (n == 0 or toJoints(vel, &joint[0]) < 0)
+        return -1;
+
+    // MAX_SPEED caps run() too, so put back any left from a feed rate
+    m_group->stage();
+    for (int i=0; i<n; i++)
+    {
+        double sps = joint[i] * m_scale[i];
+        ownSettings(i, L6470_KIN_SAVED_SPEED);
+        m_group->getAxis(i)->run((sps < 0) ? dSPIN_REV : dSPIN_FWD,
+                                 (float)fabs(sps));
+    }
+    return m_group->release();
+}
+
+
+/** @brief Returns the current position in machine coordinates.
+ *
+ *  @param coord Receives count() machine coordinates.
+ *  @return int: 0 on success, -1 if the group does not fit the type.
+ */
+inline int L6470Kinematics::getPosition(double* coord)
+{
+    int n = jointCount();
+    std::vector<double> joint(n);
+
+    for (int i=0; i<n; i++)
+    {
+        L6470* axis = m_group->getAxis(i);
+        int32_t pos = axis->estPosition();
+        if (axis->isInverted())
+            pos = -pos;
+        joint[i] = (double)pos / axis->getMicroSteps() / m_scale[i];
+    }
+    return fromJoints(&joint[0], coord);
+}
+
+
+/** @brief Soft stop every axis together.
+ *
+ *  @return int: Negative on failure.
+ */
+inline int L6470Kinematics::stop()
+{
+    m_group->stage();
+    for (int i=0; i<jointCount(); i++)
+        m_group->getAxis(i)->softStop();
+    return m_group->release();
+}
+
+
+/*
+ *  Number of axes, limited to the scales set up at construction.
+ */
+inline int L6470Kinematics::jointCount()
+{
+    int n = m_group->count();
+    return (n < (int)m_scale.size()) ? n : m_scale.size();
+}
+
+
+/*
+ *  Stage a GoTo on every axis that moves and release them together.  With a
+ *  feed rate each axis' MAX_SPEED (and ACC/DEC with a path acceleration) is
+ *  scaled by its share of the move so all axes finish together, after saving
+ *  the axis' own values.  Saved values not needed by this move are put back.
+ *  ACC and DEC are only written when every axis is stopped.
+ */
+inline int L6470Kinematics::moveJoints(const double* from, const double* to,
+                                       double feed)
+{
+    int n = jointCount();
+    int c = count();
+    std::vector<double>  j0(n);
+    std::vector<double>  j1(n);
+    std::vector<int32_t> steps(n);
+    double len = 0;
+
+    if (toJoints(from, &j0[0]) < 0 or toJoints(to, &j1[0]) < 0 or
+        toSteps(to, &steps[0]) < 0)
+        return -1;
+
+    // Path length in machine coordinates, or the longest wheel travel
+    if (m_type == L6470_KIN_DIFF_DRIVE)
+        len = (fabs(j1[0]-j0[0]) > fabs(j1[1]-j0[1])) ? fabs(j1[0]-j0[0])
+                                                       : fabs(j1[1]-j0[1]);
+    else
+    {
+        for (int i=0; i<c; i++)
+            len += (to[i]-from[i]) * (to[i]-from[i]);
+        len = sqrt(len);
+    }
+
+    // Decide what each axis needs written and save its own settings before
+    //  staging, since reads cannot be answered while staged.
+    std::vector<int> use(n);
+    int accWrite = 0;
+    for (int i=0; i<n; i++)
+    {
+        L6470* axis = m_group->getAxis(i);
+        use[i] = 0;
+        if (feed > 0 and len > 0 and fabs(j1[i] - j0[i]) > 0)
+            use[i] = L6470_KIN_SAVED_SPEED |
+                     ((m_accel > 0) ? L6470_KIN_SAVED_ACC : 0);
+
+        if ((use[i] & L6470_KIN_SAVED_ACC) or
+            (m_saved[i] & L6470_KIN_SAVED_ACC))
+            accWrite = 1;
+
+        if ((use[i] & L6470_KIN_SAVED_SPEED) and
+            !(m_saved[i] & L6470_KIN_SAVED_SPEED))
+            m_ownSpeed[i] = axis->getMaxSpeed_FX();
+        if ((use[i] & L6470_KIN_SAVED_ACC) and
+            !(m_saved[i] & L6470_KIN_SAVED_ACC))
+        {
+            m_ownAcc[i] = axis->getAccel_FX();
+            m_ownDec[i] = axis->getDecel_FX();
+        }
+    }
+
+    if (accWrite and !allStopped())
+        return -1;
+
+    m_group->stage();
+    for (int i=0; i<n; i++)
+    {
+        L6470* axis = m_group->getAxis(i);
+        double dist = fabs(j1[i] - j0[i]);
+
+        ownSettings(i, ~use[i]);
+        if (use[i] & L6470_KIN_SAVED_SPEED)
+            axis->setMaxSpeed((float)(feed * dist / len * m_scale[i]));
+        if (use[i] & L6470_KIN_SAVED_ACC)
+        {
+            float acc = (float)(m_accel * dist / len * m_scale[i]);
+            axis->setAccel(acc);
+            axis->setDecel(acc);
+        }
+        m_saved[i] |= use[i];
+        axis->gotoPosABS(steps[i]);
+    }
+    return m_group->release();
+}
+
+
+/*
+ *  Returns 1 if no axis is moving or executing a command.
+ */
+inline int L6470Kinematics::allStopped()
+{
+    for (int i=0; i<jointCount(); i++)
+    {
+        L6470* axis = m_group->getAxis(i);
+        if (axis->isBusy() or axis->lastStatus().motStatus != 0)
+            return 0;
+    }
+    return 1;
+}
+
+
+/*
+ *  Write back the saved settings of one axis selected by which
+ *  (L6470_KIN_SAVED bits) and forget them.
+ */
+inline void L6470Kinematics::ownSettings(int axis, int which)
+{
+    L6470* a = m_group->getAxis(axis);
+    which &= m_saved[axis];
+
+    if (which & L6470_KIN_SAVED_SPEED)
+        a->setMaxSpeed(m_ownSpeed[axis]);
+    if (which & L6470_KIN_SAVED_ACC)
+    {
+        a->setAccel(m_ownAcc[axis]);
+        a->setDecel(m_ownDec[axis]);
+    }
+    m_saved[axis] &= ~which;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_KINEMATICS_H
@@ -0,0 +1,235 @@
+#ifndef L6470_MICROSTEP_H
+#define L6470_MICROSTEP_H
+
+#include <stdint.h>
+#include "l6470.h"
+
+enum L6470_STEP_PHASE
+{
+    L6470_STEP_PRECISE  = 0,    // Fine step mode, normal full step threshold
+    L6470_STEP_TRAVERSE = 1     // Coarse step mode, low full step threshold
+};
+
+
+/** @brief Switches an L6470 between a fine and a coarse step resolution
+ *
+ *  Two mechanisms are combined so a change of resolution never interrupts a
+ *  move:
+ *
+ *  - FS_SPD may be written at any time.  On entering traverse the threshold
+ *    is lowered so the chip drives the motor in full steps once it passes
+ *    the traverse speed, and on returning to precise it is put back.  The
+ *    position count is unaffected.
+ *
+ *  - STEP_MODE can only be changed with the motor stopped.  The requested
+ *    mode is held until service() finds the axis at standstill and is then
+ *    applied with L6470::setMicroSteps(), which rescales ABS_POS and MARK
+ *    and keeps the electrical position so full step positions stay the
+ *    same.  A holding motor is released for the few commands this takes;
+ *    see setMicroSteps() for axes that can be back-driven.
+ *
+ *  Typical use is to call traverse() before a long rapid move, precise()
+ *  before the final approach, and service() from the control loop.  Moves
+ *  given in full steps (move_FS(), gotoPosABS_FS()) are unaffected by the
+ *  step mode in force.
+ */
+class L6470StepScheduler
+{
+protected:
+    L6470*      m_axis;
+    uint8_t     m_fine;
+    uint8_t     m_coarse;
+    float       m_fsPrecise;
+    float       m_fsTraverse;
+    int         m_phase;
+    uint8_t     m_want;         // Step mode waiting for standstill, 0 if none
+    uint32_t    m_switches;
+
+public:
+    L6470StepScheduler(L6470& axis, uint8_t fine = 128, uint8_t coarse = 16);
+    virtual ~L6470StepScheduler();
+
+    void        setModes(uint8_t fine, uint8_t coarse);
+    void        setThresholds(float precise, float traverse);
+
+    void        traverse();
+    void        precise();
+    int         service();
+
+    int         getPhase();
+    int         isPending();
+    uint32_t    switchCount();
+
+protected:
+    void        request(uint8_t mode);
+};
+
+
+
+
+
+/** @brief Creates a scheduler in the precise phase.
+ *
+ *  The full step threshold in force is kept as the precise threshold and the
+ *  traverse threshold starts at the lowest speed the register allows.
+ *
+ *  @param axis The axis to manage.
+ *  @param fine Microsteps per step for positioning.
+ *  @param coarse Microsteps per step while traversing.
+ */
+inline L6470StepScheduler::L6470StepScheduler(L6470& axis, uint8_t fine,
+                                              uint8_t coarse)
+{
+    m_axis       = &axis;
+    m_fine       = fine;
+    m_coarse     = coarse;
+    m_fsPrecise  = axis.getFullStepThreshold();
+    m_fsTraverse = 0;
+    m_phase      = L6470_STEP_PRECISE;
+    m_want       = 0;
+    m_switches   = 0;
+}
+
+
+inline L6470StepScheduler::~L6470StepScheduler()
+{}
+
+
+/** @brief Set the step modes used for each phase.
+ *
+ *  @param fine Microsteps per step for positioning.
+ *  @param coarse Microsteps per step while traversing.
+ */
+inline void L6470StepScheduler::setModes(uint8_t fine, uint8_t coarse)
+{
+    m_fine   = fine;
+    m_coarse = coarse;
+}
+
+
+/** @brief Set the full step thresholds used for each phase.
+ *
+ *  @param precise FS_SPD in steps/sec for positioning.
+ *  @param traverse FS_SPD in steps/sec while traversing.
+ */
+inline void L6470StepScheduler::setThresholds(float precise, float traverse)
+{
+    m_fsPrecise  = precise;
+    m_fsTraverse = traverse;
+}
+
+
+/** @brief Enter the traverse phase.
+ *
+ *  The full step threshold changes at once, the step mode at the next
+ *  standstill.
+ */
+inline void L6470StepScheduler::traverse()
+{
+    m_phase = L6470_STEP_TRAVERSE;
+    m_axis->setFullStepThreshold(m_fsTraverse);
+    request(m_coarse);
+}
+
+
+/** @brief Enter the precise phase.
+ *
+ *  The full step threshold changes at once, the step mode at the next
+ *  standstill.
+ */
+inline void L6470StepScheduler::precise()
+{
+    m_phase = L6470_STEP_PRECISE;
+    m_axis->setFullStepThreshold(m_fsPrecise);
+    request(m_fine);
+}
+
+
+/** @brief Apply a waiting step mode change if the axis is at standstill.
+ *
+ *  Reads STATUS only while a change is waiting.
+ *
+ *  @return int: 1 - The step mode was changed.  0 - Nothing to do or the
+ *               axis is moving.  -1 - The chip refused the change, which
+ *               stays pending.
+ */
+inline int L6470StepScheduler::service()
+{
+    if (!m_want)
+        return 0;
+
+    // GET_PARAM leaves the latched fault flags for whoever reports them
+    m_axis->updateStatus(m_axis->getParam<dSPIN_STATUS>());
+    const L6470Status& st = m_axis->lastStatus();
+    if (st.busy or st.motStatus != 0)
+        return 0;
+
+    // Left pending if refused so the next call tries again
+    if (m_axis->setMicroSteps(m_want) != m_want)
+        return -1;
+
+    m_want = 0;
+    m_switches++;
+    return 1;
+}
+
+
+/** @brief Returns the current phase (L6470_STEP_PHASE).
+ */
+inline int L6470StepScheduler::getPhase()
+{
+    return m_phase;
+}
+
+
+/** @brief Returns 1 while a step mode change waits for standstill.
+ */
+inline int L6470StepScheduler::isPending()
+{
+    return m_want ? 1 : 0;
+}
+
+
+/** @brief Returns the number of step mode changes made.
+ */
+inline uint32_t L6470StepScheduler::switchCount()
+{
+    return m_switches;
+}
+
+
+/*
+ *  Hold a step mode change until standstill.  Nothing is held if the axis is
+ *  already in that mode.
+ */
+inline void L6470StepScheduler::request(uint8_t mode)
+{
+    m_want = (mode == m_axis->getMicroSteps()) ? 0 : mode;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_MICROSTEP_H
@@ -0,0 +1,788 @@
+#ifndef L6470_MODEL_H
+#define L6470_MODEL_H
+
+#include <stdint.h>
+#include <math.h>
+#include "l6470-support.h"
+#include "l6470-units.h"
+
+enum L6470_MODEL_CONST
+{
+    L6470_MODEL_STEP_NS = 1000000   // Longest integration step in advance()
+};
+
+
+enum L6470_MODEL_MODE
+{
+    L6470_MODE_STOPPED  = 0,
+    L6470_MODE_RUN      = 1,        // Run at a speed until told otherwise
+    L6470_MODE_TARGET   = 2,        // Move or GoTo a position
+    L6470_MODE_STOP     = 3,        // Decelerating to a stop
+    L6470_MODE_UNTIL    = 4,        // GoUntil, run until the switch closes
+    L6470_MODE_RELEASE  = 5         // ReleaseSW, run until the switch opens
+};
+
+
+/** @brief Behavioural model of a single L6470
+ *
+ *  Holds the register file and the command decoder of one chip and integrates
+ *  the motion profile over time.  Bytes are fed in with shift(), one per
+ *  chip-select frame, exactly as the chip sees them, and the byte the chip
+ *  would return is given back.  advance() moves simulated time forward.
+ *
+ *  Motion follows the ACC, DEC, MAX_SPEED and MIN_SPEED registers and the
+ *  selected step mode.  The STATUS register tracks HiZ, BUSY, direction,
+ *  motor status, switch state and the NOTPERF/WRONG_CMD flags.  Alarm flags
+ *  can be raised with raiseFlag() and are latched until GET_STATUS as on the
+ *  chip.  The switch input is driven with setSwitch().
+ *
+ *  Not modelled: step clock mode, the back EMF compensation, the ADC and the
+ *  electrical position.  Commands that the chip refuses while running
+ *  (MOVE, GOTO and writes to ABS_POS, EL_POS, ACC, DEC) set NOTPERF, and
+ *  writes to STEP_MODE and CONFIG are refused unless the bridges are HiZ.
+ */
+class L6470Model
+{
+protected:
+    uint32_t    m_reg[dSPIN_REG_COUNT];
+    double      m_pos;          // Microsteps
+    double      m_speed;        // Steps/sec, always positive
+    uint8_t     m_dir;          // Direction of travel
+    uint8_t     m_wantDir;      // Direction of the current command
+    double      m_runSpeed;     // Speed for RUN, UNTIL and RELEASE
+    int32_t     m_target;       // Microsteps for TARGET
+    int         m_mode;
+    uint32_t    m_mot;          // MOT_STATUS field
+    int         m_hizAtStop;
+    int         m_busy;
+    uint8_t     m_act;
+    int         m_switch;
+
+    // Command decoder
+    uint8_t     m_cmd;
+    int         m_need;
+    uint32_t    m_payload;
+    uint8_t     m_out[4];
+    int         m_outLen;
+    int         m_outPos;
+
+public:
+    L6470Model();
+    virtual ~L6470Model();
+
+    void        reset();
+    uint8_t     shift(uint8_t in);
+    void        advance(int64_t ns);
+
+    uint32_t    reg(uint8_t param);
+    void        setReg(uint8_t param, uint32_t value);
+    int32_t     position();
+    double      speed();
+    uint8_t     dir();
+    int         mode();
+    int         isBusy();
+    int         isHiZ();
+    int         microSteps();
+
+    void        setSwitch(int closed);
+    void        raiseFlag(uint16_t flag);
+    void        halt(int hiz);
+
+protected:
+    void        execute();
+    void        startMotion(int mode, uint8_t dir);
+    void        stopNow(int hiz);
+    void        updateStatus();
+    void        setStatusBit(uint16_t bit, int on);
+    int         accessAllowed(uint8_t param);
+    void        setPos(double pos);
+    double      limitSpeed(double sps);
+};
+
+
+
+
+
+/** @brief Creates a chip in its power-on state.
+ */
+inline L6470Model::L6470Model()
+{
+    m_switch = 0;
+    reset();
+}
+
+
+inline L6470Model::~L6470Model()
+{}
+
+
+/** @brief Put the chip in its power-on state.
+ *
+ *  Registers take their datasheet reset values, the bridges are HiZ and any
+ *  partly received command is discarded.
+ */
+inline void L6470Model::reset()
+{
+    for (int i=0; i<dSPIN_REG_COUNT; i++)
+        m_reg[i] = 0;
+
+    m_reg[dSPIN_ACC]        = 0x08A;
+    m_reg[dSPIN_DEC]        = 0x08A;
+    m_reg[dSPIN_MAX_SPEED]  = 0x041;
+    m_reg[dSPIN_KVAL_HOLD]  = 0x29;
+    m_reg[dSPIN_KVAL_RUN]   = 0x29;
+    m_reg[dSPIN_KVAL_ACC]   = 0x29;
+    m_reg[dSPIN_KVAL_DEC]   = 0x29;
+    m_reg[dSPIN_INT_SPD]    = 0x0408;
+    m_reg[dSPIN_ST_SLP]     = 0x19;
+    m_reg[dSPIN_FN_SLP_ACC] = 0x29;
+    m_reg[dSPIN_FN_SLP_DEC] = 0x29;
+    m_reg[dSPIN_OCD_TH]     = 0x8;
+    m_reg[dSPIN_STALL_TH]   = 0x40;
+    m_reg[dSPIN_FS_SPD]     = 0x027;
+    m_reg[dSPIN_STEP_MODE]  = 0x7;
+    m_reg[dSPIN_ALARM_EN]   = 0xFF;
+    m_reg[dSPIN_CONFIG]     = 0x2E88;
+
+    // Alarm flags are active low, all clear
+    m_reg[dSPIN_STATUS]     = dSPIN_STATUS_HIZ | dSPIN_STATUS_BUSY |
+                              dSPIN_STATUS_UVLO | dSPIN_STATUS_TH_WRN |
+                              dSPIN_STATUS_TH_SD | dSPIN_STATUS_OCD |
+                              dSPIN_STATUS_STEP_LOSS_A |
+                              dSPIN_STATUS_STEP_LOSS_B;
+    if (m_switch)
+        m_reg[dSPIN_STATUS] |= dSPIN_STATUS_SW_F;
+
+    m_pos       = 0;
+    m_speed     = 0;
+    m_dir       = dSPIN_FWD;
+    m_wantDir   = dSPIN_FWD;
+    m_runSpeed  = 0;
+    m_target    = 0;
+    m_mode      = L6470_MODE_STOPPED;
+    m_mot       = 0;
+    m_hizAtStop = 1;
+    m_busy      = 0;
+    m_act       = 0;
+    m_cmd       = 0;
+    m_need      = 0;
+    m_payload   = 0;
+    m_outLen    = 0;
+    m_outPos    = 0;
+    updateStatus();
+}
+
+
+/** @brief Shift one byte through the chip.
+ *
+ *  @param in The byte clocked in on SDI.
+ *  @return uint8_t: The byte clocked out on SDO.
+ */
+inline uint8_t L6470Model::shift(uint8_t in)
+{
+    uint8_t out = 0;
+    if (m_outPos < m_outLen)
+        out = m_out[m_outPos++];
+
+    if (m_need > 0)
+    {
+        m_payload = (m_payload << 8) | in;
+        if (--m_need == 0)
+            execute();
+        return out;
+    }
+
+    // NOPs clock out the rest of a reply
+    if (in == dSPIN_NOP)
+        return out;
+
+    m_cmd     = in;
+    m_payload = 0;
+    m_outLen  = 0;
+    m_outPos  = 0;
+
+    uint8_t param = in & 0x1F;
+    int     bytes = 0;
+    switch (in & 0xE0)
+    {
+        case dSPIN_SET_PARAM:
+        case dSPIN_GET_PARAM:
+            if (param >= dSPIN_REG_COUNT)
+            {
+                setStatusBit(dSPIN_STATUS_WRONG_CMD, 1);
+                return out;
+            }
+            bytes = (dSPIN_REG_TABLE[param].bits + 7) / 8;
+            if ((in & 0xE0) == dSPIN_SET_PARAM)
+                m_need = bytes;
+            else
+            {
+                updateStatus();
+                uint32_t val = m_reg[param];
+                for (int i=0; i<bytes; i++)
+                    m_out[i] = (uint8_t)(val >> (8*(bytes-1-i)));
+                m_outLen = bytes;
+            }
+            return out;
+    }
+
+    switch (in & 0xFE)
+    {
+        case dSPIN_RUN:
+        case dSPIN_MOVE:
+        case dSPIN_GOTO_DIR:
+            m_need = 3;
+            return out;
+        case dSPIN_STEP_CLOCK:
+            return out;
+    }
+
+    switch (in & 0xF6)
+    {
+        case dSPIN_GO_UNTIL:
+            m_need = 3;
+            return out;
+        case dSPIN_RELEASE_SW:
+            execute();
+            return out;
+    }
+
+    switch (in)
+    {
+        case dSPIN_GOTO:
+            m_need = 3;
+            return out;
+        case dSPIN_GET_STATUS:
+            updateStatus();
+            m_out[0] = (uint8_t)(m_reg[dSPIN_STATUS] >> 8);
+            m_out[1] = (uint8_t)(m_reg[dSPIN_STATUS]);
+            m_outLen = 2;
+            // Reading clears the latched flags
+            m_reg[dSPIN_STATUS] |= dSPIN_STATUS_UVLO | dSPIN_STATUS_TH_WRN |
+                                   dSPIN_STATUS_TH_SD | dSPIN_STATUS_OCD |
+                                   dSPIN_STATUS_STEP_LOSS_A |
+                                   dSPIN_STATUS_STEP_LOSS_B;
+            m_reg[dSPIN_STATUS] &= ~(dSPIN_STATUS_SW_EVN |
+                                     dSPIN_STATUS_NOTPERF_CMD |
+                                     dSPIN_STATUS_WRONG_CMD);
+            return out;
+        case dSPIN_GO_HOME:
+        case dSPIN_GO_MARK:
+        case dSPIN_RESET_POS:
+        case dSPIN_RESET_DEVICE:
+        case dSPIN_SOFT_STOP:
+        case dSPIN_HARD_STOP:
+        case dSPIN_SOFT_HIZ:
+        case dSPIN_HARD_HIZ:
+            execute();
+            return out;
+    }
+
+    setStatusBit(dSPIN_STATUS_WRONG_CMD, 1);
+    return out;
+}
+
+
+/** @brief Move simulated time forward.
+ *
+ *  @param ns Nanoseconds to advance.
+ */
+inline void L6470Model::advance(int64_t ns)
+{
+    double acc = dSPIN_fromReg<dSPIN_ACC>(m_reg[dSPIN_ACC]) / 1000.0;
+    double dec = dSPIN_fromReg<dSPIN_DEC>(m_reg[dSPIN_DEC]) / 1000.0;
+    double vmax = dSPIN_fromReg<dSPIN_MAX_SPEED>(m_reg[dSPIN_MAX_SPEED])
+                  / 1000.0;
+    double vmin = dSPIN_fromReg<dSPIN_MIN_SPEED>(m_reg[dSPIN_MIN_SPEED] & 0xFFF)
+                  / 1000.0;
+    int    ms   = microSteps();
+    int    accInf = (m_reg[dSPIN_ACC] == 0xFFF);
+    int    decInf = (m_reg[dSPIN_DEC] == 0xFFF);
+
+    while (ns > 0 and m_mode != L6470_MODE_STOPPED)
+    {
+        int64_t step = (ns > L6470_MODEL_STEP_NS) ? (int64_t)L6470_MODEL_STEP_NS : ns;
+        double  dt = step / 1e9;
+        double  vt = 0;
+        ns -= step;
+
+        switch (m_mode)
+        {
+            case L6470_MODE_RUN:
+            case L6470_MODE_UNTIL:
+            case L6470_MODE_RELEASE:
+                vt = m_runSpeed;
+                break;
+            case L6470_MODE_TARGET:
+            {
+                double dist = fabs(m_target - m_pos) / ms;
+                double brake = decInf ? 0 : m_speed*m_speed / (2*dec);
+                vt = (dist <= brake) ? 0 : vmax;
+                break;
+            }
+            default:
+                vt = 0;
+        }
+
+        // A change of direction first stops the motor
+        if (m_dir != m_wantDir)
+        {
+            if (m_speed > 0)
+                vt = 0;
+            else
+                m_dir = m_wantDir;
+        }
+
+        double was = m_speed;
+        if (m_speed < vt)
+        {
+            m_speed = accInf ? vt : m_speed + acc*dt;
+            if (m_speed > vt)
+                m_speed = vt;
+        }
+        else if (m_speed > vt)
+        {
+            m_speed = decInf ? vt : m_speed - dec*dt;
+            if (m_speed < vt)
+                m_speed = vt;
+        }
+
+        if (m_mode == L6470_MODE_TARGET)
+        {
+            // Never crawl slower than MIN_SPEED (or 1 step/s) short of target
+            double floor = (vmin > 1) ? vmin : 1;
+            if (m_speed < floor)
+                m_speed = floor;
+        }
+
+        if (m_speed > was)
+            m_mot = 1;
+        else if (m_speed < was)
+            m_mot = 2;
+        else
+            m_mot = (m_speed > 0) ? 3 : 0;
+
+        double delta = m_speed * ms * dt * ((m_dir == dSPIN_FWD) ? 1 : -1);
+        if (m_mode == L6470_MODE_TARGET)
+        {
+            double left = m_target - m_pos;
+            if (fabs(delta) >= fabs(left) and m_dir == m_wantDir)
+            {
+                setPos(m_target);
+                stopNow(0);
+                continue;
+            }
+        }
+        setPos(m_pos + delta);
+
+        if (m_mode == L6470_MODE_RUN and m_speed == vt and m_dir == m_wantDir)
+            m_busy = 0;
+
+        if (m_mode == L6470_MODE_STOP and m_speed == 0)
+            stopNow(m_hizAtStop);
+    }
+
+    updateStatus();
+}
+
+
+/** @brief Returns a register value as the chip would report it.
+ */
+inline uint32_t L6470Model::reg(uint8_t param)
+{
+    if (param >= dSPIN_REG_COUNT)
+        return 0;
+    updateStatus();
+    return m_reg[param];
+}
+
+
+/** @brief Set a register directly, bypassing the command decoder.
+ */
+inline void L6470Model::setReg(uint8_t param, uint32_t value)
+{
+    if (param >= dSPIN_REG_COUNT or dSPIN_REG_TABLE[param].bits == 0)
+        return;
+    value &= 0xFFFFFFFFUL >> (32 - dSPIN_REG_TABLE[param].bits);
+    m_reg[param] = value;
+    if (param == dSPIN_ABS_POS)
+        m_pos = dSPIN_toSigned(value, 22);
+}
+
+
+/** @brief Returns ABS_POS as a signed value.
+ */
+inline int32_t L6470Model::position()
+{
+    return dSPIN_toSigned(reg(dSPIN_ABS_POS), 22);
+}
+
+
+/** @brief Returns the speed in steps/sec.
+ */
+inline double L6470Model::speed()
+{
+    return m_speed;
+}
+
+
+/** @brief Returns the direction of travel, dSPIN_FWD or dSPIN_REV.
+ */
+inline uint8_t L6470Model::dir()
+{
+    return m_dir;
+}
+
+
+/** @brief Returns the motion mode (L6470_MODEL_MODE).
+ */
+inline int L6470Model::mode()
+{
+    return m_mode;
+}
+
+
+/** @brief Returns 1 while the BUSY output is asserted.
+ */
+inline int L6470Model::isBusy()
+{
+    return m_busy;
+}
+
+
+/** @brief Returns 1 while the bridges are high impedance.
+ */
+inline int L6470Model::isHiZ()
+{
+    return (m_reg[dSPIN_STATUS] & dSPIN_STATUS_HIZ) ? 1 : 0;
+}
+
+
+/** @brief Returns the microsteps per full step from STEP_MODE.
+ */
+inline int L6470Model::microSteps()
+{
+    return 1 << (m_reg[dSPIN_STEP_MODE] & 0x07);
+}
+
+
+/** @brief Drive the switch input.
+ *
+ *  Closing the switch sets SW_EVN and ends a GoUntil.  Opening it ends a
+ *  ReleaseSW.
+ *
+ *  @param closed 1 - Switch closed.  0 - Switch open.
+ */
+inline void L6470Model::setSwitch(int closed)
+{
+    int was = m_switch;
+    m_switch = closed ? 1 : 0;
+    setStatusBit(dSPIN_STATUS_SW_F, m_switch);
+
+    if (m_switch and !was)
+    {
+        setStatusBit(dSPIN_STATUS_SW_EVN, 1);
+        if (m_mode == L6470_MODE_UNTIL)
+        {
+            if (m_act)
+                m_reg[dSPIN_MARK] = m_reg[dSPIN_ABS_POS];
+            else
+                setPos(0);
+            m_mode = L6470_MODE_STOP;
+            m_hizAtStop = 0;
+        }
+    }
+    else if (!m_switch and was and m_mode == L6470_MODE_RELEASE)
+    {
+        if (m_act)
+            m_reg[dSPIN_MARK] = m_reg[dSPIN_ABS_POS];
+        else
+            setPos(0);
+        stopNow(0);
+    }
+}
+
+
+/** @brief Raise a latched alarm flag.
+ *
+ *  @param flag One of dSPIN_STATUS_UVLO, _TH_WRN, _TH_SD, _OCD,
+ *              _STEP_LOSS_A or _STEP_LOSS_B.  Cleared by GET_STATUS.
+ */
+inline void L6470Model::raiseFlag(uint16_t flag)
+{
+    // The alarm flags are active low
+    m_reg[dSPIN_STATUS] &= ~flag;
+    if ((flag & dSPIN_STATUS_TH_SD) or
+        ((flag & dSPIN_STATUS_OCD) and
+         (m_reg[dSPIN_CONFIG] & dSPIN_CONFIG_OC_SD_ENABLE)))
+        stopNow(1);
+}
+
+
+/** @brief Stop at once without decelerating.
+ *
+ *  Used to bring a model that tracks a real chip in line with it.
+ *
+ *  @param hiz 1 - Leave the bridges HiZ.  0 - Hold the position.
+ */
+inline void L6470Model::halt(int hiz)
+{
+    stopNow(hiz);
+}
+
+
+/*
+ *  Carry out a command once its payload has arrived.
+ */
+inline void L6470Model::execute()
+{
+    uint8_t cmd   = m_cmd;
+    uint8_t dir   = cmd & 0x01;
+    uint8_t param = cmd & 0x1F;
+
+    if ((cmd & 0xE0) == dSPIN_SET_PARAM)
+    {
+        if (dSPIN_REG_TABLE[param].flags & dSPIN_REG_RO)
+        {
+            setStatusBit(dSPIN_STATUS_WRONG_CMD, 1);
+            return;
+        }
+        if (!accessAllowed(param))
+        {
+            setStatusBit(dSPIN_STATUS_NOTPERF_CMD, 1);
+            return;
+        }
+        setReg(param, m_payload);
+        if (param == dSPIN_STEP_MODE)
+            setPos(0);          // Changing step mode resets ABS_POS
+        return;
+    }
+
+    if ((cmd & 0xFE) == dSPIN_RUN)
+    {
+        m_runSpeed = limitSpeed(dSPIN_fromReg<dSPIN_SPEED>(m_payload & 0xFFFFF)
+                                / 1000.0);
+        startMotion(L6470_MODE_RUN, dir);
+        return;
+    }
+
+    if ((cmd & 0xFE) == dSPIN_MOVE or (cmd & 0xFE) == dSPIN_GOTO_DIR or
+        cmd == dSPIN_GOTO or cmd == dSPIN_GO_HOME or cmd == dSPIN_GO_MARK)
+    {
+        if (m_speed > 0)
+        {
+            setStatusBit(dSPIN_STATUS_NOTPERF_CMD, 1);
+            return;
+        }
+
+        int32_t here = dSPIN_toSigned(m_reg[dSPIN_ABS_POS], 22);
+        int32_t target;
+        if ((cmd & 0xFE) == dSPIN_MOVE)
+        {
+            int32_t n = m_payload & 0x3FFFFF;
+            target = here + (dir ? n : -n);
+        }
+        else if (cmd == dSPIN_GO_HOME)
+            target = 0;
+        else if (cmd == dSPIN_GO_MARK)
+            target = dSPIN_toSigned(m_reg[dSPIN_MARK], 22);
+        else
+            target = dSPIN_toSigned(m_payload, 22);
+
+        if ((cmd & 0xFE) != dSPIN_MOVE and (cmd & 0xFE) != dSPIN_GOTO_DIR)
+        {
+            // Shortest path around the 22 bit position range
+            int32_t d = dSPIN_toSigned((uint32_t)(target - here), 22);
+            dir = (d >= 0) ? dSPIN_FWD : dSPIN_REV;
+        }
+
+        // Keep the target on the same side of any wrap as the travel
+        int32_t d = dSPIN_toSigned((uint32_t)(target - here), 22);
+        if (dir == dSPIN_FWD and d < 0) d += 0x400000;
+        if (dir == dSPIN_REV and d > 0) d -= 0x400000;
+        m_target = (int32_t)floor(m_pos + 0.5) + d;
+
+        if (d == 0)
+            return;
+        startMotion(L6470_MODE_TARGET, dir);
+        return;
+    }
+
+    if ((cmd & 0xF6) == dSPIN_GO_UNTIL)
+    {
+        m_act = (cmd & 0x08) ? 1 : 0;
+        m_runSpeed = limitSpeed(dSPIN_fromReg<dSPIN_SPEED>(m_payload & 0xFFFFF)
+                                / 1000.0);
+        startMotion(L6470_MODE_UNTIL, dir);
+        return;
+    }
+
+    if ((cmd & 0xF6) == dSPIN_RELEASE_SW)
+    {
+        double vmin = dSPIN_fromReg<dSPIN_MIN_SPEED>(m_reg[dSPIN_MIN_SPEED]
+                                                     & 0xFFF) / 1000.0;
+        m_act = (cmd & 0x08) ? 1 : 0;
+        m_runSpeed = (vmin > 5) ? vmin : 5;
+        if (!m_switch)
+            return;
+        startMotion(L6470_MODE_RELEASE, dir);
+        return;
+    }
+
+    switch (cmd)
+    {
+        case dSPIN_RESET_POS:
+            if (m_speed > 0)
+                setStatusBit(dSPIN_STATUS_NOTPERF_CMD, 1);
+            else
+                setPos(0);
+            break;
+        case dSPIN_RESET_DEVICE:
+            reset();
+            break;
+        case dSPIN_SOFT_STOP:
+        case dSPIN_SOFT_HIZ:
+            m_hizAtStop = (cmd == dSPIN_SOFT_HIZ);
+            if (m_speed > 0)
+            {
+                m_mode = L6470_MODE_STOP;
+                m_busy = 1;
+            }
+            else
+                stopNow(m_hizAtStop or isHiZ());
+            break;
+        case dSPIN_HARD_STOP:
+            stopNow(0);
+            break;
+        case dSPIN_HARD_HIZ:
+            stopNow(1);
+            break;
+    }
+}
+
+
+/*
+ *  Begin a motion command.
+ */
+inline void L6470Model::startMotion(int mode, uint8_t dir)
+{
+    m_mode    = mode;
+    m_wantDir = dir;
+    m_busy    = 1;
+    if (m_speed == 0)
+        m_dir = dir;
+    setStatusBit(dSPIN_STATUS_HIZ, 0);
+}
+
+
+/*
+ *  Stop immediately, optionally releasing the bridges.
+ */
+inline void L6470Model::stopNow(int hiz)
+{
+    m_speed = 0;
+    m_mode  = L6470_MODE_STOPPED;
+    m_mot   = 0;
+    m_busy  = 0;
+    setPos(floor(m_pos + 0.5));
+    setStatusBit(dSPIN_STATUS_HIZ, hiz);
+}
+
+
+/*
+ *  Bring SPEED and the STATUS motion fields up to date.
+ */
+inline void L6470Model::updateStatus()
+{
+    uint32_t st = m_reg[dSPIN_STATUS];
+    st &= ~(dSPIN_STATUS_MOT_STATUS | dSPIN_STATUS_DIR | dSPIN_STATUS_BUSY);
+    st |= m_mot << 5;
+    if (m_dir == dSPIN_FWD)
+        st |= dSPIN_STATUS_DIR;
+    if (!m_busy)
+        st |= dSPIN_STATUS_BUSY;    // BUSY is active low
+    m_reg[dSPIN_STATUS] = st;
+
+    m_reg[dSPIN_SPEED] = dSPIN_toReg<dSPIN_SPEED>(
+                             (uint32_t)(m_speed * 1000 + 0.5));
+}
+
+
+/*
+ *  Set or clear a STATUS bit by its raw polarity.
+ */
+inline void L6470Model::setStatusBit(uint16_t bit, int on)
+{
+    if (on)
+        m_reg[dSPIN_STATUS] |= bit;
+    else
+        m_reg[dSPIN_STATUS] &= ~bit;
+}
+
+
+/*
+ *  Whether a register may be written in the present state.
+ */
+inline int L6470Model::accessAllowed(uint8_t param)
+{
+    switch (param)
+    {
+        case dSPIN_ABS_POS:
+        case dSPIN_EL_POS:
+        case dSPIN_ACC:
+        case dSPIN_DEC:
+            return (m_speed == 0 and m_mode == L6470_MODE_STOPPED);
+        case dSPIN_STEP_MODE:
+        case dSPIN_CONFIG:
+            return isHiZ();
+    }
+    return 1;
+}
+
+
+/*
+ *  Set the position and wrap ABS_POS to 22 bits.
+ */
+inline void L6470Model::setPos(double pos)
+{
+    m_pos = pos;
+    m_reg[dSPIN_ABS_POS] = (uint32_t)((int32_t)floor(m_pos + 0.5)) & 0x3FFFFF;
+}
+
+
+/*
+ *  Commanded speeds are capped by MAX_SPEED.
+ */
+inline double L6470Model::limitSpeed(double sps)
+{
+    double vmax = dSPIN_fromReg<dSPIN_MAX_SPEED>(m_reg[dSPIN_MAX_SPEED])
+                  / 1000.0;
+    return (sps > vmax) ? vmax : sps;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_MODEL_H
@@ -0,0 +1,495 @@
+#ifndef L6470_PLANNER_H
+#define L6470_PLANNER_H
+
+#include <stdint.h>
+#include <math.h>
+#include <deque>
+#include "l6470.h"
+
+enum L6470_PLANNER_STATE
+{
+    L6470_PLAN_IDLE      = 0,   // Nothing queued, motor stopped
+    L6470_PLAN_RUNNING   = 1,   // Streaming speed updates
+    L6470_PLAN_STOPPING  = 2,   // Waiting for the final soft stop
+    L6470_PLAN_SETTLING  = 3    // Correcting the final position
+};
+
+
+/** @brief Host side motion planner for a single L6470 axis
+ *
+ *  Targets are queued as absolute microstep positions with their own speed,
+ *  acceleration and (optional) jerk limits.  The planner looks ahead through
+ *  the queue to find how fast each target may be passed through without
+ *  being unable to stop for a later one, so consecutive moves in the same
+ *  direction blend together without stopping.  A change of direction always
+ *  passes through zero speed.
+ *
+ *  The profile is streamed to the chip as run() speed updates from service()
+ *  (or update()) at a fixed rate.  With a jerk limit of zero the profile is
+ *  trapezoidal, otherwise the acceleration ramps at the jerk limit to give an
+ *  S-curve.  After the last target the motor is soft stopped and any residual
+ *  position error is removed with a move().
+ *
+ *  Speeds and accelerations are in steps/sec and steps/sec/sec like the rest
+ *  of the L6470 interface.  The chip's own ACC/DEC should be at least as high
+ *  as the planner limits so the chip follows the streamed speeds.
+ *
+ *  By default the planned position is resynchronised from ABS_POS on every
+ *  update.  setFeedback() reduces how often that read happens.
+ */
+class L6470Planner
+{
+protected:
+    struct Segment
+    {
+        double  target;     // Absolute position in full steps
+        float   vmax;
+        float   acc;
+        float   jerk;
+        float   vexit;      // Speed allowed when passing the target
+        int     dir;        // 1 toward increasing position, -1 decreasing
+    };
+
+    L6470*              m_axis;
+    std::deque<Segment> m_queue;
+    double              m_pos;      // Full steps
+    float               m_vel;      // Signed steps/sec
+    float               m_accCur;   // Signed steps/sec/sec
+    float               m_sentVel;
+    float               m_vmax;
+    float               m_acc;
+    float               m_jerk;
+    int64_t             m_period;
+    int64_t             m_next;
+    int64_t             m_last;
+    int                 m_feedback;
+    int                 m_tick;
+    int                 m_state;
+    int32_t             m_final;    // Last target in microsteps
+
+public:
+    L6470Planner(L6470& axis, float hz = 200);
+    virtual ~L6470Planner();
+
+    void        setLimits(float vmax, float acc, float jerk = 0);
+    void        setRate(float hz);
+    void        setFeedback(int ticks);
+    void        reset();
+
+    int         push(int32_t pos);
+    int         push(int32_t pos, float vmax, float acc, float jerk = 0);
+    int         pending();
+    int         getState();
+    int         isDone();
+    float       getVelocity();
+    double      getPosition();
+
+    int         service();
+    int         update(float dt);
+    void        stop();
+
+protected:
+    void        plan();
+    uint8_t     chipDir(float vel);
+};
+
+
+
+
+
+/** @brief Create a planner for an axis.
+ *
+ *  @param axis The axis to drive.  Not owned by the planner.
+ *  @param hz Rate of speed updates sent by service().
+ */
+inline L6470Planner::L6470Planner(L6470& axis, float hz)
+{
+    m_axis      = &axis;
+    m_vmax      = 500;
+    m_acc       = 100;
+    m_jerk      = 0;
+    m_feedback  = 1;
+    m_tick      = 0;
+    m_next      = 0;
+    m_last      = 0;
+    setRate(hz);
+    reset();
+}
+
+
+inline L6470Planner::~L6470Planner()
+{}
+
+
+/** @brief Set the limits used by push(int32_t).
+ *
+ *  @param vmax Maximum speed in steps/sec.
+ *  @param acc Acceleration and deceleration in steps/sec/sec.
+ *  @param jerk Rate of change of acceleration.  0 for a trapezoidal profile.
+ */
+inline void L6470Planner::setLimits(float vmax, float acc, float jerk)
+{
+    m_vmax = vmax;
+    m_acc  = acc;
+    m_jerk = jerk;
+}
+
+
+/** @brief Set the rate of speed updates sent by service().
+ */
+inline void L6470Planner::setRate(float hz)
+{
+    if (hz <= 0)
+        hz = 200;
+    m_period = (int64_t)(1000000000.0 / hz);
+}
+
+
+/** @brief Set how often the planned position is resynchronised from ABS_POS.
+ *
+ *  @param ticks Number of updates between reads.  0 never reads ABS_POS.
+ */
+inline void L6470Planner::setFeedback(int ticks)
+{
+    m_feedback = (ticks > 0) ? ticks : 0;
+}
+
+
+/** @brief Drop all queued targets and take the current chip position.
+ *
+ *  The motor should be stopped.
+ */
+inline void L6470Planner::reset()
+{
+    m_queue.clear();
+    m_pos     = (double)m_axis->getPosition() / m_axis->getMicroSteps();
+    m_final   = m_axis->getPosition();
+    m_vel     = 0;
+    m_accCur  = 0;
+    m_sentVel = 0;
+    m_state   = L6470_PLAN_IDLE;
+}
+
+
+/** @brief Queue an absolute target using the limits from setLimits().
+ *
+ *  @param pos Absolute position in microsteps.
+ *  @return int: Number of targets queued.
+ */
+inline int L6470Planner::push(int32_t pos)
+{
+    return push(pos, m_vmax, m_acc, m_jerk);
+}
+
+
+/** @brief Queue an absolute target with its own limits.
+ *
+ *  @param pos Absolute position in microsteps.
+ *  @param vmax Maximum speed toward this target in steps/sec.
+ *  @param acc Acceleration toward this target in steps/sec/sec.
+ *  @param jerk Jerk limit toward this target, 0 for none.
+ *  @return int: Number of targets queued.
+ */
+inline int L6470Planner::push(int32_t pos, float vmax, float acc, float jerk)
+{
+    // A stop in progress is abandoned.  The chip is slowing from wherever
+    //  it got to, so plan the new targets from there.
+    if (m_state == L6470_PLAN_STOPPING)
+    {
+        m_pos     = (double)m_axis->getPosition() / m_axis->getMicroSteps();
+        m_vel     = 0;
+        m_accCur  = 0;
+        m_sentVel = 0;
+        m_tick    = 0;
+        m_state   = L6470_PLAN_RUNNING;
+    }
+
+    Segment seg;
+    seg.target = (double)pos / m_axis->getMicroSteps();
+    seg.vmax   = vmax;
+    seg.acc    = (acc > 0) ? acc : 1;
+    seg.jerk   = jerk;
+    seg.vexit  = 0;
+
+    double start = m_queue.empty() ? m_pos : m_queue.back().target;
+    seg.dir = (seg.target >= start) ? 1 : -1;
+
+    m_queue.push_back(seg);
+    m_final = pos;
+    if (m_state == L6470_PLAN_IDLE or m_state == L6470_PLAN_SETTLING)
+        m_state = L6470_PLAN_RUNNING;
+
+    plan();
+    return m_queue.size();
+}
+
+
+/** @brief Returns the number of targets not yet reached.
+ */
+inline int L6470Planner::pending()
+{
+    return m_queue.size();
+}
+
+
+/** @brief Returns the planner state (L6470_PLANNER_STATE).
+ */
+inline int L6470Planner::getState()
+{
+    return m_state;
+}
+
+
+/** @brief Returns 1 when every target has been reached and the motor stopped.
+ */
+inline int L6470Planner::isDone()
+{
+    return (m_state == L6470_PLAN_IDLE) ? 1 : 0;
+}
+
+
+/** @brief Returns the planned velocity in steps/sec, signed by direction.
+ */
+inline float L6470Planner::getVelocity()
+{
+    return m_vel;
+}
+
+
+/** @brief Returns the planned position in microsteps.
+ */
+inline double L6470Planner::getPosition()
+{
+    return m_pos * m_axis->getMicroSteps();
+}
+
+
+/** @brief Run update() if the update period has passed.
+ *
+ *  @return int: 1 if an update was run, 0 if not due.
+ */
+inline int L6470Planner::service()
+{
+    int64_t now = L6470::monotonic();
+    if (now < m_next)
+        return 0;
+
+    float dt = (m_last > 0) ? (now - m_last) / 1e9 : m_period / 1e9;
+    m_last = now;
+    m_next += m_period;
+    if (m_next < now)
+        m_next = now + m_period;
+
+    update(dt);
+    return 1;
+}
+
+
+/** @brief Advance the plan by dt seconds and send the new speed to the chip.
+ *
+ *  @param dt Time since the last update in seconds.
+ *  @return int: The planner state after the update.
+ */
+inline int L6470Planner::update(float dt)
+{
+    if (dt <= 0)
+        return m_state;
+
+    if ((m_state == L6470_PLAN_STOPPING or m_state == L6470_PLAN_SETTLING) and
+        !m_queue.empty())
+        m_state = L6470_PLAN_RUNNING;   // Never settle with targets left
+
+    if (m_state == L6470_PLAN_STOPPING or m_state == L6470_PLAN_SETTLING)
+    {
+        if (m_axis->isBusy())
+            return m_state;
+
+        int32_t pos = m_axis->getPosition();
+        m_pos = (double)pos / m_axis->getMicroSteps();
+        if (m_state == L6470_PLAN_STOPPING and pos != m_final)
+        {
+            m_axis->move(m_axis->isInverted() ? pos - m_final : m_final - pos);
+            m_state = L6470_PLAN_SETTLING;
+        }
+        else
+            m_state = L6470_PLAN_IDLE;
+        return m_state;
+    }
+
+    if (m_state != L6470_PLAN_RUNNING)
+        return m_state;
+
+    if (m_feedback and (++m_tick >= m_feedback))
+    {
+        m_tick = 0;
+        m_pos = (double)m_axis->getPosition() / m_axis->getMicroSteps();
+    }
+
+    // Drop targets we have reached or passed
+    double tol = 0.5 / m_axis->getMicroSteps();
+    while (!m_queue.empty())
+    {
+        double d = m_queue.front().target - m_pos;
+        int passed = (m_queue.front().dir > 0) ? (d < 0) : (d > 0);
+        if (fabs(d) > tol and !passed)
+            break;
+        m_queue.pop_front();
+    }
+
+    float vt = 0;
+    float acc = m_acc;
+    float jerk = 0;
+    if (!m_queue.empty())
+    {
+        const Segment& seg = m_queue.front();
+        double d = seg.target - m_pos;
+        // Brake from where we will be next update, and allow for the time
+        //  the jerk limit takes to build up the deceleration.
+        float lag  = dt/2;
+        if (seg.jerk > 0)
+            lag += seg.acc / (2*seg.jerk);
+        float dist = fabs(d) - fabs(m_vel)*lag;
+        if (dist < 0)
+            dist = 0;
+        float vbrake = sqrt(seg.vexit*seg.vexit + 2*seg.acc*dist);
+
+        vt   = (vbrake < seg.vmax) ? vbrake : seg.vmax;
+        vt   = (d < 0) ? -vt : vt;
+        acc  = seg.acc;
+        jerk = seg.jerk;
+
+        // Never reverse without passing through zero speed
+        if ((vt > 0 and m_vel < 0) or (vt < 0 and m_vel > 0))
+            vt = 0;
+    }
+
+    float dv = vt - m_vel;
+    float aWant = dv / dt;
+    if (aWant >  acc) aWant =  acc;
+    if (aWant < -acc) aWant = -acc;
+
+    if (jerk > 0)
+    {
+        // Start easing the acceleration off early enough to land on vt
+        if ((dv > 0 and m_accCur > 0 and dv <= m_accCur*m_accCur/(2*jerk)) or
+            (dv < 0 and m_accCur < 0 and -dv <= m_accCur*m_accCur/(2*jerk)))
+            aWant = 0;
+
+        float da = aWant - m_accCur;
+        if (da >  jerk*dt) da =  jerk*dt;
+        if (da < -jerk*dt) da = -jerk*dt;
+        m_accCur += da;
+
+        // Do not let the ramp carry us past the speed we want
+        if ((dv > 0 and m_accCur*dt > dv) or (dv < 0 and m_accCur*dt < dv))
+            m_accCur = dv / dt;
+    }
+    else
+        m_accCur = aWant;
+
+    m_pos += (m_vel + m_accCur*dt/2) * dt;
+    m_vel += m_accCur * dt;
+
+    if (m_queue.empty())
+    {
+        // Last target reached.  Let the chip finish the stop.
+        m_axis->softStop();
+        m_vel     = 0;
+        m_accCur  = 0;
+        m_sentVel = 0;
+        m_state   = L6470_PLAN_STOPPING;
+        return m_state;
+    }
+
+    if (fabs(m_vel - m_sentVel) >= 0.5 or (m_vel == 0) != (m_sentVel == 0))
+    {
+        m_axis->run(chipDir(m_vel), fabs(m_vel));
+        m_sentVel = m_vel;
+    }
+
+    return m_state;
+}
+
+
+/** @brief Drop all queued targets and soft stop the motor.
+ */
+inline void L6470Planner::stop()
+{
+    m_queue.clear();
+    m_axis->softStop();
+    m_vel     = 0;
+    m_accCur  = 0;
+    m_sentVel = 0;
+    m_final   = m_axis->getPosition();
+    m_state   = L6470_PLAN_STOPPING;
+}
+
+
+/*
+ *  Backward pass through the queue to find the highest speed each target can
+ *  be passed at while still being able to slow down for every later target.
+ */
+inline void L6470Planner::plan()
+{
+    if (m_queue.empty())
+        return;
+
+    m_queue.back().vexit = 0;
+    for (int i=m_queue.size()-2; i>=0; i--)
+    {
+        Segment& cur  = m_queue[i];
+        Segment& next = m_queue[i+1];
+        double dNext  = next.target - cur.target;
+
+        if (dNext == 0 or cur.dir != next.dir)
+        {
+            cur.vexit = 0;
+            continue;
+        }
+
+        float v = sqrt(next.vexit*next.vexit + 2*next.acc*fabs(dNext));
+        if (v > cur.vmax)  v = cur.vmax;
+        if (v > next.vmax) v = next.vmax;
+        cur.vexit = v;
+    }
+}
+
+
+/*
+ *  The direction to pass to run() so ABS_POS moves with the sign of vel.
+ *  run() inverts the direction itself when the axis is inverted.
+ */
+inline uint8_t L6470Planner::chipDir(float vel)
+{
+    uint8_t dir = (vel >= 0) ? dSPIN_FWD : dSPIN_REV;
+    if (m_axis->isInverted())
+        dir = (dir == dSPIN_FWD) ? dSPIN_REV : dSPIN_FWD;
+    return dir;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_PLANNER_H
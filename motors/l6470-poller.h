@@ -0,0 +1,327 @@
+#ifndef L6470_POLLER_H
+#define L6470_POLLER_H
+
+#include <stdint.h>
+#include <vector>
+#include "l6470.h"
+
+/** @brief Callback invoked with each newly polled axis status.
+ *
+ *  @param idx Index of the axis in the poller.
+ *  @param st The decoded status.
+ *  @param ctx The context pointer given to subscribe().
+ */
+typedef void (*L6470StatusCallback)(int idx, const L6470Status& st, void* ctx);
+
+
+/** @brief Reads the STATUS of a set of L6470 axes once per tick
+ *
+ *  Each poll reads STATUS exactly once for every axis.  Axes attached to the
+ *  same L6470Chain are read together in a single chained frame.  The decoded
+ *  status is kept by each axis (see L6470::lastStatus) and the busy,
+ *  direction and error queries of the poller are answered from it without
+ *  touching the bus.  Subscribers are called with the status of each axis
+ *  after every poll.
+ *
+ *  The poll rate is set with setRate().  Call service() from the control loop
+ *  and the bus is only read when a poll is due.
+ *
+ *  Status is read with GET_STATUS, which clears the latched error and switch
+ *  event flags in the chip.  The decoded copy keeps them until the next poll.
+ */
+class L6470StatusPoller
+{
+protected:
+    struct Subscriber
+    {
+        L6470StatusCallback cb;
+        void*               ctx;
+    };
+
+    std::vector<L6470*>         m_axes;
+    std::vector<Subscriber>     m_subs;
+    int64_t                     m_period;
+    int64_t                     m_next;
+    uint32_t                    m_polls;
+
+public:
+    L6470StatusPoller(float hz = 100);
+    virtual ~L6470StatusPoller();
+
+    int         addAxis(L6470& axis);
+    int         count();
+    L6470*      getAxis(int idx);
+    void        setRate(float hz);
+    float       getRate();
+
+    int         service();
+    int         poll();
+    uint32_t    pollCount();
+
+    void        subscribe(L6470StatusCallback cb, void* ctx = NULL);
+    void        unsubscribe(L6470StatusCallback cb, void* ctx = NULL);
+
+    const L6470Status& status(int idx);
+    uint32_t    isBusy(int idx);
+    uint8_t     getDir(int idx);
+    uint32_t    getError(int idx);
+};
+
+
+
+
+
+/** @brief Creates a poller with no axes.
+ *
+ *  @param hz Polls per second performed by service().
+ */
+inline L6470StatusPoller::L6470StatusPoller(float hz)
+{
+    m_next  = 0;
+    m_polls = 0;
+    setRate(hz);
+}
+
+
+inline L6470StatusPoller::~L6470StatusPoller()
+{}
+
+
+/** @brief Add an axis to the poller.
+ *
+ *  The axis is not owned by the poller and must remain valid for the life of
+ *  the poller.
+ *
+ *  @param axis The axis to poll.
+ *  @return int: Index of the axis.
+ */
+inline int L6470StatusPoller::addAxis(L6470& axis)
+{
+    m_axes.push_back(&axis);
+    return m_axes.size() - 1;
+}
+
+
+/** @brief Returns the number of axes polled.
+ */
+inline int L6470StatusPoller::count()
+{
+    return m_axes.size();
+}
+
+
+/** @brief Returns the axis at the given index or NULL.
+ */
+inline L6470* L6470StatusPoller::getAxis(int idx)
+{
+    if (idx < 0 or idx >= (int)m_axes.size())
+        return NULL;
+    return m_axes[idx];
+}
+
+
+/** @brief Set the number of polls per second performed by service().
+ *
+ *  @param hz Poll rate.  Zero or less polls on every call to service().
+ */
+inline void L6470StatusPoller::setRate(float hz)
+{
+    if (hz > 0)
+        m_period = (int64_t)(1000000000.0 / hz);
+    else
+        m_period = 0;
+}
+
+
+/** @brief Returns the poll rate in polls per second, 0 if unlimited.
+ */
+inline float L6470StatusPoller::getRate()
+{
+    if (m_period == 0)
+        return 0;
+    return 1000000000.0 / m_period;
+}
+
+
+/** @brief Poll if the poll period has passed since the last poll.
+ *
+ *  @return int: 1 if a poll was performed, 0 if not due, negative on failure.
+ */
+inline int L6470StatusPoller::service()
+{
+    int64_t now = L6470::monotonic();
+    if (now < m_next)
+        return 0;
+
+    // Stay on the poll grid unless we have fallen a whole period behind
+    m_next += m_period;
+    if (m_next < now)
+        m_next = now + m_period;
+
+    int result = poll();
+    return (result < 0) ? result : 1;
+}
+
+
+/** @brief Read the status of every axis now.
+ *
+ *  @return int: Negative if any read failed.
+ */
+inline int L6470StatusPoller::poll()
+{
+    int err = 0;
+    std::vector<L6470Chain*> chains;
+    static const uint8_t cmd[3] = {dSPIN_GET_STATUS, dSPIN_NOP, dSPIN_NOP};
+
+    // Stage one GET_STATUS per chained axis so each chain is one transfer
+    for (unsigned int i=0; i<m_axes.size(); i++)
+    {
+        L6470Chain* chain = m_axes[i]->getChain();
+        if (!chain)
+            continue;
+
+        unsigned int c = 0;
+        while (c < chains.size() and chains[c] != chain)
+            c++;
+        if (c == chains.size())
+        {
+            chain->clear();
+            chains.push_back(chain);
+        }
+
+        chain->stage(m_axes[i]->getSlot(), cmd, 3);
+    }
+
+    for (unsigned int c=0; c<chains.size(); c++)
+    {
+        if (chains[c]->transfer() < 0)
+        {
+            err = -1;
+            continue;
+        }
+
+        for (unsigned int i=0; i<m_axes.size(); i++)
+        {
+            if (m_axes[i]->getChain() != chains[c])
+                continue;
+
+            uint8_t* rsp = chains[c]->response(m_axes[i]->getSlot());
+            if (rsp)
+                m_axes[i]->updateStatus((rsp[1]<<8) | rsp[2]);
+        }
+    }
+
+    for (unsigned int i=0; i<m_axes.size(); i++)
+    {
+        if (!m_axes[i]->getChain())
+            m_axes[i]->getStatus();
+    }
+
+    m_polls++;
+
+    for (unsigned int i=0; i<m_axes.size(); i++)
+    {
+        for (unsigned int s=0; s<m_subs.size(); s++)
+            m_subs[s].cb(i, m_axes[i]->lastStatus(), m_subs[s].ctx);
+    }
+
+    return err;
+}
+
+
+/** @brief Returns the number of polls performed.
+ */
+inline uint32_t L6470StatusPoller::pollCount()
+{
+    return m_polls;
+}
+
+
+/** @brief Register a callback to receive every polled status.
+ *
+ *  @param cb The function to call.
+ *  @param ctx Pointer passed back to the callback.
+ */
+inline void L6470StatusPoller::subscribe(L6470StatusCallback cb, void* ctx)
+{
+    Subscriber sub;
+    sub.cb  = cb;
+    sub.ctx = ctx;
+    if (cb)
+        m_subs.push_back(sub);
+}
+
+
+/** @brief Remove a callback registered with subscribe().
+ */
+inline void L6470StatusPoller::unsubscribe(L6470StatusCallback cb, void* ctx)
+{
+    for (unsigned int s=0; s<m_subs.size(); s++)
+    {
+        if (m_subs[s].cb == cb and m_subs[s].ctx == ctx)
+        {
+            m_subs.erase(m_subs.begin() + s);
+            return;
+        }
+    }
+}
+
+
+/** @brief Returns the last polled status of an axis.
+ */
+inline const L6470Status& L6470StatusPoller::status(int idx)
+{
+    return m_axes[idx]->lastStatus();
+}
+
+
+/** @brief Same result as L6470::isBusy() from the last poll.
+ */
+inline uint32_t L6470StatusPoller::isBusy(int idx)
+{
+    const L6470Status& st = status(idx);
+    return st.busy ? st.motStatus : 0;
+}
+
+
+/** @brief Same result as L6470::getDir() from the last poll.
+ */
+inline uint8_t L6470StatusPoller::getDir(int idx)
+{
+    return status(idx).dir;
+}
+
+
+/** @brief Same result as L6470::getError() from the last poll.
+ */
+inline uint32_t L6470StatusPoller::getError(int idx)
+{
+    return status(idx).error;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_POLLER_H
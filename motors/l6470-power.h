@@ -0,0 +1,374 @@
+#ifndef L6470_POWER_H
+#define L6470_POWER_H
+
+#include <stdint.h>
+#include "l6470.h"
+#include "itempsensor.h"
+
+enum L6470_POWER_CONST
+{
+    L6470_POWER_IDLE_MS   = 500,    // Default standstill time before hold drops
+    L6470_POWER_TEMP_MS   = 1000    // Default interval between sensor reads
+};
+
+
+enum L6470_POWER_PHASE
+{
+    L6470_POWER_MOVING  = 0,        // Motor running, accelerating or braking
+    L6470_POWER_HOLDING = 1,        // Stopped, full holding voltage
+    L6470_POWER_IDLE    = 2,        // Stopped for a while, reduced hold
+    L6470_POWER_HIZ     = 3         // Bridges off
+};
+
+
+/** @brief Set of KVAL register values for one axis.
+ */
+typedef struct L6470KvalSet
+{
+    uint8_t     hold;
+    uint8_t     run;
+    uint8_t     acc;
+    uint8_t     dec;
+} L6470KvalSet;
+
+
+/** @brief Adjusts the KVAL registers of an L6470 to cut heat in the driver
+ *
+ *  The chip already picks KVAL_ACC, KVAL_DEC and KVAL_RUN for each part of a
+ *  move and KVAL_HOLD at standstill, but those are set once and sized for
+ *  the worst case.  This policy adjusts them while running:
+ *
+ *  - Once the motor has stood still for the idle time KVAL_HOLD drops to the
+ *    idle hold level, and returns to nominal when motion starts.
+ *
+ *  - With a temperature sensor (an ITempSensor on or near the driver) every
+ *    KVAL is scaled down linearly between the derating start and full
+ *    temperatures, to the minimum scale at and above full.
+ *
+ *  - A thermal warning from the chip's STATUS applies the minimum scale
+ *    until it clears.  The warning is latched and update() reads STATUS
+ *    without clearing it, so the scale stays at the minimum until a
+ *    getStatus() elsewhere (e.g. L6470Telemetry) clears the flag.
+ *
+ *  update() is called from the control loop.  It reads STATUS once and the
+ *  sensor at most once per sensor interval, and writes only registers whose
+ *  value changed.  The writes go out as one staged bus operation, or join
+ *  the axis' staged commands if it is already staging (e.g. for an
+ *  L6470Group release).  KVAL registers may be written while moving.
+ */
+class L6470PowerPolicy
+{
+protected:
+    L6470*          m_axis;
+    ITempSensor*    m_sensor;
+    L6470KvalSet    m_nominal;
+    L6470KvalSet    m_applied;
+    uint8_t         m_idleHold;
+    int64_t         m_idleNs;
+    int64_t         m_tempNs;
+    float           m_tempStart;
+    float           m_tempFull;
+    float           m_minScale;
+    float           m_temp;
+    float           m_scale;
+    int64_t         m_stillSince;   // 0 while moving
+    int64_t         m_lastTemp;
+    int             m_phase;
+    uint32_t        m_writes;
+
+public:
+    L6470PowerPolicy(L6470& axis, ITempSensor* sensor = NULL);
+    virtual ~L6470PowerPolicy();
+
+    void        setNominal(const L6470KvalSet& kval);
+    void        setIdleHold(uint8_t kval, uint32_t afterMs = L6470_POWER_IDLE_MS);
+    void        setDerating(float startC, float fullC, float minScale);
+    void        setSensor(ITempSensor* sensor,
+                          uint32_t intervalMs = L6470_POWER_TEMP_MS);
+
+    int         update();
+
+    int         getPhase();
+    float       getScale();
+    float       getTemp();
+    const L6470KvalSet& getApplied();
+    uint32_t    writeCount();
+
+protected:
+    uint8_t     scaled(uint8_t kval);
+    int         apply(const L6470KvalSet& kval);
+};
+
+
+
+
+
+/** @brief Creates a policy for an axis.
+ *
+ *  The KVALs in the chip become the nominal set.  Idle hold reduction and
+ *  derating are off until set.
+ *
+ *  @param axis The axis to manage.
+ *  @param sensor Optional temperature sensor near the driver.
+ */
+inline L6470PowerPolicy::L6470PowerPolicy(L6470& axis, ITempSensor* sensor)
+{
+    m_axis      = &axis;
+    m_sensor    = sensor;
+    m_nominal.hold = axis.getParam<dSPIN_KVAL_HOLD>();
+    m_nominal.run  = axis.getParam<dSPIN_KVAL_RUN>();
+    m_nominal.acc  = axis.getParam<dSPIN_KVAL_ACC>();
+    m_nominal.dec  = axis.getParam<dSPIN_KVAL_DEC>();
+    m_applied   = m_nominal;
+    m_idleHold  = m_nominal.hold;
+    m_idleNs    = (int64_t)L6470_POWER_IDLE_MS * 1000000;
+    m_tempNs    = (int64_t)L6470_POWER_TEMP_MS * 1000000;
+    m_tempStart = 0;
+    m_tempFull  = 0;
+    m_minScale  = 1;
+    m_temp      = 0;
+    m_scale     = 1;
+    m_stillSince = 0;
+    m_lastTemp  = 0;
+    m_phase     = L6470_POWER_HOLDING;
+    m_writes    = 0;
+}
+
+
+inline L6470PowerPolicy::~L6470PowerPolicy()
+{}
+
+
+/** @brief Set the KVALs used at normal temperature while moving or holding.
+ */
+inline void L6470PowerPolicy::setNominal(const L6470KvalSet& kval)
+{
+    m_nominal = kval;
+}
+
+
+/** @brief Set the reduced holding level.
+ *
+ *  @param kval KVAL_HOLD after the motor has been still for afterMs.
+ *  @param afterMs Standstill time before the hold level drops.
+ */
+inline void L6470PowerPolicy::setIdleHold(uint8_t kval, uint32_t afterMs)
+{
+    m_idleHold = kval;
+    m_idleNs   = (int64_t)afterMs * 1000000;
+}
+
+
+/** @brief Set the temperature derating curve.
+ *
+ *  @param startC Temperature in C where derating begins.
+ *  @param fullC Temperature in C where the minimum scale is reached.
+ *  @param minScale Fraction of the nominal KVALs at and above fullC.
+ */
+inline void L6470PowerPolicy::setDerating(float startC, float fullC,
+                                          float minScale)
+{
+    m_tempStart = startC;
+    m_tempFull  = (fullC > startC) ? fullC : startC;
+    m_minScale  = (minScale < 0) ? 0 : (minScale > 1) ? 1 : minScale;
+}
+
+
+/** @brief Set the temperature sensor.
+ *
+ *  @param sensor Sensor near the driver, NULL for none.
+ *  @param intervalMs Shortest time between sensor reads.
+ */
+inline void L6470PowerPolicy::setSensor(ITempSensor* sensor,
+                                        uint32_t intervalMs)
+{
+    m_sensor   = sensor;
+    m_tempNs   = (int64_t)intervalMs * 1000000;
+    m_lastTemp = 0;
+}
+
+
+/** @brief Bring the KVALs in line with the motion and temperature.
+ *
+ *  @return int: Number of registers written, negative on a bus failure.
+ */
+inline int L6470PowerPolicy::update()
+{
+    int64_t now = L6470::monotonic();
+
+    // Temperature, rate limited since the sensor may be slow to read
+    if (m_sensor and m_sensor->isEnabled() and now - m_lastTemp >= m_tempNs)
+    {
+        float t = m_sensor->getTemp_C();
+        m_lastTemp = now;
+        if (t > -273)
+            m_temp = t;
+    }
+
+    m_scale = 1;
+    if (m_sensor and m_minScale < 1 and m_temp > m_tempStart)
+    {
+        if (m_temp >= m_tempFull)
+            m_scale = m_minScale;
+        else
+            m_scale = 1 - (1 - m_minScale) * (m_temp - m_tempStart)
+                          / (m_tempFull - m_tempStart);
+    }
+
+    // While staging no reply is available, use the last STATUS read.  The
+    //  register is read with GET_PARAM as GET_STATUS would clear the latched
+    //  fault flags before anything else saw them.
+    if (!m_axis->isStaging())
+        m_axis->updateStatus(m_axis->getParam<dSPIN_STATUS>());
+    const L6470Status& st = m_axis->lastStatus();
+    if (st.thWarn and m_minScale < m_scale)
+        m_scale = m_minScale;
+
+    // Motion phase
+    if (st.hiz)
+    {
+        m_phase = L6470_POWER_HIZ;
+        m_stillSince = 0;
+    }
+    else if (st.busy or st.motStatus != 0)
+    {
+        m_phase = L6470_POWER_MOVING;
+        m_stillSince = 0;
+    }
+    else
+    {
+        if (!m_stillSince)
+            m_stillSince = now;
+        m_phase = (now - m_stillSince >= m_idleNs) ? L6470_POWER_IDLE
+                                                   : L6470_POWER_HOLDING;
+    }
+
+    L6470KvalSet want;
+    want.hold = scaled((m_phase == L6470_POWER_IDLE) ? m_idleHold
+                                                     : m_nominal.hold);
+    want.run  = scaled(m_nominal.run);
+    want.acc  = scaled(m_nominal.acc);
+    want.dec  = scaled(m_nominal.dec);
+    return apply(want);
+}
+
+
+/** @brief Returns the motion phase seen by the last update().
+ */
+inline int L6470PowerPolicy::getPhase()
+{
+    return m_phase;
+}
+
+
+/** @brief Returns the derating scale in force, 1 for none.
+ */
+inline float L6470PowerPolicy::getScale()
+{
+    return m_scale;
+}
+
+
+/** @brief Returns the last good temperature reading in C.
+ */
+inline float L6470PowerPolicy::getTemp()
+{
+    return m_temp;
+}
+
+
+/** @brief Returns the KVALs last written.
+ */
+inline const L6470KvalSet& L6470PowerPolicy::getApplied()
+{
+    return m_applied;
+}
+
+
+/** @brief Returns the number of KVAL registers written.
+ */
+inline uint32_t L6470PowerPolicy::writeCount()
+{
+    return m_writes;
+}
+
+
+/*
+ *  Applies the derating scale to a KVAL.
+ */
+inline uint8_t L6470PowerPolicy::scaled(uint8_t kval)
+{
+    return (uint8_t)(kval * m_scale + 0.5);
+}
+
+
+/*
+ *  Writes the registers that differ from the last values written, in one
+ *  bus operation.
+ */
+inline int L6470PowerPolicy::apply(const L6470KvalSet& kval)
+{
+    int count = 0;
+    int result = 0;
+    int stage = !m_axis->isStaging();
+
+    if (stage)
+        m_axis->beginStage();
+
+    if (kval.hold != m_applied.hold)
+    {
+        m_axis->setParam<dSPIN_KVAL_HOLD>(kval.hold);
+        count++;
+    }
+    if (kval.run != m_applied.run)
+    {
+        m_axis->setParam<dSPIN_KVAL_RUN>(kval.run);
+        count++;
+    }
+    if (kval.acc != m_applied.acc)
+    {
+        m_axis->setParam<dSPIN_KVAL_ACC>(kval.acc);
+        count++;
+    }
+    if (kval.dec != m_applied.dec)
+    {
+        m_axis->setParam<dSPIN_KVAL_DEC>(kval.dec);
+        count++;
+    }
+
+    if (stage)
+        result = m_axis->flushStage();
+    if (result < 0)
+        return result;      // Tried again next update
+
+    m_applied = kval;
+    m_writes += count;
+    return count;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_POWER_H
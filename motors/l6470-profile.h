@@ -0,0 +1,213 @@
+#ifndef L6470_PROFILE_H
+#define L6470_PROFILE_H
+
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include "l6470-support.h"
+
+/** @brief Saved set of L6470 register values
+ *
+ *  Holds the value of each register that was captured along with a mask of
+ *  which registers hold a value.  Profiles are filled by L6470::snapshot()
+ *  and written back to a chip with L6470::restore().  A profile can be saved
+ *  to and loaded from a text stream with one register per line:
+ *
+ *      ACC 0x08A
+ *      CONFIG 0x2E88
+ *
+ *  Lines starting with '#' and registers that are unknown or read-only are
+ *  ignored when loading.
+ */
+class L6470Profile
+{
+public:
+    uint32_t    value[dSPIN_REG_COUNT];
+    uint32_t    valid;
+
+public:
+    L6470Profile();
+
+    void        clear();
+    int         has(uint8_t param) const;
+    uint32_t    get(uint8_t param) const;
+    void        set(uint8_t param, uint32_t val);
+
+    int         save(std::ostream& os) const;
+    int         load(std::istream& is);
+
+    static const char* regName(uint8_t param);
+    static int         regLookup(const std::string& name);
+};
+
+
+
+
+
+/** @brief Creates an empty profile.
+ */
+inline L6470Profile::L6470Profile()
+{
+    clear();
+}
+
+
+/** @brief Remove every register value from the profile.
+ */
+inline void L6470Profile::clear()
+{
+    for (int i=0; i<dSPIN_REG_COUNT; i++)
+        value[i] = 0;
+    valid = 0;
+}
+
+
+/** @brief Returns 1 if the profile holds a value for the register.
+ */
+inline int L6470Profile::has(uint8_t param) const
+{
+    if (param >= dSPIN_REG_COUNT)
+        return 0;
+    return (valid & (1UL << param)) ? 1 : 0;
+}
+
+
+/** @brief Returns the stored value of a register, 0 if not present.
+ */
+inline uint32_t L6470Profile::get(uint8_t param) const
+{
+    if (!has(param))
+        return 0;
+    return value[param];
+}
+
+
+/** @brief Store a register value in the profile.
+ *
+ *  The value is limited to the width of the register.
+ */
+inline void L6470Profile::set(uint8_t param, uint32_t val)
+{
+    if (param >= dSPIN_REG_COUNT or dSPIN_REG_TABLE[param].bits == 0)
+        return;
+
+    uint32_t mask = 0xFFFFFFFFUL >> (32 - dSPIN_REG_TABLE[param].bits);
+    value[param] = (val > mask) ? mask : val;
+    valid |= (1UL << param);
+}
+
+
+/** @brief Write the profile to a text stream.
+ *
+ *  @return int: Number of registers written.
+ */
+inline int L6470Profile::save(std::ostream& os) const
+{
+    int count = 0;
+
+    for (uint8_t i=0; i<dSPIN_REG_COUNT; i++)
+    {
+        if (!has(i))
+            continue;
+
+        os << regName(i) << " 0x" << std::hex << std::uppercase
+           << std::setw((dSPIN_REG_TABLE[i].bits + 3) / 4) << std::setfill('0')
+           << value[i] << std::dec << std::endl;
+        count++;
+    }
+
+    return count;
+}
+
+
+/** @brief Read register values from a text stream into the profile.
+ *
+ *  @return int: Number of registers read or -1 on a malformed line.
+ */
+inline int L6470Profile::load(std::istream& is)
+{
+    int count = 0;
+    std::string name;
+
+    while (is >> name)
+    {
+        if (name[0] == '#')
+        {
+            std::getline(is, name);
+            continue;
+        }
+
+        uint32_t val = 0;
+        if (!(is >> std::hex >> val >> std::dec))
+            return -1;
+
+        int param = regLookup(name);
+        if (param < 0 or (dSPIN_REG_TABLE[param].flags & dSPIN_REG_RO))
+            continue;
+
+        set(param, val);
+        count++;
+    }
+
+    return count;
+}
+
+
+/** @brief Returns the register name used in saved profiles.
+ */
+inline const char* L6470Profile::regName(uint8_t param)
+{
+    static const char* names[dSPIN_REG_COUNT] =
+    {
+        "", "ABS_POS", "EL_POS", "MARK", "SPEED", "ACC", "DEC", "MAX_SPEED",
+        "MIN_SPEED", "KVAL_HOLD", "KVAL_RUN", "KVAL_ACC", "KVAL_DEC",
+        "INT_SPD", "ST_SLP", "FN_SLP_ACC", "FN_SLP_DEC", "K_THERM", "ADC_OUT",
+        "OCD_TH", "STALL_TH", "FS_SPD", "STEP_MODE", "ALARM_EN", "CONFIG",
+        "STATUS"
+    };
+
+    if (param >= dSPIN_REG_COUNT)
+        return "";
+    return names[param];
+}
+
+
+/** @brief Returns the register address for a name or -1 if unknown.
+ */
+inline int L6470Profile::regLookup(const std::string& name)
+{
+    for (uint8_t i=1; i<dSPIN_REG_COUNT; i++)
+    {
+        if (name == regName(i))
+            return i;
+    }
+    return -1;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_PROFILE_H
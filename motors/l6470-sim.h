@@ -0,0 +1,380 @@
+#ifndef L6470_SIM_H
+#define L6470_SIM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include "ispi.h"
+#include "l6470-model.h"
+
+enum L6470_SIM_CONST
+{
+    L6470_SIM_SPEED  = 5000000,     // Default simulated SCK in Hz
+    L6470_SIM_CS_NS  = 800          // Chip-select deselect time per frame
+};
+
+
+/** @brief ISPI implementation backed by simulated L6470 chips
+ *
+ *  Lets L6470, L6470Chain and everything built on them run without hardware.
+ *  One or more L6470Model chips are connected in a daisy chain: byte n of
+ *  every chip-select frame goes to chip count()-1-n and the chips' replies
+ *  come back in the same positions, as on the real bus.  A chain of one is a
+ *  single chip on its own chip-select.
+ *
+ *  Simulated time advances by the time each transfer would take on the bus
+ *  at the configured speed, plus anything passed to advance().  With
+ *  setRealTime(1) the chips instead follow CLOCK_MONOTONIC so code that
+ *  sleeps or polls sees the motors move in real time.
+ *
+ *  Counters of transfers, frames and bytes are kept for benchmarking.
+ */
+class L6470Sim : public ISPI
+{
+protected:
+    std::vector<L6470Model> m_dev;
+    int         m_open;
+    int         m_persist;
+    int         m_realTime;
+    int64_t     m_simTime;
+    int64_t     m_lastReal;
+    uint32_t    m_transfers;
+    uint32_t    m_frames;
+    uint32_t    m_bytes;
+
+public:
+    L6470Sim(int count = 1);
+    virtual ~L6470Sim();
+
+    int         count();
+    L6470Model& device(int idx);
+
+    void        advance(int64_t ns);
+    int64_t     time();
+    void        setRealTime(int on);
+
+    uint32_t    transferCount();
+    uint32_t    frameCount();
+    uint32_t    byteCount();
+    void        resetCounters();
+
+    // ISPI interface
+    int         openBus();
+    int         closeBus();
+    int         isReady();
+    int         setBPW(int val);
+    int         setSpeed(int val);
+    int         setMode(int val);
+    int         setPersistent(int val);
+    int         isPersistent();
+    int         rwData(uint8_t *data, uint8_t len);
+    uint8_t     rwByte(uint8_t bt);
+    uint16_t    rwWord(uint16_t wd);
+    int         rwFrames(uint8_t *data, int len, uint8_t frameLen);
+
+protected:
+    void        sync();
+    static int64_t now();
+};
+
+
+
+
+
+/** @brief Creates a chain of simulated chips in their power-on state.
+ *
+ *  @param count Number of chips on the chip-select.
+ */
+inline L6470Sim::L6470Sim(int count)
+{
+    m_dev.resize((count > 0) ? count : 1);
+    m_speed     = L6470_SIM_SPEED;
+    m_spiMode   = 3;
+    m_spiBPW    = 8;
+    m_open      = 0;
+    m_persist   = 0;
+    m_realTime  = 0;
+    m_simTime   = 0;
+    m_lastReal  = now();
+    resetCounters();
+}
+
+
+inline L6470Sim::~L6470Sim()
+{}
+
+
+/** @brief Returns the number of chips on the chip-select.
+ */
+inline int L6470Sim::count()
+{
+    return m_dev.size();
+}
+
+
+/** @brief Returns one of the simulated chips.
+ *
+ *  @param idx Chain position, 0 is the chip wired to the master MOSI.
+ */
+inline L6470Model& L6470Sim::device(int idx)
+{
+    return m_dev[idx];
+}
+
+
+/** @brief Move simulated time forward for every chip.
+ *
+ *  @param ns Nanoseconds to advance.
+ */
+inline void L6470Sim::advance(int64_t ns)
+{
+    if (ns <= 0)
+        return;
+    m_simTime += ns;
+    for (unsigned int i=0; i<m_dev.size(); i++)
+        m_dev[i].advance(ns);
+}
+
+
+/** @brief Returns the simulated time in ns.
+ */
+inline int64_t L6470Sim::time()
+{
+    sync();
+    return m_simTime;
+}
+
+
+/** @brief Follow real time instead of bus time.
+ *
+ *  @param on 1 - Chips advance with CLOCK_MONOTONIC.  0 - Bus time only.
+ */
+inline void L6470Sim::setRealTime(int on)
+{
+    m_realTime = on ? 1 : 0;
+    m_lastReal = now();
+}
+
+
+/** @brief Returns the number of bus operations performed.
+ */
+inline uint32_t L6470Sim::transferCount()
+{
+    return m_transfers;
+}
+
+
+/** @brief Returns the number of chip-select frames shifted.
+ */
+inline uint32_t L6470Sim::frameCount()
+{
+    return m_frames;
+}
+
+
+/** @brief Returns the number of bytes shifted.
+ */
+inline uint32_t L6470Sim::byteCount()
+{
+    return m_bytes;
+}
+
+
+/** @brief Zero the transfer counters.
+ */
+inline void L6470Sim::resetCounters()
+{
+    m_transfers = 0;
+    m_frames    = 0;
+    m_bytes     = 0;
+}
+
+
+inline int L6470Sim::openBus()
+{
+    m_open = 1;
+    return 0;
+}
+
+
+inline int L6470Sim::closeBus()
+{
+    if (!m_persist)
+        m_open = 0;
+    return 0;
+}
+
+
+inline int L6470Sim::isReady()
+{
+    return m_open;
+}
+
+
+/** @brief Set the word size.  Only 8 bits is accepted, other values are
+ *  ignored.  Returns the previous setting.
+ */
+inline int L6470Sim::setBPW(int val)
+{
+    int result = m_spiBPW;
+    if (val == 8)
+        m_spiBPW = val;
+    return result;
+}
+
+
+/** @brief Set the simulated SCK rate in Hz.  Values of 0 or less are
+ *  ignored.  Returns the previous setting.
+ */
+inline int L6470Sim::setSpeed(int val)
+{
+    int result = m_speed;
+    if (val > 0)
+        m_speed = val;
+    return result;
+}
+
+
+/** @brief Set the SPI mode.  Only mode 3 is accepted, as the L6470 samples
+ *  on the rising edge with SCK idle high.  Returns the previous setting.
+ */
+inline int L6470Sim::setMode(int val)
+{
+    int result = m_spiMode;
+    if (val == 3)
+        m_spiMode = val;
+    return result;
+}
+
+
+inline int L6470Sim::setPersistent(int val)
+{
+    int was = m_persist;
+    m_persist = val ? 1 : 0;
+    if (!m_persist)
+        m_open = 0;
+    return was;
+}
+
+
+inline int L6470Sim::isPersistent()
+{
+    return m_persist;
+}
+
+
+/** @brief Shift a buffer as frames of count() bytes.
+ */
+inline int L6470Sim::rwData(uint8_t *data, uint8_t len)
+{
+    return rwFrames(data, len, m_dev.size());
+}
+
+
+/** @brief Shift one byte.  Only a chain of one chip takes a single byte as
+ *  a whole frame; on longer chains nothing is shifted and 0xFF, an idle
+ *  MISO, is returned.
+ */
+inline uint8_t L6470Sim::rwByte(uint8_t bt)
+{
+    uint8_t buf = bt;
+    if (rwFrames(&buf, 1, m_dev.size()) < 0)
+        return 0xFF;
+    return buf;
+}
+
+
+/** @brief Shift two bytes, MSB first.  Valid on chains of one or two chips,
+ *  otherwise nothing is shifted and 0xFFFF is returned.
+ */
+inline uint16_t L6470Sim::rwWord(uint16_t wd)
+{
+    uint8_t buf[2] = {(uint8_t)(wd >> 8), (uint8_t)wd};
+    if (rwFrames(buf, 2, m_dev.size()) < 0)
+        return 0xFFFF;
+    return (buf[0] << 8) | buf[1];
+}
+
+
+/** @brief Shift a buffer through the chain, one frame per chip-select.
+ *
+ *  @param data Bytes to send, overwritten with the bytes returned.
+ *  @param len Number of bytes.
+ *  @param frameLen Bytes per frame, must equal count().
+ *  @return int: Number of bytes shifted or -1 on error.
+ */
+inline int L6470Sim::rwFrames(uint8_t *data, int len, uint8_t frameLen)
+{
+    int n = m_dev.size();
+
+    if (!m_open or frameLen != n or len % n)
+        return -1;
+
+    sync();
+    m_transfers++;
+
+    for (int f=0; f<len; f+=n)
+    {
+        for (int j=0; j<n; j++)
+            data[f+j] = m_dev[n-1-j].shift(data[f+j]);
+
+        m_frames++;
+        m_bytes += n;
+        if (!m_realTime)
+            advance((int64_t)n * 8 * 1000000000LL / m_speed + L6470_SIM_CS_NS);
+    }
+
+    return len;
+}
+
+
+/*
+ *  In real time mode bring the chips up to the present.
+ */
+inline void L6470Sim::sync()
+{
+    if (!m_realTime)
+        return;
+
+    int64_t t = now();
+    advance(t - m_lastReal);
+    m_lastReal = t;
+}
+
+
+/*
+ *  Current CLOCK_MONOTONIC time in ns.
+ */
+inline int64_t L6470Sim::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_SIM_H
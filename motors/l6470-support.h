@@ -1,6 +1,8 @@
 #ifndef L6470_SUPPORT_H
 #define L6470_SUPPORT_H
 
+#include <stdint.h>
+
 // constant definitions for overcurrent thresholds. Write these values to
 //  register dSPIN_OCD_TH to set the level at which an overcurrent even occurs.
 typedef enum DSPIN_OVERCURRENT_CONST
@@ -226,7 +228,7 @@ typedef enum dSPIN_REG_ADDR_CONST
     dSPIN_ACC                  = 0x05,
     dSPIN_DEC                  = 0x06,
     dSPIN_MAX_SPEED            = 0x07,
-    dSPIN_MIN_SPEED            = 0x08d,
+    dSPIN_MIN_SPEED            = 0x08,
     dSPIN_FS_SPD               = 0x15,
     dSPIN_KVAL_HOLD            = 0x09,
     dSPIN_KVAL_RUN             = 0x0A,
@@ -244,10 +246,121 @@ typedef enum dSPIN_REG_ADDR_CONST
     dSPIN_ALARM_EN             = 0x17,
     dSPIN_CONFIG               = 0x18,
     dSPIN_STATUS               = 0x19,
+    
+    dSPIN_REG_COUNT            = 0x1A   // Number of register addresses
 
 } dSPIN_REG_ADDR_CONST;
 
 
+// Register descriptor flags
+typedef enum dSPIN_REG_FLAGS
+{
+    dSPIN_REG_RW               = 0x00,
+    dSPIN_REG_SIGNED           = 0x01,  // Two's complement value
+    dSPIN_REG_RO               = 0x02,  // Read-only, writes are ignored
+    dSPIN_REG_VOLATILE         = 0x04   // Changed by the chip during operation
+
+} dSPIN_REG_FLAGS;
+
+
+//  Register descriptions: address, width in bits and flags.  Conversion
+//  between register counts and steps/s or steps/s/s is in l6470-units.h.
+//
+//  ABS_POS is the current absolute offset from home and MARK a second stored
+//  position, both 22 bit two's complement.  EL_POS is the electrical position
+//  in the step cycle.  SPEED is the read-only current speed without direction.
+//  ACC and DEC set the acceleration rates (0xFFF for infinite acceleration)
+//  and cannot be written while the motor runs.  MAX_SPEED caps the speed of
+//  every command, MIN_SPEED sets the lowest speed and carries the LSPD_OPT bit
+//  in bit 12.  FS_SPD is the speed above which the chip switches to full
+//  steps.  KVAL_* are the ratiometric PWM output levels (255 is full voltage)
+//  for hold, run, accel and decel.  INT_SPD, ST_SLP and FN_SLP_* control the
+//  back EMF compensation and K_THERM the winding thermal drift compensation.
+//  ADC_OUT is the read-only ADC result.  OCD_TH is the overcurrent threshold
+//  in 375mA steps and STALL_TH the stall threshold in 31.25mA steps.
+//  STEP_MODE holds the microstep selection and BUSY/SYNC output setup,
+//  ALARM_EN the alarms that pull the FLAG pin low, CONFIG the assorted chip
+//  configuration (0x2E88 on boot) and STATUS the read-only chip status.
+//
+#define DSPIN_REG_LIST(X)                                                       \
+    X(dSPIN_ABS_POS,    22, dSPIN_REG_SIGNED | dSPIN_REG_VOLATILE)              \
+    X(dSPIN_EL_POS,      9, dSPIN_REG_VOLATILE)                                 \
+    X(dSPIN_MARK,       22, dSPIN_REG_SIGNED)                                   \
+    X(dSPIN_SPEED,      20, dSPIN_REG_RO | dSPIN_REG_VOLATILE)                  \
+    X(dSPIN_ACC,        12, dSPIN_REG_RW)                                       \
+    X(dSPIN_DEC,        12, dSPIN_REG_RW)                                       \
+    X(dSPIN_MAX_SPEED,  10, dSPIN_REG_RW)                                       \
+    X(dSPIN_MIN_SPEED,  13, dSPIN_REG_RW)                                       \
+    X(dSPIN_KVAL_HOLD,   8, dSPIN_REG_RW)                                       \
+    X(dSPIN_KVAL_RUN,    8, dSPIN_REG_RW)                                       \
+    X(dSPIN_KVAL_ACC,    8, dSPIN_REG_RW)                                       \
+    X(dSPIN_KVAL_DEC,    8, dSPIN_REG_RW)                                       \
+    X(dSPIN_INT_SPD,    14, dSPIN_REG_RW)                                       \
+    X(dSPIN_ST_SLP,      8, dSPIN_REG_RW)                                       \
+    X(dSPIN_FN_SLP_ACC,  8, dSPIN_REG_RW)                                       \
+    X(dSPIN_FN_SLP_DEC,  8, dSPIN_REG_RW)                                       \
+    X(dSPIN_K_THERM,     4, dSPIN_REG_RW)                                       \
+    X(dSPIN_ADC_OUT,     5, dSPIN_REG_RO | dSPIN_REG_VOLATILE)                  \
+    X(dSPIN_OCD_TH,      4, dSPIN_REG_RW)                                       \
+    X(dSPIN_STALL_TH,    7, dSPIN_REG_RW)                                       \
+    X(dSPIN_FS_SPD,     10, dSPIN_REG_RW)                                       \
+    X(dSPIN_STEP_MODE,   8, dSPIN_REG_RW)                                       \
+    X(dSPIN_ALARM_EN,    8, dSPIN_REG_RW)                                       \
+    X(dSPIN_CONFIG,     16, dSPIN_REG_RW)                                       \
+    X(dSPIN_STATUS,     16, dSPIN_REG_RO | dSPIN_REG_VOLATILE)
+
+
+// Run time register descriptor.  dSPIN_REG_TABLE is indexed by address.
+typedef struct dSPIN_REG_INFO
+{
+    uint8_t     addr;
+    uint8_t     bits;
+    uint8_t     flags;
+} dSPIN_REG_INFO;
+
+#define DSPIN_REG_INFO_ENTRY(reg, nbits, flg)   {reg, nbits, flg},
+
+static const dSPIN_REG_INFO dSPIN_REG_TABLE[dSPIN_REG_COUNT] =
+{
+    {0x00, 0, dSPIN_REG_RO},        // 0x00 is not a register
+    DSPIN_REG_LIST(DSPIN_REG_INFO_ENTRY)
+};
+
+
+// Compile time register descriptor.  Only defined for valid registers.
+template<uint8_t REG> struct dSPIN_Reg;
+
+#define DSPIN_REG_TRAITS(reg, nbits, flg)                                   \
+template<> struct dSPIN_Reg<reg>                                            \
+{                                                                           \
+    enum                                                                    \
+    {                                                                       \
+        ADDR  = reg,                                                        \
+        BITS  = nbits,                                                      \
+        BYTES = (nbits + 7) / 8,                                            \
+        FLAGS = flg                                                         \
+    };                                                                      \
+    static const uint32_t MASK = 0xFFFFFFFFUL >> (32 - nbits);              \
+};
+
+DSPIN_REG_LIST(DSPIN_REG_TRAITS)
+
+
+// Compile error when writing a read-only register through setParam<REG>().
+template<bool> struct dSPIN_RegWritable;
+template<> struct dSPIN_RegWritable<true> {};
+
+
+/*  Sign extend a raw register value of the given width.
+ */
+inline int32_t dSPIN_toSigned(uint32_t raw, uint8_t bits)
+{
+    uint32_t sign = 1UL << (bits - 1);
+    raw &= 0xFFFFFFFFUL >> (32 - bits);
+    return (int32_t)(raw ^ sign) - (int32_t)sign;
+}
+
+
 typedef enum dSPIN_ERROR_CODE
 {
     dSPIN_ERR_BADCMD          = 1,
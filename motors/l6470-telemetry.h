@@ -0,0 +1,390 @@
+#ifndef L6470_TELEMETRY_H
+#define L6470_TELEMETRY_H
+
+#include <stdint.h>
+#include <vector>
+#include <iostream>
+#include "l6470.h"
+#include "l6470-poller.h"
+
+enum L6470_TELEM_CONST
+{
+    L6470_TELEM_DEPTH    = 256,     // Default ring depth, rounded up to 2^n
+    L6470_TELEM_MAX_AXES = 16       // Axes with their own counters
+};
+
+
+enum L6470_TELEM_EVENT
+{
+    L6470_EVT_STALL_A     = 0,      // STEP_LOSS_A
+    L6470_EVT_STALL_B     = 1,      // STEP_LOSS_B
+    L6470_EVT_OVERCURRENT = 2,      // OCD
+    L6470_EVT_TH_SHUTDOWN = 3,      // TH_SD
+    L6470_EVT_TH_WARN     = 4,      // TH_WRN
+    L6470_EVT_UVLO        = 5,      // UVLO
+    L6470_EVT_COUNT       = 6
+};
+
+
+/** @brief One recorded fault event.
+ */
+typedef struct L6470TelemetryEvent
+{
+    int64_t     time;       // CLOCK_MONOTONIC ns of the STATUS read
+    int         axis;       // Index of the axis in the poller
+    uint8_t     type;       // L6470_TELEM_EVENT
+    uint8_t     posValid;   // pos holds ABS_POS
+    uint32_t    status;     // Raw STATUS value
+    int32_t     pos;        // ABS_POS when the event was seen
+} L6470TelemetryEvent;
+
+
+/** @brief Stall and fault event stream for a set of L6470 axes
+ *
+ *  Attached to an L6470StatusPoller the telemetry looks at every STATUS the
+ *  poller reads, so it adds no polling of its own.  Each step loss,
+ *  overcurrent, thermal or undervoltage flag is recorded as an event with the
+ *  time, axis index, raw status and ABS_POS.  ABS_POS is only read from the
+ *  chip when an event is seen, and not at all if setReadPosition(0) is used.
+ *
+ *  Events go into a lock-free single producer / single consumer ring.  The
+ *  poller thread produces and one other thread may consume with read().
+ *  When the ring is full new events are dropped and counted by dropped().
+ *  Counters per event type and per axis are kept regardless and can be read
+ *  from any thread, or written as text with save().
+ *
+ *  The fault flags are latched by the chip and cleared by the GET_STATUS the
+ *  poller uses, so each flag seen in a poll is a new event.
+ */
+class L6470Telemetry
+{
+protected:
+    std::vector<L6470TelemetryEvent> m_ring;
+    uint32_t            m_mask;
+    uint32_t            m_head;
+    uint32_t            m_tail;
+    uint32_t            m_dropped;
+    uint32_t            m_count[L6470_TELEM_MAX_AXES][L6470_EVT_COUNT];
+    uint32_t            m_total[L6470_EVT_COUNT];
+    int64_t             m_since;
+    int                 m_readPos;
+    L6470StatusPoller*  m_poller;
+
+public:
+    L6470Telemetry(int depth = L6470_TELEM_DEPTH);
+    virtual ~L6470Telemetry();
+
+    void        attach(L6470StatusPoller& poller);
+    void        detach();
+    void        setReadPosition(int on);
+
+    int         record(int axis, const L6470Status& st, L6470* dev = NULL);
+    int         read(L6470TelemetryEvent& ev);
+    int         available();
+    uint32_t    dropped();
+
+    uint32_t    count(int type);
+    uint32_t    count(int axis, int type);
+    float       rate(int type);
+    void        resetCounters();
+    int         save(std::ostream& os);
+
+    static const char* eventName(int type);
+
+protected:
+    static void statusCallback(int idx, const L6470Status& st, void* ctx);
+};
+
+
+
+
+
+/** @brief Creates an empty telemetry stream.
+ *
+ *  @param depth Number of events the ring holds, rounded up to a power of 2.
+ */
+inline L6470Telemetry::L6470Telemetry(int depth)
+{
+    uint32_t size = 2;
+    while ((int)size < depth)
+        size <<= 1;
+
+    m_ring.resize(size);
+    m_mask    = size - 1;
+    m_head    = 0;
+    m_tail    = 0;
+    m_readPos = 1;
+    m_poller  = NULL;
+    resetCounters();
+}
+
+
+/** @brief Detaches from the poller.
+ */
+inline L6470Telemetry::~L6470Telemetry()
+{
+    detach();
+}
+
+
+/** @brief Record events from every status read by a poller.
+ *
+ *  The poller must remain valid until detach() or destruction.
+ */
+inline void L6470Telemetry::attach(L6470StatusPoller& poller)
+{
+    detach();
+    m_poller = &poller;
+    m_poller->subscribe(statusCallback, this);
+}
+
+
+/** @brief Stop recording events from the poller.
+ */
+inline void L6470Telemetry::detach()
+{
+    if (m_poller)
+        m_poller->unsubscribe(statusCallback, this);
+    m_poller = NULL;
+}
+
+
+/** @brief Enable or disable reading ABS_POS when an event is seen.
+ */
+inline void L6470Telemetry::setReadPosition(int on)
+{
+    m_readPos = on ? 1 : 0;
+}
+
+
+/** @brief Record the fault flags of a status.
+ *
+ *  Called for every poll when attached.  May also be called directly by the
+ *  producing thread with any status read.
+ *
+ *  @param axis Axis index stored with the events.
+ *  @param st The decoded status.
+ *  @param dev Axis to read ABS_POS from, or NULL.
+ *  @return int: Number of events seen.
+ */
+inline int L6470Telemetry::record(int axis, const L6470Status& st, L6470* dev)
+{
+    uint8_t flags[L6470_EVT_COUNT];
+    int     seen = 0;
+    int32_t pos = 0;
+    uint8_t posValid = 0;
+
+    flags[L6470_EVT_STALL_A]     = st.stallA;
+    flags[L6470_EVT_STALL_B]     = st.stallB;
+    flags[L6470_EVT_OVERCURRENT] = st.overCurrent;
+    flags[L6470_EVT_TH_SHUTDOWN] = st.thShutdown;
+    flags[L6470_EVT_TH_WARN]     = st.thWarn;
+    flags[L6470_EVT_UVLO]        = st.uvlo;
+
+    for (int t=0; t<L6470_EVT_COUNT; t++)
+    {
+        if (!flags[t])
+            continue;
+
+        if (!seen and dev and m_readPos)
+        {
+            pos = dev->getPosition();
+            posValid = 1;
+        }
+        seen++;
+
+        __atomic_fetch_add(&m_total[t], 1, __ATOMIC_RELAXED);
+        if (axis >= 0 and axis < L6470_TELEM_MAX_AXES)
+            __atomic_fetch_add(&m_count[axis][t], 1, __ATOMIC_RELAXED);
+
+        uint32_t head = m_head;
+        if (head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) > m_mask)
+        {
+            __atomic_fetch_add(&m_dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        L6470TelemetryEvent& ev = m_ring[head & m_mask];
+        ev.time     = st.time;
+        ev.axis     = axis;
+        ev.type     = t;
+        ev.posValid = posValid;
+        ev.status   = st.raw;
+        ev.pos      = pos;
+        __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    return seen;
+}
+
+
+/** @brief Take the oldest event from the ring.
+ *
+ *  @param ev Receives the event.
+ *  @return int: 1 if an event was read, 0 if the ring is empty.
+ */
+inline int L6470Telemetry::read(L6470TelemetryEvent& ev)
+{
+    uint32_t tail = m_tail;
+    if (tail == __atomic_load_n(&m_head, __ATOMIC_ACQUIRE))
+        return 0;
+
+    ev = m_ring[tail & m_mask];
+    __atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/** @brief Returns the number of events waiting in the ring.
+ */
+inline int L6470Telemetry::available()
+{
+    return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+}
+
+
+/** @brief Returns the number of events dropped because the ring was full.
+ */
+inline uint32_t L6470Telemetry::dropped()
+{
+    return __atomic_load_n(&m_dropped, __ATOMIC_RELAXED);
+}
+
+
+/** @brief Returns the number of events of a type on all axes.
+ */
+inline uint32_t L6470Telemetry::count(int type)
+{
+    if (type < 0 or type >= L6470_EVT_COUNT)
+        return 0;
+    return __atomic_load_n(&m_total[type], __ATOMIC_RELAXED);
+}
+
+
+/** @brief Returns the number of events of a type on one axis.
+ */
+inline uint32_t L6470Telemetry::count(int axis, int type)
+{
+    if (axis < 0 or axis >= L6470_TELEM_MAX_AXES or
+        type < 0 or type >= L6470_EVT_COUNT)
+        return 0;
+    return __atomic_load_n(&m_count[axis][type], __ATOMIC_RELAXED);
+}
+
+
+/** @brief Returns the events of a type per second since resetCounters().
+ */
+inline float L6470Telemetry::rate(int type)
+{
+    int64_t elapsed = L6470::monotonic() - m_since;
+    if (elapsed <= 0)
+        return 0;
+    return count(type) * 1e9 / elapsed;
+}
+
+
+/** @brief Zero the counters and restart the rate measurement.
+ *
+ *  Not synchronised with record().  Call while the poller is idle.
+ */
+inline void L6470Telemetry::resetCounters()
+{
+    for (int a=0; a<L6470_TELEM_MAX_AXES; a++)
+        for (int t=0; t<L6470_EVT_COUNT; t++)
+            m_count[a][t] = 0;
+    for (int t=0; t<L6470_EVT_COUNT; t++)
+        m_total[t] = 0;
+    m_dropped = 0;
+    m_since   = L6470::monotonic();
+}
+
+
+/** @brief Write the counters to a text stream.
+ *
+ *  One line per event type with the total count and rate, followed by a line
+ *  per axis and type with a non-zero count:
+ *
+ *      STALL_A 12 0.4
+ *      STALL_A.1 12
+ *
+ *  @return int: Number of lines written.
+ */
+inline int L6470Telemetry::save(std::ostream& os)
+{
+    int lines = 0;
+
+    for (int t=0; t<L6470_EVT_COUNT; t++)
+    {
+        os << eventName(t) << " " << count(t) << " " << rate(t) << std::endl;
+        lines++;
+    }
+
+    for (int a=0; a<L6470_TELEM_MAX_AXES; a++)
+    {
+        for (int t=0; t<L6470_EVT_COUNT; t++)
+        {
+            if (!count(a, t))
+                continue;
+            os << eventName(t) << "." << a << " " << count(a, t) << std::endl;
+            lines++;
+        }
+    }
+
+    os << "DROPPED " << dropped() << std::endl;
+    return lines + 1;
+}
+
+
+/** @brief Returns the name of an event type.
+ */
+inline const char* L6470Telemetry::eventName(int type)
+{
+    static const char* names[L6470_EVT_COUNT] =
+    {
+        "STALL_A", "STALL_B", "OVERCURRENT", "TH_SHUTDOWN", "TH_WARN", "UVLO"
+    };
+
+    if (type < 0 or type >= L6470_EVT_COUNT)
+        return "";
+    return names[type];
+}
+
+
+/*
+ *  Poller subscription.  Records the status of one axis.
+ */
+inline void L6470Telemetry::statusCallback(int idx, const L6470Status& st,
+                                           void* ctx)
+{
+    L6470Telemetry* self = (L6470Telemetry*)ctx;
+    L6470* dev = self->m_poller ? self->m_poller->getAxis(idx) : NULL;
+    self->record(idx, st, dev);
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_TELEMETRY_H
@@ -0,0 +1,180 @@
+#ifndef L6470_UNITS_H
+#define L6470_UNITS_H
+
+#include <stdint.h>
+#include "l6470-support.h"
+
+/** @brief Integer unit conversion for the L6470 speed and acceleration registers
+ *
+ *  Speeds and accelerations are carried as fixed point values with three
+ *  decimal places (milli-steps/sec and milli-steps/sec/sec) in the typed
+ *  wrappers L6470StepRate and L6470StepAccel so the two cannot be mixed up or
+ *  confused with raw register values.
+ *
+ *  Each register's datasheet formula with tick = 250ns reduces to an exact
+ *  rational factor, register = units * NUM / DEN:
+ *
+ *      SPEED       step/s   = SPEED * 2^-28 / tick       2^20 / 5^6
+ *      MAX_SPEED   step/s   = MAX_SPEED * 2^-18 / tick   2^10 / 5^6
+ *      MIN_SPEED   step/s   = MIN_SPEED * 2^-24 / tick   2^16 / 5^6
+ *      INT_SPD     step/s   = INT_SPD * 2^-26 / tick     2^18 / 5^6
+ *      FS_SPD      step/s   = (FS_SPD + 0.5) * 2^-18 / tick
+ *      ACC, DEC    step/s^2 = ACC * 2^-40 / tick^2        2^24 / 5^12
+ *
+ *  Conversions round to nearest (FS_SPD rounds down so the threshold stays at
+ *  or below the requested speed) and use 64 bit integer math only.
+ *  dSPIN_RegConst<> does the same conversion at compile time for constant
+ *  inputs:
+ *
+ *      setParam<dSPIN_ACC>(dSPIN_RegConst<dSPIN_ACC, 500000>::value);
+ */
+
+
+/** @brief Speed in milli-steps per second.
+ */
+struct L6470StepRate
+{
+    uint32_t    milli;
+
+    L6470StepRate() : milli(0) {}
+    explicit L6470StepRate(uint32_t m) : milli(m) {}
+};
+
+
+/** @brief Acceleration in milli-steps per second per second.
+ */
+struct L6470StepAccel
+{
+    uint32_t    milli;
+
+    L6470StepAccel() : milli(0) {}
+    explicit L6470StepAccel(uint32_t m) : milli(m) {}
+};
+
+
+/** @brief Returns a whole number of steps/sec as an L6470StepRate.
+ */
+inline L6470StepRate stepsPerSec(uint32_t sps)
+{
+    return L6470StepRate(sps * 1000);
+}
+
+
+/** @brief Returns a whole number of steps/sec/sec as an L6470StepAccel.
+ */
+inline L6470StepAccel stepsPerSec2(uint32_t spss)
+{
+    return L6470StepAccel(spss * 1000);
+}
+
+
+// Register = milli-units * NUM / (DEN * 1000).  HALF marks FS_SPD's
+//  half-count offset.  Only defined for registers holding a speed or rate.
+template<uint8_t REG> struct dSPIN_Units;
+
+#define DSPIN_UNITS(reg, num, den, half)                                    \
+template<> struct dSPIN_Units<reg>                                          \
+{                                                                           \
+    static const uint32_t NUM  = num;                                       \
+    static const uint32_t DEN  = den;                                       \
+    static const uint32_t HALF = half;                                      \
+};
+
+DSPIN_UNITS(dSPIN_SPEED,     1048576UL,  15625UL,     0)
+DSPIN_UNITS(dSPIN_MAX_SPEED, 1024UL,     15625UL,     0)
+DSPIN_UNITS(dSPIN_MIN_SPEED, 65536UL,    15625UL,     0)
+DSPIN_UNITS(dSPIN_INT_SPD,   262144UL,   15625UL,     0)
+DSPIN_UNITS(dSPIN_FS_SPD,    1024UL,     15625UL,     1)
+DSPIN_UNITS(dSPIN_ACC,       16777216UL, 244140625UL, 0)
+DSPIN_UNITS(dSPIN_DEC,       16777216UL, 244140625UL, 0)
+
+
+/** @brief Convert milli-units to a register value, limited to the register
+ *  width.  MIN_SPEED is limited to 12 bits to leave LSPD_OPT clear.
+ */
+template<uint8_t REG> inline uint32_t dSPIN_toReg(uint32_t milli)
+{
+    typedef dSPIN_Units<REG> U;
+    uint64_t n   = (uint64_t)milli * U::NUM;
+    uint64_t d   = (uint64_t)U::DEN * 1000;
+    uint64_t reg = (n + d/2) / d;
+    uint32_t max = (REG == dSPIN_MIN_SPEED) ? 0xFFF : dSPIN_Reg<REG>::MASK;
+
+    // The FS_SPD threshold is reg + 0.5 counts, keep it at or below the input
+    if (U::HALF)
+        reg = (2*n < d) ? 0 : (2*n - d) / (2*d);
+    return (reg > max) ? max : (uint32_t)reg;
+}
+
+
+/** @brief Convert a register value to milli-units.
+ *
+ *  Rounded to nearest, except FS_SPD which rounds up so converting the result
+ *  back gives the same register value.
+ */
+template<uint8_t REG> inline uint32_t dSPIN_fromReg(uint32_t reg)
+{
+    typedef dSPIN_Units<REG> U;
+    uint64_t n = (uint64_t)(2*reg + U::HALF) * U::DEN * 1000;
+    uint64_t d = (uint64_t)2 * U::NUM;
+    return (uint32_t)((n + (U::HALF ? d-1 : d/2)) / d);
+}
+
+
+/** @brief Compile time register value for a constant milli-unit input.
+ *
+ *  Gives the same result as dSPIN_toReg<REG>(MILLI).
+ */
+template<uint8_t REG, uint32_t MILLI> struct dSPIN_RegConst
+{
+    static const uint64_t N = (uint64_t)MILLI * dSPIN_Units<REG>::NUM;
+    static const uint64_t D = (uint64_t)dSPIN_Units<REG>::DEN * 1000;
+    static const uint64_t R = !dSPIN_Units<REG>::HALF ? (N + D/2) / D :
+                              (2*N < D) ? 0 : (2*N - D) / (2*D);
+    static const uint32_t LIMIT = (REG == dSPIN_MIN_SPEED) ? 0xFFF :
+                                  dSPIN_Reg<REG>::MASK;
+    static const uint32_t value = (R > LIMIT) ? LIMIT : (uint32_t)R;
+};
+
+
+/** @brief Convert a speed to a speed register value.
+ */
+template<uint8_t REG> inline uint32_t dSPIN_toReg(L6470StepRate rate)
+{
+    return dSPIN_toReg<REG>(rate.milli);
+}
+
+
+/** @brief Convert an acceleration to an ACC or DEC register value.
+ */
+template<uint8_t REG> inline uint32_t dSPIN_toReg(L6470StepAccel acc)
+{
+    return dSPIN_toReg<REG>(acc.milli);
+}
+
+
+
+
+/*
+ Copyright (C) 2013 Kyle Crane
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#endif // L6470_UNITS_H
@@ -4,8 +4,61 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include "l6470-support.h"
+#include "l6470-chain.h"
+#include "l6470-profile.h"
+#include "l6470-units.h"
+#include "l6470-model.h"
 #include "ispi.h"
+#include "gpio_pin.h"
+
+enum L6470_CONST
+{
+    L6470_MAX_CMD_LEN = 4,      // Opcode plus up to 3 bytes of payload
+    L6470_STAGE_LEN   = 96,     // Bytes of commands that can be staged
+    L6470_CLOCK_PPM   = 30000,  // Internal oscillator tolerance, +/-3%
+    L6470_IDLE_SLICE  = 10      // Longest ms waitIdle() sleeps on the BUSY pin
+};
+
+class L6470;
+
+
+/** @brief Callback invoked by L6470::service() for BUSY and FLAG events.
+ *
+ *  @param axis The axis that raised the event.
+ *  @param ctx The context pointer given when the callback was set.
+ */
+typedef void (*L6470EventCallback)(L6470& axis, void* ctx);
+
+
+/** @brief Decoded STATUS register of an L6470
+ *
+ *  Every flag is active high regardless of its polarity in the register.
+ */
+typedef struct L6470Status
+{
+    uint32_t    raw;            // STATUS register value
+    int64_t     time;           // CLOCK_MONOTONIC ns when read, 0 if never
+    uint8_t     hiz;            // Bridges are high impedance
+    uint8_t     busy;           // A command is in progress
+    uint8_t     swClosed;       // Switch input closed
+    uint8_t     swEvent;        // Switch falling edge seen
+    uint8_t     dir;            // Direction, corrected for invert()
+    uint8_t     motStatus;      // 0 stopped, 1 accel, 2 decel, 3 const speed
+    uint8_t     notPerf;        // Last command not performed
+    uint8_t     wrongCmd;       // Last command not valid
+    uint8_t     uvlo;           // Undervoltage lockout
+    uint8_t     thWarn;         // Thermal warning
+    uint8_t     thShutdown;     // Thermal shutdown
+    uint8_t     overCurrent;    // Overcurrent detected
+    uint8_t     stallA;         // Stall detected on bridge A
+    uint8_t     stallB;         // Stall detected on bridge B
+    uint8_t     stepClock;      // Step clock mode active
+    uint32_t    error;          // dSPIN_ERROR_CODE bits as from getError()
+} L6470Status;
+
 
 /** @brief Class to interface to the STI L6470 stepper motor driver chip
  *
@@ -18,6 +71,59 @@
  *  exclusive use of it.  See the file "l6470-support.h" for a list of
  *  constants used extensively throughout the operation of the chip.
  *
+ *  The SPI object is switched to persistent mode for the lifetime of the
+ *  driver so the device is opened and configured once rather than on every
+ *  byte that is shifted to the chip.  Each command is assembled into a buffer
+ *  and shifted in a single bus operation with chip-select released between
+ *  bytes as the chip requires.
+ *
+ *  Chips that are daisy-chained on a single chip-select are driven through
+ *  an L6470Chain.  Each L6470 object is attached to one slot of the chain and
+ *  its commands are sent with NOPs for the other devices.
+ *
+ *  Commands can be staged with beginStage() rather than sent.  Staged bytes
+ *  are sent together by flushStage() or collected by an L6470Group so that
+ *  commands for several axes are released at the same time.  Only commands
+ *  that write to the chip should be issued while staging since no reply is
+ *  available until the staged bytes are sent.
+ *
+ *  A shadow copy of the writable registers is kept.  Values written with
+ *  setParam() or read from the chip are remembered and later reads of the
+ *  same register are answered without bus traffic.  ABS_POS, EL_POS, SPEED,
+ *  ADC_OUT and STATUS are always read from the chip.  Writes that fail on
+ *  the bus are not remembered, and writes made while staging only once the
+ *  staged bytes are sent.  The chip silently refuses some writes while the
+ *  motor is moving; call invalidate() or refresh() if a write may not have
+ *  been performed.
+ *
+ *  Register widths and flags come from the descriptor table in
+ *  "l6470-support.h".  setParam<REG>() and getParam<REG>() resolve the width
+ *  of the register at compile time and refuse to compile a write to a
+ *  read-only register.
+ *
+ *  snapshot() and restore() read or write every register in an L6470Profile
+ *  with a single bus operation, which makes it quick to bring an axis back
+ *  to its working setup after resetDev() or an undervoltage lockout.
+ *
+ *  Every read of the STATUS register is decoded and kept; lastStatus()
+ *  returns it without bus traffic.  isBusy(), getDir() and getError() each
+ *  read STATUS once and answer from the decoded copy.
+ *
+ *  The motor position can be estimated from the commanded motion.
+ *  enableEstimate() creates an L6470Model of the chip, and from then on every
+ *  command sent is also fed to it; axes that do not enable it pay nothing.
+ *  Once enabled estPosition() and estSpeed() answer without bus traffic,
+ *  otherwise they read the chip.  ABS_POS is read again when the interval set
+ *  with setResyncInterval() runs out and on every getPosition().  estDrift()
+ *  bounds the error of the estimate from the oscillator tolerance and the
+ *  distance moved since the last read.
+ *
+ *  The chip's BUSY and FLAG open-drain outputs can be bound to GPIO inputs
+ *  with bindBusyPin() and bindFlagPin().  waitIdle() then sleeps on the BUSY
+ *  edge instead of reading STATUS over SPI, and service() calls the onIdle()
+ *  and onFlag() callbacks from the pin levels.  FLAG only causes a STATUS
+ *  read when it is asserted.
+ *
  *  Be aware that most functions are non-blocking.  The chip performs the 
  *  needed stepping to move the motors. Functions that command motion will
  *  return immediately before that motion is completed.
@@ -27,12 +133,39 @@ class L6470
 protected:
     ISPI*   m_bus;
     int     m_ownBus;
+    int     m_busPersist;
+    L6470Chain* m_chain;
+    int     m_slot;
+    int     m_staging;
+    int     m_stageLen;
+    uint8_t m_stage[L6470_STAGE_LEN];
+    GPIO_Pin* m_busyPin;
+    GPIO_Pin* m_flagPin;
+    int     m_wasBusy;
+    L6470EventCallback m_idleCb;
+    void*   m_idleCtx;
+    L6470EventCallback m_flagCb;
+    void*   m_flagCtx;
+    L6470Status m_status;
+    uint32_t m_shadow[dSPIN_REG_COUNT];
+    uint32_t m_shadowValid;
+    uint32_t m_stageShadow[dSPIN_REG_COUNT];    // Writes waiting in the stage
+    uint32_t m_stageValid;
     int     m_invertDir;
     int     m_msMode;
+    L6470Model* m_track;        // Estimate of the chip's motion, NULL if off
+    int64_t m_trackTime;        // Time the estimate was last advanced to
+    int64_t m_syncTime;         // Time of the last ABS_POS read
+    int64_t m_resyncNs;
+    uint32_t m_clockPpm;
+    double  m_travel;           // Microsteps moved since the last sync
+    double  m_syncErr;          // Uncertainty of the last sync in microsteps
+    int32_t m_correction;
 
 public:
     L6470(ISPI& bus, uint32_t cfg=0);
     L6470(ISPI* p_bus, uint32_t cfg=0);
+    L6470(L6470Chain& chain, int slot, uint32_t cfg=0);
     virtual ~L6470();
     void    initMotion(uint8_t microStp, float maxSpd = 500,
                        float acc=100, float dec=100);
@@ -41,20 +174,31 @@ public:
 
     /********** Set Functions ************/
     void        setParam(uint8_t param, uint32_t value);
+    template<uint8_t REG> void setParam(uint32_t value);
     void        setAccel(float spss);
     void        setDecel(float spss);
     void        setMaxSpeed(float sps);
     void        setMinSpeed(float sps);
     void        setFullStepThreshold(float sps);
+    void        setAccel(L6470StepAccel acc);
+    void        setDecel(L6470StepAccel dec);
+    void        setMaxSpeed(L6470StepRate spd);
+    void        setMinSpeed(L6470StepRate spd);
+    void        setFullStepThreshold(L6470StepRate spd);
     uint8_t     setMicroSteps(uint8_t val);
     void        setPosition(int32_t);
     void        setPosition_FS(int32_t);
     int32_t     setMark();
     int         setConfig(uint32_t cfg);
     void        invert(uint8_t inv);
+    void        bindBusyPin(GPIO_Pin* pin);
+    void        bindFlagPin(GPIO_Pin* pin);
+    void        onIdle(L6470EventCallback cb, void* ctx = NULL);
+    void        onFlag(L6470EventCallback cb, void* ctx = NULL);
 
     /********** Get Functions ************/
     uint32_t    getParam(uint8_t param);
+    template<uint8_t REG> uint32_t getParam();
     uint32_t    isBusy();
     uint8_t     isInverted();
     uint32_t    getStatus();
@@ -63,17 +207,62 @@ public:
     int32_t     getPosition();
     int32_t     getPosition_FS();
     uint32_t    getError();
+    const L6470Status& lastStatus();
+    void        updateStatus(uint32_t raw);
+    static int64_t monotonic();
     float       getAccel();
     float       getDecel();
     float       getMaxSpeed();
     float       getMinSpeed();
     float       getFullStepThreshold();
     float       getSpeed();
+    L6470StepAccel getAccel_FX();
+    L6470StepAccel getDecel_FX();
+    L6470StepRate  getMaxSpeed_FX();
+    L6470StepRate  getMinSpeed_FX();
+    L6470StepRate  getFullStepThreshold_FX();
+    L6470StepRate  getSpeed_FX();
     uint8_t     getMicroSteps();
+    L6470Chain* getChain();
+    int         getSlot();
+    GPIO_Pin*   getBusyPin();
+    GPIO_Pin*   getFlagPin();
+    int         waitIdle(int timeout_ms = -1);
+    int         service();
+    
+    /********** Register Shadow ***********/
+    void        invalidate(uint8_t param);
+    void        invalidateAll();
+    void        refresh();
+    int         isCached(uint8_t param);
+    int         snapshot(L6470Profile& prof);
+    int         restore(const L6470Profile& prof);
+    
+    /********** Position Estimate *********/
+    int         enableEstimate();
+    int32_t     estPosition();
+    int32_t     estPosition_FS();
+    float       estSpeed();
+    uint32_t    estDrift();
+    int32_t     lastCorrection();
+    int32_t     resync();
+    void        setResyncInterval(uint32_t ms);
+    void        setClockTolerance(uint32_t ppm);
+    
+    /********** Command Staging ***********/
+    void        beginStage();
+    int         flushStage();
+    void        cancelStage();
+    void        stageSent();
+    void        commandsSent(const uint8_t* buf, int len);
+    int         isStaging();
+    int         stagedLen();
+    const uint8_t* stagedData();
     
     /********** Device Commands ***********/
     void        resetDev();
     void        run(uint8_t dir, float spd);
+    void        run(uint8_t dir, L6470StepRate spd);
     void        move(int32_t steps);
     void        move_FS(int32_t steps);
     void        gotoPosABS(int32_t pos);
@@ -91,10 +280,20 @@ public:
     void        hardHiZ();
 
 protected:
-    uint32_t    paramHandler(uint8_t param, uint32_t value);
-    uint32_t    procParam(uint32_t value, uint8_t bit_len);
+    void        init(ISPI* bus, L6470Chain* chain, int slot, uint32_t cfg);
+    uint32_t    paramHandler(uint8_t cmd, uint8_t param, uint32_t value);
+    uint32_t    procParam(uint8_t cmd, uint32_t value, uint8_t bit_len);
     uint8_t     dspin_xfer(uint8_t data);
+    int         dspin_cmd(uint8_t* buf, uint8_t len);
+    int         dspin_cmd(uint8_t cmd, uint32_t value);
+    int         dspin_send(uint8_t* buf, uint8_t len);
+    void        trackBytes(const uint8_t* buf, int len);
+    void        trackAdvance();
+    void        trackSync(int32_t pos, int64_t t0, int64_t t1);
     uint8_t     dirInvert(uint8_t dir);
+    int         writeStepMode(uint8_t reg, int releaseHold);
+    void        shadowStore(uint8_t param, uint32_t value);
+    void        shadowStaged(int sent);
     
 private:
     L6470(const L6470&);            // Disable copy constructor
@@ -123,19 +322,7 @@ private:
  */
 inline L6470::L6470(ISPI& bus, uint32_t cfg)
 {
-    m_bus       = &bus;
-    m_bus->setMode(3);
-    m_bus->setBPW(8);
-    m_invertDir = 0;
-    m_msMode    = 128;     // Power on default
-    resetDev();            // Ensure device is fully reset to power-on default
-    if (cfg)
-        setConfig(cfg);
-    else
-        setConfig(dSPIN_CONFIG_PWM_DIV_1          | dSPIN_CONFIG_PWM_MUL_2
-                  | dSPIN_CONFIG_SR_290V_us       | dSPIN_CONFIG_OC_SD_DISABLE
-                  | dSPIN_CONFIG_VS_COMP_ENABLE   | dSPIN_CONFIG_SW_HARD_STOP
-                  | dSPIN_CONFIG_INT_16MHZ);
+    init(&bus, NULL, 0, cfg);
 }
 
 
@@ -152,36 +339,162 @@ inline L6470::L6470(ISPI& bus, uint32_t cfg)
  */
 inline L6470::L6470(ISPI* p_bus, uint32_t cfg)
 {
-    m_invertDir = 0;
-    m_msMode    = 128;     // Power on default
-    
-    if(p_bus)
-    {
-        m_bus = p_bus;
-        m_ownBus = 1;
-        m_bus->setMode(3);
-        m_bus->setBPW(8);
-        resetDev();        // Ensure device is fully reset to power-on default
-        if (cfg)
-            setConfig(cfg);
-        else
-            setConfig(dSPIN_CONFIG_PWM_DIV_1          | dSPIN_CONFIG_PWM_MUL_2
-                      | dSPIN_CONFIG_SR_290V_us       | dSPIN_CONFIG_OC_SD_DISABLE
-                      | dSPIN_CONFIG_VS_COMP_ENABLE   | dSPIN_CONFIG_SW_HARD_STOP
-                      | dSPIN_CONFIG_INT_16MHZ);
-    }
-    else
-        m_bus = NULL;
+    init(p_bus, NULL, 0, cfg);
+    m_ownBus = p_bus ? 1 : 0;
+}
+
+
+/** @brief Creates an L6470 object for one chip in a daisy chain.
+ *
+ *  The chain owns the SPI bus.  This object sends its commands through the
+ *  chain to the chip at the given slot.  The chain must remain valid for the
+ *  life of this object.
+ *
+ *  @param chain The chain the chip is connected to.
+ *  @param slot The position of the chip in the chain.
+ *  @param cfg Optional configuration register value to pass to the chip.
+ */
+inline L6470::L6470(L6470Chain& chain, int slot, uint32_t cfg)
+{
+    init(NULL, &chain, slot, cfg);
 }
 
 
 /** @brief Destroys the object and cleans up dynamically created SPI bus if present.
  *
+ *  A shared SPI object is returned to the persistent setting it had before
+ *  this object was created.
  */
 inline L6470::~L6470()
 {
+    delete m_track;
     if (m_ownBus)
         delete m_bus;
+    else if (m_bus)
+        m_bus->setPersistent(m_busPersist);
+}
+
+
+/*
+ *  Writes STEP_MODE the way the chip accepts it: only with the motor stopped
+ *  and the bridges HiZ.  ABS_POS and MARK are rescaled to the new mode and
+ *  EL_POS put back so the rotor does not jump.  A holding motor is released for the
+ *  write and energised again after it if releaseHold is set, otherwise the
+ *  write is refused.  Returns 0 on success and -1 if the chip is moving,
+ *  holding, or rejected the write.
+ */
+inline int L6470::writeStepMode(uint8_t reg, int releaseHold)
+{
+    int oldVal = m_msMode;
+    int newVal = 1 << (reg & dSPIN_STEP_MODE_STEP_SEL);
+    int result = 0;
+    
+    // The chip refuses the change and the position reads below while moving
+    getStatus();
+    if (m_status.busy or m_status.motStatus != 0)
+        return -1;
+    
+    uint8_t hold = !m_status.hiz;
+    if (hold and !releaseHold)
+        return -1;
+    
+    int32_t  pos  = getPosition();
+    uint32_t el   = getParam<dSPIN_EL_POS>();
+    int32_t  mark = dSPIN_toSigned(getParam<dSPIN_MARK>(),
+                                   dSPIN_Reg<dSPIN_MARK>::BITS);
+    
+    if (hold)
+        hardHiZ();
+    setParam<dSPIN_STEP_MODE>(reg);
+    int err = getError();
+    
+    if (err & dSPIN_ERR_NOEXEC)
+    {
+        invalidate(dSPIN_STEP_MODE);
+        result = -1;
+    }
+    else
+    {
+        m_msMode = newVal;
+        
+        // Round to the nearest step of the new mode
+        int64_t scaled = (int64_t)pos * newVal;
+        scaled = (scaled >= 0) ? (scaled + oldVal/2) / oldVal
+                               : (scaled - oldVal/2) / oldVal;
+        setPosition((int32_t)scaled);
+        
+        // MARK counts in the same microsteps as ABS_POS
+        scaled = (int64_t)mark * newVal;
+        scaled = (scaled >= 0) ? (scaled + oldVal/2) / oldVal
+                               : (scaled - oldVal/2) / oldVal;
+        setParam<dSPIN_MARK>((uint32_t)scaled & dSPIN_Reg<dSPIN_MARK>::MASK);
+        
+        // EL_POS microsteps are 1/128 of a step, keep those the mode can use
+        el &= ~(uint32_t)(128 / newVal - 1);
+        setParam<dSPIN_EL_POS>(el);
+    }
+    
+    if (hold)
+        hardStop();
+    
+    return result;
+}
+
+
+/*
+ *  Common construction.  Sets every member to its default, sets the bus up
+ *  for the L6470 and resets and configures the chip.  Does nothing to the
+ *  chip when there is neither a bus nor a chain.
+ */
+inline void L6470::init(ISPI* bus, L6470Chain* chain, int slot, uint32_t cfg)
+{
+    m_bus       = bus;
+    m_ownBus    = 0;
+    m_busPersist = 0;
+    m_chain     = chain;
+    m_slot      = slot;
+    m_staging   = 0;
+    m_stageLen  = 0;
+    m_busyPin   = NULL;
+    m_flagPin   = NULL;
+    m_wasBusy   = 0;
+    m_idleCb    = NULL;
+    m_idleCtx   = NULL;
+    m_flagCb    = NULL;
+    m_flagCtx   = NULL;
+    m_shadowValid = 0;
+    m_stageValid  = 0;
+    memset(&m_status, 0, sizeof(m_status));
+    m_track     = NULL;
+    m_trackTime = monotonic();
+    m_syncTime  = m_trackTime;
+    m_resyncNs  = 0;
+    m_clockPpm  = L6470_CLOCK_PPM;
+    m_travel    = 0;
+    m_syncErr   = 0;
+    m_correction = 0;
+    m_invertDir = 0;
+    m_msMode    = 128;     // Power on default
+
+    if (!m_bus and !m_chain)
+        return;
+
+    if (m_bus)
+    {
+        m_bus->setMode(3);
+        m_bus->setBPW(8);
+        m_busPersist = m_bus->setPersistent(1);
+        m_bus->openBus();
+    }
+
+    resetDev();            // Ensure device is fully reset to power-on default
+    if (cfg)
+        setConfig(cfg);
+    else
+        setConfig(dSPIN_CONFIG_PWM_DIV_1          | dSPIN_CONFIG_PWM_MUL_2
+                  | dSPIN_CONFIG_SR_290V_us       | dSPIN_CONFIG_OC_SD_DISABLE
+                  | dSPIN_CONFIG_VS_COMP_ENABLE   | dSPIN_CONFIG_SW_HARD_STOP
+                  | dSPIN_CONFIG_INT_16MHZ);
 }
 
 
@@ -225,14 +538,14 @@ inline void L6470::initMotion(uint8_t microStp, float maxSpd,
 inline void L6470::initBEMF(uint32_t k_hld, uint32_t k_mv, uint32_t int_spd,
                      uint32_t st_slp, uint32_t slp_acc)
 {
-    setParam(dSPIN_KVAL_HOLD, k_hld);
-    setParam(dSPIN_KVAL_ACC, k_mv);
-    setParam(dSPIN_KVAL_DEC, k_mv);
-    setParam(dSPIN_KVAL_RUN, k_mv);
-    setParam(dSPIN_INT_SPD, int_spd);
-    setParam(dSPIN_ST_SLP, st_slp);
-    setParam(dSPIN_FN_SLP_ACC, slp_acc);
-    setParam(dSPIN_FN_SLP_DEC, slp_acc);
+    setParam<dSPIN_KVAL_HOLD>(k_hld);
+    setParam<dSPIN_KVAL_ACC>(k_mv);
+    setParam<dSPIN_KVAL_DEC>(k_mv);
+    setParam<dSPIN_KVAL_RUN>(k_mv);
+    setParam<dSPIN_INT_SPD>(int_spd);
+    setParam<dSPIN_ST_SLP>(st_slp);
+    setParam<dSPIN_FN_SLP_ACC>(slp_acc);
+    setParam<dSPIN_FN_SLP_DEC>(slp_acc);
 }
 
 
@@ -243,8 +556,7 @@ inline void L6470::initBEMF(uint32_t k_hld, uint32_t k_mv, uint32_t int_spd,
  */
 inline void L6470::setParam(uint8_t param, uint32_t value)
 {
-    dspin_xfer(dSPIN_SET_PARAM | param);
-    paramHandler(param, value);
+    paramHandler(dSPIN_SET_PARAM | param, param, value);
 }
 
 
@@ -257,13 +569,7 @@ inline void L6470::setParam(uint8_t param, uint32_t value)
  */
 inline void L6470::setAccel(float spss)
 {
-    float temp = spss * 0.137438;
-    uint32_t regVal = (uint32_t) long(temp);
-    
-    if(regVal > 0x00000FFF)
-        regVal = 0x00000FFF;
-    
-    setParam(dSPIN_ACC, regVal);
+    setAccel(L6470StepAccel((spss > 0) ? spss*1000 + 0.5 : 0));
 }
 
 
@@ -276,13 +582,7 @@ inline void L6470::setAccel(float spss)
  */
 inline void L6470::setDecel(float spss)
 {
-    float temp = spss * 0.137438;
-    uint32_t regVal = (uint32_t) long(temp);
-    
-    if(regVal > 0x00000FFF)
-        regVal = 0x00000FFF;
-    
-    setParam(dSPIN_DEC, regVal);
+    setDecel(L6470StepAccel((spss > 0) ? spss*1000 + 0.5 : 0));
 }
 
 
@@ -296,12 +596,7 @@ inline void L6470::setDecel(float spss)
  */
 inline void L6470::setMaxSpeed(float sps)
 {
-    float temp = sps * .065536;
-    uint32_t regVal = (unsigned long) long(temp);
-    if( regVal > 0x000003FF)
-        regVal = 0x000003FF;
-    
-    setParam(dSPIN_MAX_SPEED, regVal);
+    setMaxSpeed(L6470StepRate((sps > 0) ? sps*1000 + 0.5 : 0));
 }
 
 
@@ -315,12 +610,7 @@ inline void L6470::setMaxSpeed(float sps)
  */
 inline void L6470::setMinSpeed(float sps)
 {
-    float temp = sps * 4.1943;
-    uint32_t regVal = (unsigned long) long(temp);
-    if( regVal > 0x00000FFF)
-        regVal = 0x00000FFF;
-    
-    setParam(dSPIN_MIN_SPEED, regVal);
+    setMinSpeed(L6470StepRate((sps > 0) ? sps*1000 + 0.5 : 0));
 }
 
 
@@ -332,12 +622,59 @@ inline void L6470::setMinSpeed(float sps)
  */
 inline void L6470::setFullStepThreshold(float sps)
 {
-    float temp = (sps * 0.065536) - 0.5;
-    uint32_t regVal = (unsigned long) long(temp);
-    if( regVal > 0x000003FF)
-        regVal = 0x000003FF;
-    
-    setParam(dSPIN_FS_SPD, regVal);
+    setFullStepThreshold(L6470StepRate((sps > 0) ? sps*1000 + 0.5 : 0));
+}
+
+
+/** @brief Set the acceleration from a fixed point value.
+ *
+ *  Integer only conversion, see "l6470-units.h".
+ *
+ *  @param acc Acceleration in milli-steps/sec/sec.
+ */
+inline void L6470::setAccel(L6470StepAccel acc)
+{
+    setParam<dSPIN_ACC>(dSPIN_toReg<dSPIN_ACC>(acc));
+}
+
+
+/** @brief Set the deceleration from a fixed point value.
+ *
+ *  @param dec Deceleration in milli-steps/sec/sec.
+ */
+inline void L6470::setDecel(L6470StepAccel dec)
+{
+    setParam<dSPIN_DEC>(dSPIN_toReg<dSPIN_DEC>(dec));
+}
+
+
+/** @brief Set the maximum speed from a fixed point value.
+ *
+ *  @param spd Maximum speed in milli-steps/sec.
+ */
+inline void L6470::setMaxSpeed(L6470StepRate spd)
+{
+    setParam<dSPIN_MAX_SPEED>(dSPIN_toReg<dSPIN_MAX_SPEED>(spd));
+}
+
+
+/** @brief Set the minimum speed from a fixed point value.
+ *
+ *  @param spd Minimum speed in milli-steps/sec.
+ */
+inline void L6470::setMinSpeed(L6470StepRate spd)
+{
+    setParam<dSPIN_MIN_SPEED>(dSPIN_toReg<dSPIN_MIN_SPEED>(spd));
+}
+
+
+/** @brief Set the full step threshold from a fixed point value.
+ *
+ *  @param spd Threshold speed in milli-steps/sec.
+ */
+inline void L6470::setFullStepThreshold(L6470StepRate spd)
+{
+    setParam<dSPIN_FS_SPD>(dSPIN_toReg<dSPIN_FS_SPD>(spd));
 }
 
 
@@ -345,7 +682,19 @@ inline void L6470::setFullStepThreshold(float sps)
  *
  *  Sets the microstep mode for the dSPIN chip.  Valid values are 0-128 in
  *  powers of 2.  Invalid values are rounded down to next lower valid value.
- *  returns the previous setting.
+ *
+ *  The chip only accepts a new step mode with the bridges HiZ and loses
+ *  ABS_POS and EL_POS when it changes.  If the motor is stopped the bridges
+ *  are released for the change, ABS_POS and MARK are rescaled to the new
+ *  mode, EL_POS is put back so the rotor does not jump and a holding motor is
+ *  energised again.  While the motor is moving the mode is left unchanged.
+ *
+ *  A holding motor has no torque while the bridges are released, for the
+ *  handful of commands between the HiZ and the hard stop (well under a ms on
+ *  a direct chip-select at 5MHz, longer on a slow or shared bus).  An axis
+ *  with a load that can back-drive it, such as a vertical axis, may slip
+ *  during that time.  Change the mode of such an axis only where slipping
+ *  is harmless, or release it with softHiZ() first and re-home afterwards.
  *
  *  @param val value 0 to 128
  *  @return uint8_t: New Microstep Setting
@@ -353,7 +702,7 @@ inline void L6470::setFullStepThreshold(float sps)
 inline uint8_t L6470::setMicroSteps(uint8_t val)
 {
     int oldVal = m_msMode;
-    int regVal = 0;
+    uint8_t regVal = 0;
     
     if (val >= 128)
     {
@@ -396,12 +745,11 @@ inline uint8_t L6470::setMicroSteps(uint8_t val)
         m_msMode = 1;
     }
     
-    setParam(dSPIN_STEP_MODE, regVal);
-    int err = getError();
-    
-    if (err == dSPIN_ERR_NOEXEC)
-        m_msMode = oldVal;
+    if (m_msMode == oldVal and isCached(dSPIN_STEP_MODE))
+        return m_msMode;
     
+    m_msMode = oldVal;
+    writeStepMode(regVal, 1);
     return m_msMode;
 }
 
@@ -414,7 +762,7 @@ inline uint8_t L6470::setMicroSteps(uint8_t val)
 inline void L6470::setPosition(int32_t pos)
 {
     pos &= 0x3FFFFF;                 // Limit value and preserve sign
-    setParam(dSPIN_ABS_POS, pos);
+    setParam<dSPIN_ABS_POS>(pos);
 }
 
 
@@ -435,7 +783,7 @@ inline void L6470::setPosition_FS(int32_t pos)
 inline int32_t L6470::setMark()
 {
     int32_t result = getPosition();
-    setParam(dSPIN_MARK, result);
+    setParam<dSPIN_MARK>(result & dSPIN_Reg<dSPIN_MARK>::MASK);
     return result;
 }
 
@@ -450,7 +798,7 @@ inline int32_t L6470::setMark()
  */
 inline int L6470::setConfig(uint32_t cfg)
 {
-    setParam(dSPIN_CONFIG, cfg);
+    setParam<dSPIN_CONFIG>(cfg);
     return 0;
 }
 
@@ -466,6 +814,70 @@ inline void L6470::invert(uint8_t inv)
 }
 
 
+/** @brief Attach a GPIO input connected to the chip's BUSY output.
+ *
+ *  The pin is used by waitIdle() and service() to see when a command
+ *  completes, and by L6470Group to measure when axes actually start moving.
+ *  The pin is set to report both edges if it supports edges.  The pin is not
+ *  owned by this object.
+ *
+ *  @param pin GPIO input for the BUSY pin or NULL to detach.
+ */
+inline void L6470::bindBusyPin(GPIO_Pin* pin)
+{
+    m_busyPin = pin;
+    m_wasBusy = 0;
+    if (m_busyPin)
+        m_busyPin->set_edge(GPIO_EDGE_BOTH);
+}
+
+
+/** @brief Attach a GPIO input connected to the chip's FLAG output.
+ *
+ *  FLAG is pulled low by the chip on any alarm enabled in ALARM_EN.  The pin
+ *  is set to report falling edges if it supports edges.  The pin is not owned
+ *  by this object.
+ *
+ *  @param pin GPIO input for the FLAG pin or NULL to detach.
+ */
+inline void L6470::bindFlagPin(GPIO_Pin* pin)
+{
+    m_flagPin = pin;
+    if (m_flagPin)
+        m_flagPin->set_edge(GPIO_EDGE_FALLING);
+}
+
+
+/** @brief Set the function called by service() when a command completes.
+ *
+ *  Requires a BUSY pin.  Pass NULL to remove the callback.
+ *
+ *  @param cb Called when BUSY is released.
+ *  @param ctx Pointer passed back to the callback.
+ */
+inline void L6470::onIdle(L6470EventCallback cb, void* ctx)
+{
+    m_idleCb  = cb;
+    m_idleCtx = ctx;
+}
+
+
+/** @brief Set the function called by service() when FLAG is asserted.
+ *
+ *  Requires a FLAG pin.  STATUS is read (clearing the alarm) before the
+ *  callback so lastStatus() shows the cause.  Pass NULL to remove the
+ *  callback.
+ *
+ *  @param cb Called when FLAG is asserted.
+ *  @param ctx Pointer passed back to the callback.
+ */
+inline void L6470::onFlag(L6470EventCallback cb, void* ctx)
+{
+    m_flagCb  = cb;
+    m_flagCtx = ctx;
+}
+
+
 /** @brief Returns 1 if direction is inverted 0 otherwise.
  *
  *  @return uint8_t: Inverted setting
@@ -482,12 +894,8 @@ inline uint8_t L6470::isInverted()
  */
 inline uint8_t L6470::getDir()
 {
-    uint16_t status = getStatus();
-    status &= dSPIN_STATUS_DIR;
-    if (status)
-        return dirInvert(1);
-    else
-        return dirInvert(0);
+    getStatus();
+    return m_status.dir;
 }
 
 
@@ -498,8 +906,9 @@ inline uint8_t L6470::getDir()
  */
 inline uint32_t L6470::getParam(uint8_t param)
 {
-    dspin_xfer(dSPIN_GET_PARAM | param);
-    return paramHandler(param, 0);
+    if (isCached(param))
+        return m_shadow[param];
+    return paramHandler(dSPIN_GET_PARAM | param, param, 0);
 }
 
 
@@ -512,16 +921,12 @@ inline uint32_t L6470::getParam(uint8_t param)
  */
 inline uint32_t L6470::isBusy()
 {
-    uint32_t temp = getParam(dSPIN_STATUS);
-    uint32_t busy = temp & dSPIN_STATUS_BUSY;
+    uint32_t temp = getParam<dSPIN_STATUS>();
+    if (!m_staging)
+        updateStatus(temp);
     
-    if (busy == 0)
-    {
-        temp &= dSPIN_STATUS_MOT_STATUS;
-        temp >>= 5;
-        //if (temp == 0) temp = 0xFF;
-        return temp;
-    }
+    if (m_status.busy)
+        return m_status.motStatus;
     
     return 0;
 }
@@ -537,11 +942,11 @@ inline uint32_t L6470::isBusy()
  */
 inline uint32_t L6470::getStatus()
 {
-    int temp = 0;
-    dspin_xfer(dSPIN_GET_STATUS);
-    temp = dspin_xfer(0)<<8;
-    temp |= dspin_xfer(0);
-    return temp;
+    uint8_t buf[3] = {dSPIN_GET_STATUS, 0, 0};
+    dspin_cmd(buf, 3);
+    if (!m_staging)
+        updateStatus((buf[1]<<8) | buf[2]);
+    return (buf[1]<<8) | buf[2];
 }
 
 
@@ -551,7 +956,7 @@ inline uint32_t L6470::getStatus()
  */
 inline uint32_t L6470::getConfig()
 {
-    return getParam(dSPIN_CONFIG);
+    return getParam<dSPIN_CONFIG>();
 }
 
 
@@ -561,16 +966,12 @@ inline uint32_t L6470::getConfig()
  */
 inline int32_t L6470::getPosition()
 {
-    int32_t regVal = getParam(dSPIN_ABS_POS);
-    int32_t result = 0;
-    
-    if(regVal > 0x1FFFFF)
-    {
-        result = regVal + 0xFFC00000;
-        return result;
-    }
-    else
-        return regVal;
+    int64_t t0  = monotonic();
+    int32_t pos = dSPIN_toSigned(getParam<dSPIN_ABS_POS>(),
+                                 dSPIN_Reg<dSPIN_ABS_POS>::BITS);
+    if (!m_staging)
+        trackSync(pos, t0, monotonic());
+    return pos;
 }
 
 
@@ -584,8 +985,9 @@ inline int32_t L6470::getPosition()
  */
 inline int32_t L6470::getPosition_FS()
 {
-    float pos = (getPosition() / m_msMode) + 0.5;
-    return (int32_t)pos;
+    int32_t pos = getPosition();
+    int32_t half = m_msMode / 2;
+    return (pos >= 0) ? (pos + half) / m_msMode : (pos - half) / m_msMode;
 }
 
 
@@ -598,32 +1000,74 @@ inline int32_t L6470::getPosition_FS()
  */
 inline uint32_t L6470::getError()
 {
-    uint32_t result = 0;
-    uint32_t status = getStatus();
-    uint32_t temp = 0;
-    
-    temp = status & dSPIN_STATUS_NOTPERF_CMD;
-    if (temp) result |= dSPIN_ERR_NOEXEC;
-    
-    temp = status & dSPIN_STATUS_WRONG_CMD;
-    if (temp) result |= dSPIN_ERR_BADCMD;
-    
-    temp = status & dSPIN_STATUS_UVLO;
-    if (temp == 0) result |= dSPIN_ERR_UVLO;
-    
-    temp = status & dSPIN_STATUS_TH_SD;
-    if (temp == 0) result |= dSPIN_ERR_THSHTD;
-    
-    temp = status & dSPIN_STATUS_OCD;
-    if (temp == 0) result |= dSPIN_ERR_OVERC;
-    
-    temp = status & dSPIN_STATUS_STEP_LOSS_A;
-    if (temp == 0) result |= dSPIN_ERR_STALLA;
+    getStatus();
+    return m_status.error;
+}
+
+
+/** @brief Returns the decoded STATUS from the last time it was read.
+ *
+ *  No bus traffic is generated.
+ *
+ *  @return L6470Status: The last decoded status.
+ */
+inline const L6470Status& L6470::lastStatus()
+{
+    return m_status;
+}
+
+
+/** @brief Decode a STATUS register value and keep it as the last status.
+ *
+ *  Used internally whenever STATUS is read and by pollers that read STATUS
+ *  for several chips at once.
+ *
+ *  @param raw The STATUS register value.
+ */
+inline void L6470::updateStatus(uint32_t raw)
+{
+    L6470Status& st = m_status;
     
-    temp = status & dSPIN_STATUS_STEP_LOSS_B;
-    if (temp == 0) result |= dSPIN_ERR_STALLB;
+    st.raw          = raw;
+    st.time         = monotonic();
+    st.hiz          = (raw & dSPIN_STATUS_HIZ) ? 1 : 0;
+    st.busy         = (raw & dSPIN_STATUS_BUSY) ? 0 : 1;
+    st.swClosed     = (raw & dSPIN_STATUS_SW_F) ? 1 : 0;
+    st.swEvent      = (raw & dSPIN_STATUS_SW_EVN) ? 1 : 0;
+    st.dir          = dirInvert((raw & dSPIN_STATUS_DIR) ? 1 : 0);
+    st.motStatus    = (raw & dSPIN_STATUS_MOT_STATUS) >> 5;
+    st.notPerf      = (raw & dSPIN_STATUS_NOTPERF_CMD) ? 1 : 0;
+    st.wrongCmd     = (raw & dSPIN_STATUS_WRONG_CMD) ? 1 : 0;
+    st.uvlo         = (raw & dSPIN_STATUS_UVLO) ? 0 : 1;
+    st.thWarn       = (raw & dSPIN_STATUS_TH_WRN) ? 0 : 1;
+    st.thShutdown   = (raw & dSPIN_STATUS_TH_SD) ? 0 : 1;
+    st.overCurrent  = (raw & dSPIN_STATUS_OCD) ? 0 : 1;
+    st.stallA       = (raw & dSPIN_STATUS_STEP_LOSS_A) ? 0 : 1;
+    st.stallB       = (raw & dSPIN_STATUS_STEP_LOSS_B) ? 0 : 1;
+    st.stepClock    = (raw & dSPIN_STATUS_SCK_MOD) ? 1 : 0;
     
-    return result;
+    st.error = 0;
+    if (st.notPerf)     st.error |= dSPIN_ERR_NOEXEC;
+    if (st.wrongCmd)    st.error |= dSPIN_ERR_BADCMD;
+    if (st.uvlo)        st.error |= dSPIN_ERR_UVLO;
+    if (st.thShutdown)  st.error |= dSPIN_ERR_THSHTD;
+    if (st.overCurrent) st.error |= dSPIN_ERR_OVERC;
+    if (st.stallA)      st.error |= dSPIN_ERR_STALLA;
+    if (st.stallB)      st.error |= dSPIN_ERR_STALLB;
+
+    // A stopped chip stops the estimate, e.g. after a switch hard stop
+    if (m_track and st.motStatus == 0 and m_track->speed() > 0)
+        m_track->halt(st.hiz);
+}
+
+
+/** @brief Returns the CLOCK_MONOTONIC time in ns.
+ */
+inline int64_t L6470::monotonic()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 
@@ -635,13 +1079,7 @@ inline uint32_t L6470::getError()
  */
 inline float L6470::getAccel()
 {
-    float result = 0.0;
-    int32_t regVal = 0;
-    
-    regVal = getParam(dSPIN_ACC);
-    result = regVal/0.137438;
-    
-    return result;
+    return getAccel_FX().milli / 1000.0;
 }
 
 
@@ -653,13 +1091,7 @@ inline float L6470::getAccel()
  */
 inline float L6470::getDecel()
 {
-    float result = 0.0;
-    int32_t regVal = 0;
-    
-    regVal = getParam(dSPIN_DEC);
-    result = regVal/0.137438;
-    
-    return result;
+    return getDecel_FX().milli / 1000.0;
 }
 
 
@@ -669,11 +1101,7 @@ inline float L6470::getDecel()
  */
 inline float L6470::getMaxSpeed()
 {
-    float result = 0.0;
-    uint32_t regVal = getParam(dSPIN_MAX_SPEED);
-    
-    result = regVal/0.065536;
-    return result;
+    return getMaxSpeed_FX().milli / 1000.0;
 }
 
 
@@ -683,11 +1111,7 @@ inline float L6470::getMaxSpeed()
  */
 inline float L6470::getMinSpeed()
 {
-    float result = 0.0;
-    uint32_t regVal = getParam(dSPIN_MIN_SPEED);
-    
-    result = regVal/4.1943;
-    return result;
+    return getMinSpeed_FX().milli / 1000.0;
 }
 
 
@@ -697,11 +1121,7 @@ inline float L6470::getMinSpeed()
  */
 inline float L6470::getFullStepThreshold()
 {
-    float result = 0.0;
-    uint32_t regVal = getParam(dSPIN_FS_SPD);
-    
-    result = regVal/0.065536;
-    return result;
+    return getFullStepThreshold_FX().milli / 1000.0;
 }
 
 
@@ -711,112 +1131,683 @@ inline float L6470::getFullStepThreshold()
  */
 inline float L6470::getSpeed()
 {
-    float result = 0.0;
-    uint32_t regVal = getParam(dSPIN_SPEED);
-    result = regVal/67.108864;
-    return result;
+    return getSpeed_FX().milli / 1000.0;
 }
 
 
-/** @brief Returns the number of microsteps per full step.
+/** @brief Get the acceleration as a fixed point value.
  *
- *  @return int: Microsteps per full physical motor step
+ *  @return L6470StepAccel: Acceleration in milli-steps/sec/sec.
  */
-inline uint8_t L6470::getMicroSteps()
+inline L6470StepAccel L6470::getAccel_FX()
 {
-    return m_msMode;
+    return L6470StepAccel(dSPIN_fromReg<dSPIN_ACC>(getParam<dSPIN_ACC>()));
 }
 
 
-/** @brief Reset the dSPIN chip to power on defaults
+/** @brief Get the deceleration as a fixed point value.
  *
+ *  @return L6470StepAccel: Deceleration in milli-steps/sec/sec.
  */
-inline void L6470::resetDev()
+inline L6470StepAccel L6470::getDecel_FX()
 {
-    dspin_xfer(dSPIN_RESET_DEVICE);
+    return L6470StepAccel(dSPIN_fromReg<dSPIN_DEC>(getParam<dSPIN_DEC>()));
 }
 
 
-/** @brief Move the motor at the specified speed and direction.
- *
- * Motor will run indefinately in the direction specified and at the
- * step rate specfied by the spd parameter in steps per second.
+/** @brief Get the maximum speed as a fixed point value.
  *
- * @param dir Motor direction 0=REV | 1=FWD
- * @param spd Motor speed 0 - 15625
+ *  @return L6470StepRate: Maximum speed in milli-steps/sec.
  */
-inline void L6470::run(uint8_t dir, float spd)
+inline L6470StepRate L6470::getMaxSpeed_FX()
 {
-    uint32_t regVal = (spd * 67.108864) + 0.5;
-    if (regVal > 0xFFFFF) regVal = 0xFFFFF;
-    dir = dirInvert(dir);
-    dspin_xfer(dSPIN_RUN | dir);
-    dspin_xfer((uint8_t)(regVal >> 16));
-    dspin_xfer((uint8_t)(regVal >> 8));
-    dspin_xfer((uint8_t)(regVal));
+    uint32_t regVal = getParam<dSPIN_MAX_SPEED>();
+    return L6470StepRate(dSPIN_fromReg<dSPIN_MAX_SPEED>(regVal));
 }
 
 
-/** @brief Move the motor the specified number of steps and direction.
+/** @brief Get the minimum speed as a fixed point value.
  *
- *  Motor will accelerate, run to the relative number of steps specified and
- *  in the direction
- *  specified, and decelerate.
+ *  The LSPD_OPT bit is not part of the speed.
  *
- *  @param dir Motor direction 0=REV | 1=FWD
- *  @param steps Number of steps to move.
+ *  @return L6470StepRate: Minimum speed in milli-steps/sec.
  */
-inline void L6470::move(int32_t steps)
+inline L6470StepRate L6470::getMinSpeed_FX()
 {
-    int dir = 0;
-    
-    if (steps > 0)
-        dir = 1;
-    
-    uint32_t abs_steps = abs(steps);
-    if (abs_steps > 0x3FFFFF) abs_steps = 0x3FFFFF;
-    dir = dirInvert(dir);
-    dspin_xfer(dSPIN_MOVE | dir);
-    dspin_xfer((uint8_t)(abs_steps >> 16));
-    dspin_xfer((uint8_t)(abs_steps >> 8));
-    dspin_xfer((uint8_t)(abs_steps));
+    uint32_t regVal = getParam<dSPIN_MIN_SPEED>() & 0xFFF;
+    return L6470StepRate(dSPIN_fromReg<dSPIN_MIN_SPEED>(regVal));
 }
 
 
-/** @brief Move the motor the specified number of FULL STEPS and direction.
- *
- * Motor will accelerate, run to the relative number of FULL STEPS specified
- * and in the direction specified, then decelerate.
+/** @brief Get the full step threshold as a fixed point value.
  *
- * @param  dir Motor direction 0=REV | 1=FWD
- * @param  steps Number of FULL STEPS to move.
+ *  @return L6470StepRate: Threshold speed in milli-steps/sec.
  */
-inline void L6470::move_FS(int32_t steps)
+inline L6470StepRate L6470::getFullStepThreshold_FX()
 {
-    steps *= m_msMode;
-    move(steps);
+    uint32_t regVal = getParam<dSPIN_FS_SPD>();
+    return L6470StepRate(dSPIN_fromReg<dSPIN_FS_SPD>(regVal));
 }
 
 
-/** @brief Move the motor to the absolute microstep position specified.
- *
- *  Motor will accelerate, run to the relative number of microsteps specified
- *  in the direction that is the shortest distance, and decelerate.
+/** @brief Get the current speed as a fixed point value.
  *
- *  @param pos Absolute microstep postion to move to.
+ *  @return L6470StepRate: Current speed in milli-steps/sec.
  */
-inline void L6470::gotoPosABS(int32_t pos)
+inline L6470StepRate L6470::getSpeed_FX()
 {
-    uint32_t abs_pos = (uint32_t)pos;
-    dspin_xfer(dSPIN_GOTO);
-    if (abs_pos > 0x3FFFFF) abs_pos &= 0x3FFFFF;
-    dspin_xfer((uint8_t)(abs_pos >> 16));
-    dspin_xfer((uint8_t)(abs_pos >> 8));
-    dspin_xfer((uint8_t)(abs_pos));
+    return L6470StepRate(dSPIN_fromReg<dSPIN_SPEED>(getParam<dSPIN_SPEED>()));
 }
 
 
-/** @brief Moves to the specfied absolute position in FULL STEPS in the direction specified.
+/** @brief Returns the number of microsteps per full step.
+ *
+ *  @return int: Microsteps per full physical motor step
+ */
+inline uint8_t L6470::getMicroSteps()
+{
+    return m_msMode;
+}
+
+
+/** @brief Returns the chain this chip is attached to or NULL.
+ */
+inline L6470Chain* L6470::getChain()
+{
+    return m_chain;
+}
+
+
+/** @brief Returns the position of this chip in its chain.
+ */
+inline int L6470::getSlot()
+{
+    return m_slot;
+}
+
+
+/** @brief Returns the GPIO input bound to the BUSY output or NULL.
+ */
+inline GPIO_Pin* L6470::getBusyPin()
+{
+    return m_busyPin;
+}
+
+
+/** @brief Returns the GPIO input bound to the FLAG output or NULL.
+ */
+inline GPIO_Pin* L6470::getFlagPin()
+{
+    return m_flagPin;
+}
+
+
+/** @brief Wait until the chip has finished the current command.
+ *
+ *  With a BUSY pin bound this sleeps on the pin edge, or checks the pin level
+ *  each ms if the pin has no edge support, and makes no SPI transfers.  The
+ *  level is checked again at least every L6470_IDLE_SLICE ms, so a release
+ *  that lands between the level check and the start of the wait costs at
+ *  most one slice.  Without a BUSY pin STATUS is read each ms.
+ *
+ *  @param timeout_ms Longest time to wait in ms, -1 waits forever.
+ *  @return int: 0 - Idle. -1 - Timed out.
+ */
+inline int L6470::waitIdle(int timeout_ms)
+{
+    int64_t deadline = monotonic() + (int64_t)timeout_ms * 1000000;
+    
+    while (1)
+    {
+        if (m_busyPin)
+        {
+            // BUSY is open-drain and active low
+            if (m_busyPin->get() == GPIO_HIGH)
+                return 0;
+        }
+        else if (!isBusy())
+            return 0;
+        
+        int remain = L6470_IDLE_SLICE;
+        if (timeout_ms >= 0)
+        {
+            int64_t left = deadline - monotonic();
+            if (left <= 0)
+                return -1;
+            if (left < (int64_t)L6470_IDLE_SLICE * 1000000)
+                remain = (left + 999999) / 1000000;
+        }
+        
+        if (!m_busyPin or m_busyPin->wait_edge(remain) < 0)
+            usleep(1000);
+    }
+}
+
+
+/** @brief Check the BUSY and FLAG pins and call the event callbacks.
+ *
+ *  Call from the control loop.  Only pin levels are read unless FLAG is
+ *  asserted, in which case STATUS is read once to clear it.
+ *
+ *  @return int: Number of callbacks made.
+ */
+inline int L6470::service()
+{
+    int events = 0;
+    
+    if (m_busyPin)
+    {
+        int busy = (m_busyPin->get() == GPIO_LOW) ? 1 : 0;
+        if (m_wasBusy and !busy and m_idleCb)
+        {
+            m_idleCb(*this, m_idleCtx);
+            events++;
+        }
+        m_wasBusy = busy;
+    }
+    
+    if (m_flagPin and m_flagPin->get() == GPIO_LOW)
+    {
+        getStatus();
+        if (m_flagCb)
+        {
+            m_flagCb(*this, m_flagCtx);
+            events++;
+        }
+    }
+    
+    return events;
+}
+
+
+/** @brief Forget the shadow copy of a register.
+ *
+ *  The next read of the register goes to the chip.
+ *
+ *  @param param The register address.
+ */
+inline void L6470::invalidate(uint8_t param)
+{
+    if (param < dSPIN_REG_COUNT)
+        m_shadowValid &= ~(1UL << param);
+}
+
+
+/** @brief Forget the shadow copy of every register.
+ */
+inline void L6470::invalidateAll()
+{
+    m_shadowValid = 0;
+}
+
+
+/** @brief Reload the shadow copy of every non-volatile register from the chip.
+ */
+inline void L6470::refresh()
+{
+    invalidateAll();
+    for (uint8_t param=dSPIN_ABS_POS; param<dSPIN_REG_COUNT; param++)
+    {
+        if ((dSPIN_REG_TABLE[param].flags & dSPIN_REG_VOLATILE) == 0)
+            getParam(param);
+    }
+}
+
+
+/** @brief Returns 1 if reads of the register are served from the shadow copy.
+ *
+ *  @param param The register address.
+ */
+inline int L6470::isCached(uint8_t param)
+{
+    if (param >= dSPIN_REG_COUNT)
+        return 0;
+    return (m_shadowValid & (1UL << param)) ? 1 : 0;
+}
+
+
+/** @brief Read every writable, non-volatile register into a profile.
+ *
+ *  All of the GET_PARAM commands are sent in one bus operation.  The shadow
+ *  copy is refreshed with the values read.  ABS_POS and EL_POS are not part
+ *  of the snapshot.
+ *
+ *  @param prof The profile to fill.  Previous contents are discarded.
+ *  @return int: Number of registers read or negative on failure.
+ */
+inline int L6470::snapshot(L6470Profile& prof)
+{
+    uint8_t buf[L6470_STAGE_LEN];
+    int     len = 0;
+    int     count = 0;
+    
+    if (m_staging)
+        return -1;
+    
+    for (uint8_t param=1; param<dSPIN_REG_COUNT; param++)
+    {
+        const dSPIN_REG_INFO& reg = dSPIN_REG_TABLE[param];
+        if (reg.flags & (dSPIN_REG_RO | dSPIN_REG_VOLATILE))
+            continue;
+        
+        buf[len++] = dSPIN_GET_PARAM | param;
+        for (int i=0; i<(reg.bits+7)/8; i++)
+            buf[len++] = 0;
+    }
+    
+    if (dspin_cmd(buf, len) < 0)
+        return -1;
+    
+    prof.clear();
+    len = 0;
+    for (uint8_t param=1; param<dSPIN_REG_COUNT; param++)
+    {
+        const dSPIN_REG_INFO& reg = dSPIN_REG_TABLE[param];
+        if (reg.flags & (dSPIN_REG_RO | dSPIN_REG_VOLATILE))
+            continue;
+        
+        uint32_t val = 0;
+        len++;
+        for (int i=0; i<(reg.bits+7)/8; i++)
+            val = (val << 8) | buf[len++];
+        val &= 0xFFFFFFFFUL >> (32 - reg.bits);
+        
+        prof.set(param, val);
+        shadowStore(param, prof.get(param));
+        count++;
+    }
+    
+    return count;
+}
+
+
+/** @brief Write every register held in a profile to the chip.
+ *
+ *  All of the SET_PARAM commands are sent in one bus operation.  The motor
+ *  should be stopped since the chip refuses many writes while moving.
+ *
+ *  STEP_MODE is written last and on its own, the way setMicroSteps() does
+ *  it, since the chip only accepts it with the bridges HiZ.  It is skipped
+ *  and -1 returned if the motor is moving or energised (call softHiZ()
+ *  first), or while staging.  The other registers are written either way.
+ *
+ *  @param prof The profile to write.
+ *  @return int: Number of registers written or negative on failure.
+ */
+inline int L6470::restore(const L6470Profile& prof)
+{
+    uint8_t buf[L6470_STAGE_LEN];
+    int     len = 0;
+    int     count = 0;
+    
+    for (uint8_t param=1; param<dSPIN_REG_COUNT; param++)
+    {
+        const dSPIN_REG_INFO& reg = dSPIN_REG_TABLE[param];
+        if (!prof.has(param) or (reg.flags & dSPIN_REG_RO) or
+            param == dSPIN_STEP_MODE)
+            continue;
+        
+        int bytes = (reg.bits+7)/8;
+        uint32_t val = prof.get(param);
+        buf[len++] = dSPIN_SET_PARAM | param;
+        for (int i=1; i<=bytes; i++)
+            buf[len++] = (uint8_t)(val >> (8*(bytes-i)));
+        count++;
+    }
+    
+    if (len and dspin_cmd(buf, len) < 0)
+        return -1;
+    
+    for (uint8_t param=1; param<dSPIN_REG_COUNT; param++)
+    {
+        if (!prof.has(param) or (dSPIN_REG_TABLE[param].flags & dSPIN_REG_RO) or
+            param == dSPIN_STEP_MODE)
+            continue;
+        shadowStore(param, prof.get(param));
+    }
+    
+    if (prof.has(dSPIN_STEP_MODE))
+    {
+        if (m_staging or writeStepMode(prof.get(dSPIN_STEP_MODE), 0) < 0)
+            return -1;
+        count++;
+    }
+    
+    return count;
+}
+
+
+/** @brief Start estimating the motor position from the commands sent.
+ *
+ *  Creates the model of the chip and loads it with the motion registers and
+ *  ABS_POS.  Enable it with the motor stopped, before the commands to be
+ *  followed; a move already under way is not known to the estimate.
+ *
+ *  @return int: 0 - Success. -1 - Staging, the chip cannot be read.
+ */
+inline int L6470::enableEstimate()
+{
+    static const uint8_t regs[] = {dSPIN_ACC, dSPIN_DEC, dSPIN_MAX_SPEED,
+                                   dSPIN_MIN_SPEED, dSPIN_FS_SPD,
+                                   dSPIN_STEP_MODE, dSPIN_MARK};
+    
+    if (m_track)
+        return 0;
+    if (m_staging)
+        return -1;
+    
+    L6470Model* track = new L6470Model;
+    for (unsigned int i=0; i<sizeof(regs); i++)
+        track->setReg(regs[i], getParam(regs[i]));
+    
+    m_track     = track;
+    m_trackTime = monotonic();
+    getPosition();
+    return 0;
+}
+
+
+/** @brief Returns the estimated motor position without bus traffic.
+ *
+ *  The estimate follows the commands sent to the chip using its own ACC,
+ *  DEC, MAX_SPEED and MIN_SPEED settings.  ABS_POS is read instead when the
+ *  resync interval has passed or the estimate is not enabled.
+ *
+ *  @return int32_t: Signed microsteps relative to the home 0 position.
+ */
+inline int32_t L6470::estPosition()
+{
+    if (!m_track)
+        return getPosition();
+    
+    trackAdvance();
+    if (m_resyncNs and m_trackTime - m_syncTime >= m_resyncNs)
+        return getPosition();
+    return m_track->position();
+}
+
+
+/** @brief Returns the estimated motor position in FULL STEPS.
+ *
+ *  @return int32_t: Signed full steps relative to the home 0 position.
+ */
+inline int32_t L6470::estPosition_FS()
+{
+    int32_t pos = estPosition();
+    int32_t half = m_msMode / 2;
+    return (pos >= 0) ? (pos + half) / m_msMode : (pos - half) / m_msMode;
+}
+
+
+/** @brief Returns the estimated motor speed without bus traffic.
+ *
+ *  Reads SPEED from the chip if the estimate is not enabled.
+ *
+ *  @return float: Speed in steps per second.
+ */
+inline float L6470::estSpeed()
+{
+    if (!m_track)
+        return getSpeed();
+    
+    trackAdvance();
+    return m_track->speed();
+}
+
+
+/** @brief Returns the largest error expected in estPosition().
+ *
+ *  The bound is the motion during the last ABS_POS read plus the oscillator
+ *  tolerance applied to the distance moved since then.  0 if the estimate is
+ *  not enabled, since estPosition() then reads the chip.
+ *
+ *  @return uint32_t: Maximum drift in microsteps.
+ */
+inline uint32_t L6470::estDrift()
+{
+    if (!m_track)
+        return 0;
+    
+    trackAdvance();
+    return (uint32_t)ceil(m_syncErr + m_travel * m_clockPpm / 1e6);
+}
+
+
+/** @brief Returns the correction applied by the last ABS_POS read.
+ *
+ *  @return int32_t: Read position minus estimated position in microsteps.
+ */
+inline int32_t L6470::lastCorrection()
+{
+    return m_correction;
+}
+
+
+/** @brief Read ABS_POS and bring the estimate in line with it.
+ *
+ *  @return int32_t: The position read from the chip.
+ */
+inline int32_t L6470::resync()
+{
+    return getPosition();
+}
+
+
+/** @brief Set how often estPosition() reads ABS_POS from the chip.
+ *
+ *  @param ms Milliseconds between reads, 0 to only read on demand.
+ */
+inline void L6470::setResyncInterval(uint32_t ms)
+{
+    m_resyncNs = (int64_t)ms * 1000000;
+}
+
+
+/** @brief Set the tolerance of the chip's clock used by estDrift().
+ *
+ *  @param ppm Tolerance in parts per million.  The internal oscillator is
+ *             good to 3% (30000), an external crystal to about 100.
+ */
+inline void L6470::setClockTolerance(uint32_t ppm)
+{
+    m_clockPpm = ppm;
+}
+
+
+/** @brief Stage commands rather than sending them.
+ *
+ *  Commands issued after this call are collected until flushStage() or
+ *  cancelStage() is called.  A command that would take the staged bytes past
+ *  L6470_STAGE_LEN is refused and not staged, check stagedLen() when staging
+ *  long sequences.
+ */
+inline void L6470::beginStage()
+{
+    m_staging    = 1;
+    m_stageLen   = 0;
+    m_stageValid = 0;
+}
+
+
+/** @brief Stop staging and send the staged commands in one bus operation.
+ *
+ *  @return int: Negative on failure.
+ */
+inline int L6470::flushStage()
+{
+    int result = 0;
+    
+    m_staging = 0;
+    if (m_stageLen > 0)
+    {
+        trackBytes(m_stage, m_stageLen);
+        result = dspin_send(m_stage, m_stageLen);
+    }
+    shadowStaged(result >= 0);
+    m_stageLen = 0;
+    return result;
+}
+
+
+/** @brief Stop staging and discard the staged commands.
+ *
+ *  Registers written while staging are dropped from the shadow copy since
+ *  the chip may or may not get the writes (L6470Dispatcher sends them later).
+ */
+inline void L6470::cancelStage()
+{
+    shadowStaged(0);
+    m_staging  = 0;
+    m_stageLen = 0;
+}
+
+
+/** @brief Stop staging after the staged commands were sent by other means.
+ *
+ *  Used by L6470Group once it has sent the bytes from stagedData() so the
+ *  position estimate and the register shadow keep following them.  Call it
+ *  after a successful transfer, and cancelStage() after a failed one.
+ */
+inline void L6470::stageSent()
+{
+    trackBytes(m_stage, m_stageLen);
+    shadowStaged(1);
+    m_staging  = 0;
+    m_stageLen = 0;
+}
+
+
+/** @brief Feed commands sent to the chip by other means to the estimate.
+ *
+ *  Used by L6470Dispatcher on its own thread once a queued request has been
+ *  sent, the bytes having been taken from stagedData() and the staging
+ *  cancelled.
+ *
+ *  @param buf The command bytes as sent.
+ *  @param len Number of bytes.
+ */
+inline void L6470::commandsSent(const uint8_t* buf, int len)
+{
+    trackBytes(buf, len);
+}
+
+
+/** @brief Returns 1 while commands are being staged, 0 otherwise.
+ */
+inline int L6470::isStaging()
+{
+    return m_staging;
+}
+
+
+/** @brief Returns the number of bytes currently staged.
+ */
+inline int L6470::stagedLen()
+{
+    return m_stageLen;
+}
+
+
+/** @brief Returns the bytes currently staged.
+ */
+inline const uint8_t* L6470::stagedData()
+{
+    return m_stage;
+}
+
+
+/** @brief Reset the dSPIN chip to power on defaults
+ *
+ */
+inline void L6470::resetDev()
+{
+    dspin_xfer(dSPIN_RESET_DEVICE);
+    invalidateAll();
+}
+
+
+/** @brief Move the motor at the specified speed and direction.
+ *
+ * Motor will run indefinately in the direction specified and at the
+ * step rate specfied by the spd parameter in steps per second.
+ *
+ * @param dir Motor direction 0=REV | 1=FWD
+ * @param spd Motor speed 0 - 15625
+ */
+inline void L6470::run(uint8_t dir, float spd)
+{
+    run(dir, L6470StepRate((spd > 0) ? spd*1000 + 0.5 : 0));
+}
+
+
+/** @brief Run the motor at a fixed point speed.
+ *
+ *  Integer only conversion, see "l6470-units.h".
+ *
+ *  @param dir Motor direction 0=REV | 1=FWD
+ *  @param spd Speed in milli-steps/sec.
+ */
+inline void L6470::run(uint8_t dir, L6470StepRate spd)
+{
+    dir = dirInvert(dir);
+    dspin_cmd(dSPIN_RUN | dir, dSPIN_toReg<dSPIN_SPEED>(spd));
+}
+
+
+/** @brief Move the motor the specified number of steps and direction.
+ *
+ *  Motor will accelerate, run to the relative number of steps specified and
+ *  in the direction
+ *  specified, and decelerate.
+ *
+ *  @param dir Motor direction 0=REV | 1=FWD
+ *  @param steps Number of steps to move.
+ */
+inline void L6470::move(int32_t steps)
+{
+    int dir = 0;
+    
+    if (steps > 0)
+        dir = 1;
+    
+    uint32_t abs_steps = abs(steps);
+    if (abs_steps > 0x3FFFFF) abs_steps = 0x3FFFFF;
+    dir = dirInvert(dir);
+    dspin_cmd(dSPIN_MOVE | dir, abs_steps);
+}
+
+
+/** @brief Move the motor the specified number of FULL STEPS and direction.
+ *
+ * Motor will accelerate, run to the relative number of FULL STEPS specified
+ * and in the direction specified, then decelerate.
+ *
+ * @param  dir Motor direction 0=REV | 1=FWD
+ * @param  steps Number of FULL STEPS to move.
+ */
+inline void L6470::move_FS(int32_t steps)
+{
+    steps *= m_msMode;
+    move(steps);
+}
+
+
+/** @brief Move the motor to the absolute microstep position specified.
+ *
+ *  Motor will accelerate, run to the relative number of microsteps specified
+ *  in the direction that is the shortest distance, and decelerate.
+ *
+ *  @param pos Absolute microstep postion to move to.
+ */
+inline void L6470::gotoPosABS(int32_t pos)
+{
+    uint32_t abs_pos = (uint32_t)pos;
+    if (abs_pos > 0x3FFFFF) abs_pos &= 0x3FFFFF;
+    dspin_cmd(dSPIN_GOTO, abs_pos);
+}
+
+
+/** @brief Moves to the specfied absolute position in FULL STEPS in the direction specified.
  *
  *  @param pos The position to move to in FULL Steps
  */
@@ -845,10 +1836,7 @@ inline void L6470::gotoPos(int32_t pos)
     uint32_t abs_pos = (uint32_t)pos;
     if (abs_pos > 0x3FFFFF) abs_pos &= 0x3FFFFF;
     
-    dspin_xfer(dSPIN_GOTO_DIR | dir);
-    dspin_xfer((uint8_t)(abs_pos >> 16));
-    dspin_xfer((uint8_t)(abs_pos >> 8));
-    dspin_xfer((uint8_t)(abs_pos));
+    dspin_cmd(dSPIN_GOTO_DIR | dir, abs_pos);
 }
 
 
@@ -881,22 +1869,32 @@ inline void L6470::gotoMark()
 }
 
 
+/** @brief Set the current position as the home (zero) position.
+ *
+ */
+inline void L6470::resetPos()
+{
+    dspin_xfer(dSPIN_RESET_POS);
+}
+
+
 /** @brief Move at the indicated speed until a switch event is received.
  *
- *  @param act Resets the ABS_POS register [1] or Copies postion to MARK [0].
+ *  @param act Resets the ABS_POS register [dSPIN_ACTION_RESET] or copies the
+ *             position to MARK [dSPIN_ACTION_COPY].
  *  @param dir Direction of motor rotation.
  *  @param spd Speed of movement.
  */
 inline void L6470::goUntil(uint8_t act, uint8_t dir, float spd)
 {
-    uint32_t spdVal = (spd * 67.108864) + 0.5;
+    uint32_t spdVal = dSPIN_toReg<dSPIN_SPEED>(
+                          L6470StepRate((spd > 0) ? spd*1000 + 0.5 : 0));
     dir = dirInvert(dir);
     if (spdVal > 0x3FFFFF) spdVal = 0x3FFFFF;
     
-    dspin_xfer(dSPIN_GO_UNTIL | act | dir);
-    dspin_xfer((uint8_t)(spdVal >> 16));
-    dspin_xfer((uint8_t)(spdVal >> 8));
-    dspin_xfer((uint8_t)(spdVal));
+    // ACT is bit 3 of the opcode
+    dspin_cmd(dSPIN_GO_UNTIL | (act ? 0x08 : 0) | dir, spdVal);
+    invalidate(dSPIN_MARK);
 }
 
 
@@ -938,17 +1936,20 @@ inline void L6470::hardHiZ()
 
 inline void L6470::releaseSW(uint8_t act, uint8_t dir)
 {
-    dspin_xfer(dSPIN_RELEASE_SW | act | dir);
+    dspin_xfer(dSPIN_RELEASE_SW | (act ? 0x08 : 0) | dir);
+    invalidate(dSPIN_MARK);
 }
 
 
 /*   Generalization of the subsections of the register read/write functionality.
  *   We want the end user to just write the value without worrying about length,
- *   so we pass a bit length parameter from the calling function.
+ *   so we pass a bit length parameter from the calling function.  The opcode
+ *   and payload are shifted to the chip as one command.
  */
-inline uint32_t L6470::procParam(uint32_t value, uint8_t bit_len)
+inline uint32_t L6470::procParam(uint8_t cmd, uint32_t value, uint8_t bit_len)
 {
     uint32_t ret_val=0;
+    uint8_t  buf[L6470_MAX_CMD_LEN];
     
     uint8_t byte_len = bit_len/8;   // How many BYTES do we have?
     if (bit_len%8 > 0)              // Make sure not to lose any partial byte values.
@@ -960,26 +1961,25 @@ inline uint32_t L6470::procParam(uint32_t value, uint8_t bit_len)
     if (value > mask)
         value = mask;
     
-    // The following three if statements handle the various possible byte length
-    //  transfers- it'll be no less than 1 but no more than 3 bytes of data.
-    // dspin_xfer() sends a byte out through SPI and returns a byte received
-    //  over SPI- when calling it, we typecast a shifted version of the masked
-    //  value, then we shift the received value back by the same amount and
-    //  store it until return time.
-    if (byte_len == 3)
-    {
-        ret_val |= dspin_xfer((uint8_t)(value>>16)) << 16;
-    }
+    // The payload is 1 to 3 bytes sent MSB first behind the opcode. The bytes
+    //  received in the same slots hold the register value for a GET_PARAM.
+    buf[0] = cmd;
+    for (uint8_t i=1; i<=byte_len; i++)
+        buf[i] = (uint8_t)(value >> (8*(byte_len-i)));
     
-    if (byte_len >= 2)
-    {
-        ret_val |= dspin_xfer((uint8_t)(value>>8)) << 8;
-    }
+    int result = dspin_cmd(buf, byte_len+1);
     
-    if (byte_len >= 1)
-    {
-        ret_val |= dspin_xfer((uint8_t)value);
-    }
+    for (uint8_t i=1; i<=byte_len; i++)
+        ret_val = (ret_val << 8) | buf[i];
+    
+    // Keep the shadow copy in step with what was written or read.  Replies
+    //  are not available while staging.
+    if (result < 0)
+        invalidate(cmd & 0x1F);
+    else if ((cmd & dSPIN_GET_PARAM) == 0)
+        shadowStore(cmd & 0x1F, value);
+    else if (!m_staging)
+        shadowStore(cmd & 0x1F, ret_val & mask);
     
     // Return the received values. Mask off any unnecessary bits, just for
     //  the sake of thoroughness- we don't EXPECT to see anything outside
@@ -989,206 +1989,231 @@ inline uint32_t L6470::procParam(uint32_t value, uint8_t bit_len)
 
 
 /*  This function handles the variable length parameters for the various
- *  chip registers.  Since different parameters take different numbers of
- *  bits we select the correct size for the parameter and pass that to the next
- *  function along with the proper bit length.
+ *  chip registers.  The width of each register is looked up in the register
+ *  table and passed to the next function along with the command opcode.
+ *  Read-only registers are always sent a zero payload.
+ */
+inline uint32_t L6470::paramHandler(uint8_t cmd, uint8_t param, uint32_t value)
+{
+    if (param >= dSPIN_REG_COUNT or dSPIN_REG_TABLE[param].bits == 0)
+        return procParam(cmd, value & 0xFF, 8);
+    
+    const dSPIN_REG_INFO& reg = dSPIN_REG_TABLE[param];
+    if (reg.flags & dSPIN_REG_RO)
+        value = 0;
+    
+    return procParam(cmd, value, reg.bits);
+}
+
+
+/** @brief Write a register with its width resolved at compile time.
+ *
+ *  @param value The value to store in the register.  Values too large for
+ *               the register are limited to the register maximum.
+ */
+template<uint8_t REG>
+inline void L6470::setParam(uint32_t value)
+{
+    (void)sizeof(dSPIN_RegWritable<(dSPIN_Reg<REG>::FLAGS & dSPIN_REG_RO) == 0>);
+    
+    uint8_t buf[dSPIN_Reg<REG>::BYTES + 1];
+    
+    if (value > dSPIN_Reg<REG>::MASK)
+        value = dSPIN_Reg<REG>::MASK;
+    
+    buf[0] = dSPIN_SET_PARAM | REG;
+    for (int i=1; i<=dSPIN_Reg<REG>::BYTES; i++)
+        buf[i] = (uint8_t)(value >> (8*(dSPIN_Reg<REG>::BYTES-i)));
+    
+    if (dspin_cmd(buf, dSPIN_Reg<REG>::BYTES + 1) < 0)
+        invalidate(REG);
+    else
+        shadowStore(REG, value);
+}
+
+
+/** @brief Read a register with its width resolved at compile time.
+ *
+ *  @return uint32_t: The raw register value.
  */
-inline uint32_t L6470::paramHandler(uint8_t param, uint32_t value)
+template<uint8_t REG>
+inline uint32_t L6470::getParam()
 {
+    uint8_t  buf[dSPIN_Reg<REG>::BYTES + 1];
     uint32_t ret_val = 0;
     
-    switch (param)
-    {
-            //  ABS_POS is the current absolute offset from home. It is a 22 bit number
-            //  expressed in two's complement. At power up, this value is 0. It cannot
-            //  be written when the motor is running, but at any other time, it can be
-            //  updated to change the interpreted position of the motor.
-        case dSPIN_ABS_POS:
-            ret_val = procParam(value, 22);
-            break;
-            
-            //  EL_POS is the current electrical position in the step generation cycle.
-            //  It can be set when the motor is not in motion. Value is 0 on power up.
-        case dSPIN_EL_POS:
-            ret_val = procParam(value, 9);
-            break;
-            
-            //  MARK is a second position other than 0 that the motor can be told to go
-            //  to. As with ABS_POS, it is 22-bit two's complement. Value is 0 on power
-            //  up.
-        case dSPIN_MARK:
-            ret_val = procParam(value, 22);
-            break;
-            
-            //  SPEED contains information about the current speed. It is read-only. It
-            //  does NOT provide direction information.
-        case dSPIN_SPEED:
-            ret_val = procParam(0, 20);
-            break;
-            
-            //  ACC and DEC set the acceleration and deceleration rates. Set ACC to
-            //  0xFFF to get infinite acceleration/decelaeration- there is no way to
-            //  get infinite deceleration w/o infinite acceleration (except the HARD
-            //  STOP command). Cannot be written while motor is running. Both default
-            //  to 0x08A on power up.
-        case dSPIN_ACC:
-            ret_val = procParam(value, 12);
-            break;
-            
-        case dSPIN_DEC:
-            ret_val = procParam(value, 12);
-            break;
-            
-            //  MAX_SPEED is just what it says: any command which attempts to set the
-            //  speed of the motor above this value will simply cause the motor to turn
-            //  at this speed. Value is 0x041 on power up.
-        case dSPIN_MAX_SPEED:
-            ret_val = procParam(value, 10);
-            break;
-            
-            //  MIN_SPEED controls two things- the activation of the low-speed
-            //  optimization feature and the lowest speed the motor will be allowed to
-            //  operate at. LSPD_OPT is the 13th bit, and when it is set, the minimum
-            //  allowed speed is automatically set to zero. This value is 0 on startup.
-            //  SetLSPDOpt() function exists to enable/disable the optimization feature.
-        case dSPIN_MIN_SPEED:
-            ret_val = procParam(value, 12);
-            break;
-            
-            //  FS_SPD register contains a threshold value above which microstepping is
-            //  disabled and the dSPIN operates in full-step mode. Defaults to 0x027 on
-            //  power up.
-        case dSPIN_FS_SPD:
-            ret_val = procParam(value, 10);
-            break;
-            
-            //  KVAL is the maximum voltage of the PWM outputs. These 8-bit values are
-            //  ratiometric representations: 255 for full output voltage, 128 half, etc.
-            //  Default is 0x29. The implications of different KVAL settings is too
-            //  complex to dig into here, but it will usually work to max the value for
-            //  RUN, ACC, and DEC. Maxing the value for HOLD may result in excessive
-            //  power dissipation when the motor is not running.
-        case dSPIN_KVAL_HOLD:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-        case dSPIN_KVAL_RUN:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-        case dSPIN_KVAL_ACC:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-        case dSPIN_KVAL_DEC:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-            //  INT_SPD, ST_SLP, FN_SLP_ACC and FN_SLP_DEC are all related to the back
-            //  EMF compensation functionality. Please see the datasheet for details of
-            //  this function, it is too complex to discuss here. Default values seem
-            //  to work well enough.
-        case dSPIN_INT_SPD:
-            ret_val = procParam(value, 14);
-            break;
-            
-        case dSPIN_ST_SLP:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-        case dSPIN_FN_SLP_ACC:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-        case dSPIN_FN_SLP_DEC:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-            //  K_THERM is motor winding thermal drift compensation. Please see the
-            //  datasheet for full details on operation- the default value should be
-            //  okay for most use.
-        case dSPIN_K_THERM:
-            ret_val = dspin_xfer((uint8_t)value & 0x0F);
-            break;
-            
-            //  ADC_OUT is a read-only register containing the result of the ADC
-            //  measurements. This is less useful than it sounds; see the datasheet
-            //  for more information.
-        case dSPIN_ADC_OUT:
-            ret_val = dspin_xfer(0);
-            break;
-            
-            //  Set the overcurrent threshold. Ranges from 375mA to 6A in steps of
-            //  375mA. A set of defined constants is provided for the user's
-            //  convenience. Default value is 3.375A- 0x08. This is a 4-bit value.
-        case dSPIN_OCD_TH:
-            ret_val = dspin_xfer((uint8_t)value & 0x0F);
-            break;
-            
-            //  Stall current threshold. Defaults to 0x40, or 2.03A. Value is from
-            //  31.25mA to 4A in 31.25mA steps. This is a 7-bit value.
-        case dSPIN_STALL_TH:
-            ret_val = dspin_xfer((uint8_t)value & 0x7F);
-            break;
-            
-            //  STEP_MODE controls the microstepping settings, as well as the generation
-            //  of an output signal from the dSPIN. Bits 2:0 control the number of
-            //  microsteps per step the part will generate. Bit 7 controls whether the
-            //  BUSY/SYNC pin outputs a BUSY signal or a step synchronization signal.
-            //  Bits 6:4 control the frequency of the output signal relative to the
-            //  full-step frequency; see datasheet for that relationship as it is too
-            //  complex to reproduce here. Most likely, only the microsteps per step
-            //  value will be needed; there is a set of constants provided for ease of
-            //  use of these values.
-        case dSPIN_STEP_MODE:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-            // ALARM_EN controls which alarms will cause the FLAG pin to fall. A set of
-            //  constants is provided to make this easy to interpret. By default,
-            //  ALL alarms will trigger the FLAG pin.
-        case dSPIN_ALARM_EN:
-            ret_val = dspin_xfer((uint8_t)value);
-            break;
-            
-            //  CONFIG contains some assorted configuration bits and fields. A fairly
-            //  comprehensive set of reasonably self-explanatory constants is provided,
-            //  but users should refer to the datasheet before modifying the contents
-            //  of this register to be certain they understand the implications of their
-            //  modifications. Value on boot is 0x2E88; this can be a useful way to
-            //  verify proper start up and operation of the dSPIN chip.
-        case dSPIN_CONFIG:
-            ret_val = procParam(value, 16);
-            break;
-            
-            //  STATUS contains read-only information about the current condition of the
-            //  chip. A comprehensive set of constants for masking and testing this
-            //  register is provided, but users should refer to the datasheet to ensure
-            //  that they fully understand each one of the bits in the register.
-        case dSPIN_STATUS:
-            ret_val = procParam(0, 16);
-            break;
-            
-        default:
-            ret_val = dspin_xfer((uint8_t)(value));
-            break;
-    }
+    if (isCached(REG))
+        return m_shadow[REG];
+    
+    buf[0] = dSPIN_GET_PARAM | REG;
+    for (int i=1; i<=dSPIN_Reg<REG>::BYTES; i++)
+        buf[i] = 0;
+    
+    int result = dspin_cmd(buf, dSPIN_Reg<REG>::BYTES + 1);
+    
+    for (int i=1; i<=dSPIN_Reg<REG>::BYTES; i++)
+        ret_val = (ret_val << 8) | buf[i];
+    ret_val &= dSPIN_Reg<REG>::MASK;
+    
+    if (result >= 0 and !m_staging)
+        shadowStore(REG, ret_val);
     return ret_val;
 }
 
 
 /*  
- *  Moves bytes over the SPI interface
+ *  Moves bytes over the SPI interface.  With a persistent bus the open/close
+ *  calls do not touch the device.
  */
 inline uint8_t L6470::dspin_xfer(uint8_t data)
 {
+    uint8_t data_out = data;
+    if (dspin_cmd(&data_out, 1) < 0)
+        return -1;
+    return data_out;
+}
+
+
+/*
+ *  Shifts a complete command to the chip in one bus operation.  Each byte is
+ *  its own chip-select frame.  The buffer is overwritten with the reply bytes.
+ *  While staging the command is only added to the stage, or refused with -1
+ *  when it does not fit.  Staged bytes reach the estimate when they are sent.
+ */
+inline int L6470::dspin_cmd(uint8_t* buf, uint8_t len)
+{
+    if (m_staging)
+    {
+        if (m_stageLen + len > L6470_STAGE_LEN)
+            return -1;
+        for (uint8_t i=0; i<len; i++)
+            m_stage[m_stageLen++] = buf[i];
+        return 0;
+    }
+    trackBytes(buf, len);
+    return dspin_send(buf, len);
+}
+
+
+/*
+ *  Sends an opcode followed by a 3 byte payload, MSB first.
+ */
+inline int L6470::dspin_cmd(uint8_t cmd, uint32_t value)
+{
+    uint8_t buf[L6470_MAX_CMD_LEN];
+    buf[0] = cmd;
+    buf[1] = (uint8_t)(value >> 16);
+    buf[2] = (uint8_t)(value >> 8);
+    buf[3] = (uint8_t)(value);
+    return dspin_cmd(buf, 4);
+}
+
+/*
+ *  Sends bytes to the chip, through the chain if there is one.
+ */
+inline int L6470::dspin_send(uint8_t* buf, uint8_t len)
+{
+    int result = 0;
+    if (m_chain)
+        return m_chain->xfer(m_slot, buf, len);
     if(!m_bus)
         return -1;
-    uint8_t data_out = data;
     m_bus->openBus();
-    m_bus->rwData(&data_out, 1);
+    result = m_bus->rwFrames(buf, len, 1);
     m_bus->closeBus();
-    return data_out;
+    return result;
+}
+
+
+/*
+ *  Feeds outgoing command bytes to the motion estimate, if there is one.
+ */
+inline void L6470::trackBytes(const uint8_t* buf, int len)
+{
+    if (!m_track)
+        return;
+    
+    trackAdvance();
+    for (int i=0; i<len; i++)
+        m_track->shift(buf[i]);
+}
+
+
+/*
+ *  Brings the motion estimate up to the present and accumulates the distance
+ *  moved for the drift bound.
+ */
+inline void L6470::trackAdvance()
+{
+    if (!m_track)
+        return;
+    
+    int64_t t = monotonic();
+    int32_t before = m_track->position();
+
+    m_track->advance(t - m_trackTime);
+    m_trackTime = t;
+    m_travel += abs(dSPIN_toSigned((m_track->position() - before) & 0x3FFFFF, 22));
+}
+
+
+/*
+ *  Resets the estimate to a position read from the chip between t0 and t1.
+ */
+inline void L6470::trackSync(int32_t pos, int64_t t0, int64_t t1)
+{
+    if (!m_track)
+        return;
+    
+    trackAdvance();
+    m_correction = dSPIN_toSigned((pos - m_track->position()) & 0x3FFFFF, 22);
+    m_track->setReg(dSPIN_ABS_POS, pos);
+    m_syncErr    = m_track->speed() * m_track->microSteps() * (t1 - t0) / 1e9;
+    m_syncTime   = t1;
+    m_travel     = 0;
+}
+
+
+
+/*
+ *  Records a register value in the shadow copy unless it is volatile.  While
+ *  staging the value is held back until the stage is sent.
+ */
+inline void L6470::shadowStore(uint8_t param, uint32_t value)
+{
+    if (param >= dSPIN_REG_COUNT or
+        (dSPIN_REG_TABLE[param].flags & dSPIN_REG_VOLATILE))
+        return;
+    if (m_staging)
+    {
+        m_stageShadow[param] = value;
+        m_stageValid |= (1UL << param);
+        return;
+    }
+    m_shadow[param] = value;
+    m_shadowValid |= (1UL << param);
+}
+
+
+/*
+ *  Settles the registers written while staging: into the shadow copy if the
+ *  stage was sent, otherwise forgotten so they are read from the chip again.
+ */
+inline void L6470::shadowStaged(int sent)
+{
+    for (uint8_t param=0; param<dSPIN_REG_COUNT; param++)
+    {
+        if (!(m_stageValid & (1UL << param)))
+            continue;
+        if (sent)
+        {
+            m_shadow[param] = m_stageShadow[param];
+            m_shadowValid |= (1UL << param);
+        }
+        else
+            m_shadowValid &= ~(1UL << param);
+    }
+    m_stageValid = 0;
 }
 
 
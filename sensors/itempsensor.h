@@ -11,7 +11,7 @@
 
 class ITempSensor
 {
-protected:
+public:
     virtual ~ITempSensor(){};
     
     virtual int     isReady()=0;
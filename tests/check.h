@@ -0,0 +1,30 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <stdio.h>
+
+/*
+ *  Minimal assertion helpers for the test programs.  A failed CHECK prints
+ *  the expression and location and is counted; a test's main() returns
+ *  check_result() so any failure gives a non-zero exit status.
+ */
+static int check_failed = 0;
+static int check_count  = 0;
+
+#define CHECK(expr)                                                         \
+    do {                                                                    \
+        check_count++;                                                      \
+        if (!(expr))                                                        \
+        {                                                                   \
+            check_failed++;                                                 \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #expr); \
+        }                                                                   \
+    } while (0)
+
+static inline int check_result(const char* name)
+{
+    printf("%s: %d checks, %d failed\n", name, check_count, check_failed);
+    return check_failed ? 1 : 0;
+}
+
+#endif // TESTS_CHECK_H
@@ -0,0 +1,114 @@
+/*
+ *  Syscalls and wall time per L6470 command.
+ *
+ *  FS_SPI is run against a fake spidev: the program supplies its own ioctl(),
+ *  which the headers' calls bind to ahead of the C library's.  It counts
+ *  SPI_IOC_MESSAGE and settings ioctls and returns zeros as the chip's reply,
+ *  so the figures are the driver's own cost and its syscall count per
+ *  command, without the kernel or the bus.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "fs_spi.h"
+#include "l6470.h"
+
+static unsigned long g_messages = 0;    // SPI_IOC_MESSAGE calls
+static unsigned long g_settings = 0;    // Mode, BPW and speed ioctls
+static uint32_t      g_value[256];      // Last value written per ioctl nr
+
+extern "C" int ioctl(int fd, unsigned long req, ...) __THROW
+{
+    va_list ap;
+    va_start(ap, req);
+    void* arg = va_arg(ap, void*);
+    va_end(ap);
+
+    if (_IOC_TYPE(req) != SPI_IOC_MAGIC)
+        return -1;
+
+    if (_IOC_NR(req) == 0)
+    {
+        struct spi_ioc_transfer* xfer = (struct spi_ioc_transfer*)arg;
+        int count = _IOC_SIZE(req) / sizeof(struct spi_ioc_transfer);
+        int total = 0;
+        for (int i=0; i<count; i++)
+        {
+            if (xfer[i].rx_buf)
+                memset((void*)(unsigned long)xfer[i].rx_buf, 0, xfer[i].len);
+            total += xfer[i].len;
+        }
+        g_messages++;
+        return total;
+    }
+
+    // Settings: remember writes, answer reads with the value written
+    int size = _IOC_SIZE(req);
+    if (_IOC_DIR(req) & _IOC_WRITE)
+        memcpy(&g_value[_IOC_NR(req)], arg, size);
+    else
+        memcpy(arg, &g_value[_IOC_NR(req)], size);
+    g_settings++;
+    return 0;
+}
+
+
+static int64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+enum { ROUNDS = 200000 };
+
+static int g_fail = 0;
+
+static void report(const char* name, int64_t t0, unsigned long msg0,
+                   unsigned long set0)
+{
+    double ns   = (double)(now() - t0) / ROUNDS;
+    double msgs = (double)(g_messages - msg0) / ROUNDS;
+    double sets = (double)(g_settings - set0) / ROUNDS;
+
+    printf("  %-22s %8.2f %8.2f %10.1f\n", name, msgs, sets, ns);
+    if (msgs > 1.0 or sets > 0.0)
+        g_fail = 1;
+}
+
+
+#define BENCH(name, stmt)                                       \
+    do {                                                        \
+        unsigned long msg0 = g_messages, set0 = g_settings;     \
+        int64_t t0 = now();                                     \
+        for (int i=0; i<ROUNDS; i++)                            \
+            stmt;                                               \
+        report(name, t0, msg0, set0);                           \
+    } while (0)
+
+
+int main()
+{
+    FS_SPI spi(5000000, "/dev/null");
+    L6470  axis(spi);
+    volatile uint32_t sink = 0;
+
+    printf("L6470 commands on a fake spidev, %d rounds each\n", ROUNDS);
+    printf("  %-22s %8s %8s %10s\n", "command", "msg/cmd", "cfg/cmd",
+           "ns/cmd");
+
+    BENCH("run",                axis.run(dSPIN_FWD, 200.0f));
+    BENCH("move",               axis.move(1000));
+    BENCH("gotoPosABS",         axis.gotoPosABS(-5000));
+    BENCH("goUntil",            axis.goUntil(0, dSPIN_FWD, 100.0f));
+    BENCH("setParam(MAX_SPEED)",axis.setParam(dSPIN_MAX_SPEED, 0x41));
+    BENCH("getParam(ABS_POS)",  sink += axis.getParam(dSPIN_ABS_POS));
+    BENCH("getStatus",          sink += axis.getStatus());
+    BENCH("softStop",           axis.softStop());
+
+    printf("%s: every command %s one SPI_IOC_MESSAGE and no settings ioctls\n",
+           g_fail ? "FAIL" : "ok", g_fail ? "must take" : "took");
+    return g_fail;
+}
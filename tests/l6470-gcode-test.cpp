@@ -0,0 +1,112 @@
+/*
+ *  L6470GCode driving one simulated axis in real time.  A program is
+ *  stopped part way through and the interpreter started again, which must
+ *  not run anything left over from the first program.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include "l6470.h"
+#include "l6470-sim.h"
+#include "l6470-group.h"
+#include "l6470-kinematics.h"
+#include "l6470-gcode.h"
+#include "check.h"
+
+/* A stream holding the given text, read from the start. */
+static FILE* program(const char* text)
+{
+    FILE* f = tmpfile();
+    fputs(text, f);
+    rewind(f);
+    return f;
+}
+
+
+/* Wait for the simulated motor to stop.  wait() returns once the last move
+   is sent, not when it is finished. */
+static void settle(L6470Sim& sim)
+{
+    for (int i=0; i<500; i++)
+    {
+        sim.time();     // Brings the chip up to the present
+        if (sim.device(0).mode() == L6470_MODE_STOPPED)
+            return;
+        usleep(10000);
+    }
+}
+
+
+static void testRun()
+{
+    L6470Sim        sim;
+    L6470           axis(sim);
+    L6470Group      group;
+    axis.initMotion(8, 1000, 5000, 5000);
+    group.addAxis(axis);
+    L6470Kinematics kin(group);
+    L6470GCode      gc(kin);
+    sim.setRealTime(1);
+
+    FILE* f = program("G21 G90\nG1 X10 F3000\nG91 G1 X-4\nM2\n");
+    CHECK(gc.start(f) == 0);
+    CHECK(gc.wait() == 0);
+    CHECK(gc.moveCount() == 2);
+    settle(sim);
+    CHECK(sim.device(0).position() == 6 * 8);
+    fclose(f);
+}
+
+
+static void testRestart()
+{
+    L6470Sim        sim;
+    L6470           axis(sim);
+    L6470Group      group;
+    axis.initMotion(8, 1000, 5000, 5000);
+    group.addAxis(axis);
+    L6470Kinematics kin(group);
+    L6470GCode      gc(kin, 4);
+    sim.setRealTime(1);
+
+    // Enough moves to fill both queues, stopped during the first one
+    char text[60 * 24] = "";
+    for (int i=1; i<=60; i++)
+        sprintf(text + strlen(text), "G1 X%d F1200\n", i * 20);
+    FILE* f = program(text);
+    CHECK(gc.start(f) == 0);
+    usleep(100000);
+    gc.stop();
+    CHECK(!gc.isRunning());
+    CHECK(gc.moveCount() < 60);
+    fclose(f);
+
+    settle(sim);
+    int32_t stopped = sim.device(0).position();
+    CHECK(stopped < 20 * 8);
+
+    // An empty program moves nothing
+    f = program("");
+    CHECK(gc.start(f) == 0);
+    CHECK(gc.wait() == 0);
+    CHECK(gc.moveCount() == 0);
+    settle(sim);
+    CHECK(sim.device(0).position() == stopped);
+    fclose(f);
+
+    // And a new one runs from where the motor stopped
+    f = program("G1 X5 F3000\n");
+    CHECK(gc.start(f) == 0);
+    CHECK(gc.wait() == 0);
+    CHECK(gc.moveCount() == 1);
+    settle(sim);
+    CHECK(sim.device(0).position() == 5 * 8);
+    fclose(f);
+}
+
+
+int main()
+{
+    testRun();
+    testRestart();
+    return check_result("l6470-gcode-test");
+}
@@ -0,0 +1,232 @@
+/*
+ *  L6470Planner against a simulated chip.  The planner is stepped with
+ *  update() and the simulation advanced by the same time, so the test runs
+ *  faster than real time and gives the same result on every run.
+ */
+#include <math.h>
+#include "l6470.h"
+#include "l6470-sim.h"
+#include "l6470-planner.h"
+#include "check.h"
+
+static const float   DT     = 0.005;
+static const int64_t DT_NS  = 5000000;
+static const int     LIMIT  = 20000;    // Updates before giving up, 100 s
+
+struct Rig
+{
+    L6470Sim        sim;
+    L6470           axis;
+    L6470Planner    plan;
+    float           vPeak;      // Highest chip speed seen
+    float           vLow;       // Lowest chip speed seen between start and end
+
+    Rig() : axis(sim), plan(axis)
+    {
+        // The chip must accelerate at least as hard as the planner
+        axis.initMotion(8, 1000, 5000, 5000);
+        plan.reset();
+        vPeak = 0;
+        vLow  = 1e9;
+    }
+
+    /* Step until the planner is done, returns the number of updates. */
+    int runOut(int32_t from = 0, int32_t to = 0)
+    {
+        int n = 0;
+        while (!plan.isDone() and n < LIMIT)
+        {
+            plan.update(DT);
+            sim.advance(DT_NS);
+            n++;
+
+            float v = sim.device(0).speed();
+            if (v > vPeak)
+                vPeak = v;
+            int32_t pos = sim.device(0).position();
+            if (from != to and pos > from and pos < to and v < vLow)
+                vLow = v;
+        }
+        return n;
+    }
+};
+
+
+static void testSingleMove()
+{
+    Rig r;
+    r.plan.setLimits(400, 800);
+    CHECK(r.plan.push(8000) == 1);
+    CHECK(r.plan.getState() == L6470_PLAN_RUNNING);
+
+    int n = r.runOut();
+    CHECK(n < LIMIT);
+    CHECK(r.plan.isDone());
+    CHECK(r.plan.pending() == 0);
+    CHECK(r.sim.device(0).position() == 8000);
+    CHECK(r.axis.getPosition() == 8000);
+    CHECK(r.sim.device(0).mode() == L6470_MODE_STOPPED);
+    // The planner speed limit holds, allowing for the 15 bit SPEED resolution
+    CHECK(r.vPeak <= 400 * 1.01);
+    CHECK(r.vPeak >= 400 * 0.95);
+}
+
+
+static void testBlend()
+{
+    // Three targets in one direction pass through without stopping
+    Rig r;
+    r.plan.setLimits(400, 800);
+    r.plan.push(4000);
+    r.plan.push(8000);
+    CHECK(r.plan.push(12000) == 3);
+
+    r.runOut(2000, 10000);
+    CHECK(r.plan.isDone());
+    CHECK(r.sim.device(0).position() == 12000);
+    CHECK(r.vLow > 300);
+}
+
+
+static void testReverse()
+{
+    // A change of direction stops at the turning point
+    Rig r;
+    r.plan.setLimits(400, 800);
+    r.plan.push(4000);
+    r.plan.push(0);
+
+    int n = 0;
+    int turned = 0;
+    float vPrev = 0;
+    while (!r.plan.isDone() and n++ < LIMIT)
+    {
+        r.plan.update(DT);
+        r.sim.advance(DT_NS);
+        float v = r.plan.getVelocity();
+        CHECK(!(vPrev > 0 and v < 0));
+        if (vPrev == 0 and v < 0)
+            turned = 1;
+        vPrev = v;
+    }
+    CHECK(turned);
+    CHECK(r.plan.isDone());
+    CHECK(r.sim.device(0).position() == 0);
+}
+
+
+static void testJerk()
+{
+    // With a jerk limit the acceleration ramps instead of stepping
+    Rig r;
+    r.plan.setLimits(400, 800, 4000);
+    r.plan.push(8000);
+
+    float vPrev = 0;
+    float aPrev = 0;
+    float daMax = 0;
+    int   n = 0;
+    while (n++ < LIMIT)
+    {
+        // The last update hands the stop to the chip, skip that one
+        if (r.plan.update(DT) != L6470_PLAN_RUNNING)
+            break;
+        r.sim.advance(DT_NS);
+        float a = (r.plan.getVelocity() - vPrev) / DT;
+        if (fabs(a - aPrev) > daMax)
+            daMax = fabs(a - aPrev);
+        vPrev = r.plan.getVelocity();
+        aPrev = a;
+    }
+    r.runOut();
+    CHECK(daMax <= 4000 * DT * 1.01);
+    CHECK(r.plan.isDone());
+    CHECK(r.sim.device(0).position() == 8000);
+}
+
+
+static void testStop()
+{
+    Rig r;
+    r.plan.setLimits(400, 800);
+    r.plan.push(80000);
+    for (int i=0; i<200; i++)
+    {
+        r.plan.update(DT);
+        r.sim.advance(DT_NS);
+    }
+    CHECK(r.sim.device(0).speed() > 0);
+
+    r.plan.stop();
+    CHECK(r.plan.pending() == 0);
+    CHECK(r.plan.getState() == L6470_PLAN_STOPPING);
+    r.runOut();
+    CHECK(r.plan.isDone());
+    CHECK(r.sim.device(0).mode() == L6470_MODE_STOPPED);
+    CHECK(r.sim.device(0).position() < 80000);
+}
+
+
+static void testPushWhileStopping()
+{
+    // New targets during the final stop are each visited in turn
+    Rig r;
+    r.plan.setLimits(400, 800);
+    r.plan.push(4000);
+    int n = 0;
+    while (r.plan.getState() == L6470_PLAN_RUNNING and n++ < LIMIT)
+    {
+        r.plan.update(DT);
+        r.sim.advance(DT_NS);
+    }
+    CHECK(r.plan.getState() == L6470_PLAN_STOPPING);
+
+    r.plan.push(6000);
+    r.plan.push(2000);
+    CHECK(r.plan.getState() == L6470_PLAN_RUNNING);
+    CHECK(r.plan.pending() == 2);
+
+    int32_t maxPos = 0;
+    int early = 0;      // Updates that left RUNNING with targets queued
+    n = 0;
+    while (!r.plan.isDone() and n++ < LIMIT)
+    {
+        r.plan.update(DT);
+        r.sim.advance(DT_NS);
+        if (r.sim.device(0).position() > maxPos)
+            maxPos = r.sim.device(0).position();
+        if (r.plan.pending() > 0 and r.plan.getState() != L6470_PLAN_RUNNING)
+            early++;
+    }
+    CHECK(early == 0);
+    CHECK(r.plan.isDone());
+    CHECK(r.plan.pending() == 0);
+    CHECK(maxPos >= 6000 - 8);
+    CHECK(r.sim.device(0).position() == 2000);
+
+    // And a stop() followed by a push() starts from where the motor ended
+    r.plan.push(8000);
+    for (int i=0; i<100; i++)
+    {
+        r.plan.update(DT);
+        r.sim.advance(DT_NS);
+    }
+    r.plan.stop();
+    r.plan.push(1000);
+    CHECK(r.plan.getState() == L6470_PLAN_RUNNING);
+    r.runOut();
+    CHECK(r.plan.isDone());
+    CHECK(r.sim.device(0).position() == 1000);
+}
+
+
+int main()
+{
+    testSingleMove();
+    testBlend();
+    testReverse();
+    testJerk();
+    testStop();
+    testPushWhileStopping();
+    return check_result("l6470-planner-test");
+}
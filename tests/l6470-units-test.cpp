@@ -0,0 +1,83 @@
+/*
+ *  Register conversions in l6470-units.h.  Every value of every speed and
+ *  acceleration register must survive a trip through milli-units and back,
+ *  and the compile time conversion must agree with the run time one.
+ */
+#include "l6470-units.h"
+#include "check.h"
+
+/* Returns the number of register values that do not round trip. */
+template<uint8_t REG> static uint32_t roundTrip(uint32_t max)
+{
+    uint32_t bad = 0;
+    for (uint32_t r=0; r<=max; r++)
+    {
+        if (dSPIN_toReg<REG>(dSPIN_fromReg<REG>(r)) != r)
+        {
+            if (bad++ == 0)
+                printf("  first failure at 0x%X\n", r);
+        }
+    }
+    return bad;
+}
+
+
+static void testRoundTrip()
+{
+    CHECK(roundTrip<dSPIN_SPEED>(dSPIN_Reg<dSPIN_SPEED>::MASK) == 0);
+    CHECK(roundTrip<dSPIN_MAX_SPEED>(dSPIN_Reg<dSPIN_MAX_SPEED>::MASK) == 0);
+    // MIN_SPEED bit 12 is LSPD_OPT, not part of the speed
+    CHECK(roundTrip<dSPIN_MIN_SPEED>(0xFFF) == 0);
+    CHECK(roundTrip<dSPIN_FS_SPD>(dSPIN_Reg<dSPIN_FS_SPD>::MASK) == 0);
+    CHECK(roundTrip<dSPIN_INT_SPD>(dSPIN_Reg<dSPIN_INT_SPD>::MASK) == 0);
+    CHECK(roundTrip<dSPIN_ACC>(dSPIN_Reg<dSPIN_ACC>::MASK) == 0);
+    CHECK(roundTrip<dSPIN_DEC>(dSPIN_Reg<dSPIN_DEC>::MASK) == 0);
+}
+
+
+static void testKnownValues()
+{
+    // Reset values from the datasheet: ACC/DEC 0x08A = 2008 step/s^2,
+    //  MAX_SPEED 0x041 = 991.8 step/s, FS_SPD 0x027 = 602.7 step/s
+    CHECK(dSPIN_toReg<dSPIN_ACC>(stepsPerSec2(2008)) == 0x08A);
+    CHECK(dSPIN_fromReg<dSPIN_ACC>(0x08A) / 1000 == 2008);
+    CHECK(dSPIN_fromReg<dSPIN_MAX_SPEED>(0x041) / 100 == 9918);
+    CHECK(dSPIN_fromReg<dSPIN_FS_SPD>(0x027) / 100 == 6027);
+
+    // Out of range inputs saturate, MIN_SPEED leaves LSPD_OPT clear
+    CHECK(dSPIN_toReg<dSPIN_MAX_SPEED>(0xFFFFFFFFUL) == 0x3FF);
+    CHECK(dSPIN_toReg<dSPIN_MIN_SPEED>(0xFFFFFFFFUL) == 0xFFF);
+    CHECK(dSPIN_toReg<dSPIN_SPEED>(0) == 0);
+    CHECK(dSPIN_toReg<dSPIN_FS_SPD>(0) == 0);
+
+    // The FS_SPD threshold never lands above the requested speed, allowing
+    //  for fromReg() rounding the threshold up by less than a milli-step
+    uint32_t over = 0;
+    for (uint32_t m=8000; m<15000000; m+=997)
+    {
+        if (dSPIN_fromReg<dSPIN_FS_SPD>(dSPIN_toReg<dSPIN_FS_SPD>(m)) > m + 1)
+            over++;
+    }
+    CHECK(over == 0);
+}
+
+
+static void testConst()
+{
+    CHECK((dSPIN_RegConst<dSPIN_ACC, 500000>::value) ==
+          dSPIN_toReg<dSPIN_ACC>(500000));
+    CHECK((dSPIN_RegConst<dSPIN_MAX_SPEED, 991800>::value) ==
+          dSPIN_toReg<dSPIN_MAX_SPEED>(991800));
+    CHECK((dSPIN_RegConst<dSPIN_FS_SPD, 602700>::value) ==
+          dSPIN_toReg<dSPIN_FS_SPD>(602700));
+    CHECK((dSPIN_RegConst<dSPIN_MIN_SPEED, 0xFFFFFFFFUL>::value) == 0xFFF);
+}
+
+
+int main()
+{
+    testRoundTrip();
+    testKnownValues();
+    testConst();
+    return check_result("l6470-units-test");
+}
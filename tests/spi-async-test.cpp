@@ -0,0 +1,239 @@
+/*
+ *  SPI_AsyncQueue against a simulated L6470 and a recording bus.  Ordering,
+ *  merging and completion are checked with dispatch() called directly, then
+ *  the worker thread is run with two producers.
+ */
+#include <unistd.h>
+#include <vector>
+#include "spi_async.h"
+#include "l6470-sim.h"
+#include "check.h"
+
+/* Bus that records every segment it is given and echoes tx + 1 into rx. */
+struct RecordBus : public ISPI
+{
+    int calls;
+    std::vector<uint32_t> lens;
+    std::vector<int>      cs;
+
+    RecordBus() : calls(0) {}
+    int openBus() {return 0;}
+    int closeBus() {return 0;}
+    int isReady() {return 1;}
+    int setBPW(int val) {return 8;}
+    int setSpeed(int val) {return 0;}
+    int setMode(int val) {return 0;}
+    int rwData(uint8_t *data, uint8_t len) {return len;}
+    uint8_t  rwByte(uint8_t bt) {return bt;}
+    uint16_t rwWord(uint16_t wd) {return wd;}
+
+    int rwSegments(const SPI_Segment* seg, int count)
+    {
+        int total = 0;
+        calls++;
+        for (int i=0; i<count; i++)
+        {
+            lens.push_back(seg[i].len);
+            cs.push_back(seg[i].csChange);
+            for (uint32_t j=0; seg[i].rx and j<seg[i].len; j++)
+                seg[i].rx[j] = seg[i].tx ? seg[i].tx[j] + 1 : 0;
+            total += seg[i].len;
+        }
+        return total;
+    }
+};
+
+
+static std::vector<uint32_t> doneSeq;
+static std::vector<int>      doneLen;
+
+static void record(uint32_t seq, int result, void* ctx)
+{
+    doneSeq.push_back(seq);
+    doneLen.push_back(result);
+    if (ctx)
+        (*(int*)ctx)++;
+}
+
+
+static void testSim()
+{
+    // Commands shifted through the queue reach the chip and replies come back
+    L6470Sim sim;
+    SPI_AsyncQueue q;
+    sim.openBus();
+
+    uint8_t get[3] = {dSPIN_GET_PARAM | dSPIN_CONFIG, 0, 0};
+    uint8_t rsp[3];
+    uint8_t set[3] = {dSPIN_SET_PARAM | dSPIN_MAX_SPEED, 0x00, 0x20};
+    uint8_t run[4] = {dSPIN_RUN | dSPIN_FWD, 0x00, 0x10, 0x00};
+
+    // The L6470 needs chip-select released after every byte
+    SPI_Segment seg[4];
+    memset(seg, 0, sizeof(seg));
+    for (int i=0; i<3; i++)
+    {
+        seg[i].tx = get + i;
+        seg[i].rx = rsp + i;
+        seg[i].len = 1;
+        seg[i].csChange = 1;
+    }
+    uint32_t s1 = q.submit(sim, seg, 3);
+    uint32_t s2 = q.submit(sim, set, NULL, 3);
+    uint32_t s3 = q.submit(sim, run, NULL, 4);
+    CHECK(s1 != 0 and s2 != 0 and s3 != 0);
+    CHECK(q.pending() == 3);
+    CHECK(!q.isDone(s1));
+
+    CHECK(q.start() == 0);
+    CHECK(q.wait(s3, 1000) == 0);
+    CHECK(q.isDone(s1) and q.isDone(s2));
+    CHECK(q.pending() == 0);
+    q.stop();
+
+    CHECK(((rsp[1] << 8) | rsp[2]) == 0x2E88);
+    CHECK(sim.device(0).reg(dSPIN_MAX_SPEED) == 0x20);
+    CHECK(sim.device(0).mode() == L6470_MODE_RUN);
+    // The three requests share one bus call
+    CHECK(q.callCount() == 1);
+    CHECK(q.mergeCount() == 2);
+}
+
+
+static void testMerge()
+{
+    // Consecutive requests for one bus share a call, in queue order
+    RecordBus a, b;
+    SPI_AsyncQueue q;
+    uint8_t tx[6] = {1, 2, 3, 4, 5, 6};
+    uint8_t rx[6][6];
+    int count = 0;
+
+    doneSeq.clear();
+    doneLen.clear();
+    uint32_t s[6];
+    s[0] = q.submit(a, tx, rx[0], 1, record, &count);
+    s[1] = q.submit(a, tx, rx[1], 2, record, &count);
+    s[2] = q.submit(a, tx, rx[2], 3, record, &count);
+    s[3] = q.submit(b, tx, rx[3], 4, record, &count);
+    s[4] = q.submit(b, tx, rx[4], 5, record, &count);
+    s[5] = q.submit(a, tx, rx[5], 6, record, &count);
+
+    CHECK(q.dispatch() == 3);
+    CHECK(q.isDone(s[2]) and !q.isDone(s[3]));
+    CHECK(q.dispatch() == 2);
+    CHECK(q.dispatch() == 1);
+    CHECK(q.dispatch() == 0);
+
+    CHECK(a.calls == 2 and b.calls == 1);
+    CHECK(q.callCount() == 3);
+    CHECK(q.mergeCount() == 3);
+    CHECK(count == 6);
+    CHECK(doneSeq.size() == 6);
+    for (unsigned int i=0; i<doneSeq.size(); i++)
+    {
+        CHECK(doneSeq[i] == s[i]);
+        CHECK(doneLen[i] == (int)i + 1);
+        CHECK(rx[i][i] == tx[i] + 1);
+    }
+
+    // Chip-select is released after each request
+    CHECK(a.cs.size() == 4 and b.cs.size() == 2);
+    for (unsigned int i=0; i<a.cs.size(); i++)
+        CHECK(a.cs[i] == 1);
+    CHECK(a.lens[3] == 6);
+}
+
+
+static void testLimits()
+{
+    RecordBus a;
+    SPI_AsyncQueue q(2);
+    uint8_t tx[4] = {0};
+    SPI_Segment seg[SPI_ASYNC_SEGS + 1];
+    memset(seg, 0, sizeof(seg));
+
+    CHECK(q.submit(a, seg, 0) == 0);
+    CHECK(q.submit(a, seg, SPI_ASYNC_SEGS + 1) == 0);
+
+    uint32_t s1 = q.submit(a, tx, NULL, 4);
+    uint32_t s2 = q.submit(a, tx, NULL, 4);
+    CHECK(s1 != 0 and s2 != 0);
+    CHECK(q.submit(a, tx, NULL, 4) == 0);
+
+    // Nothing is performed without a worker or a dispatch() call
+    CHECK(q.wait(s1, 10) == -1);
+    CHECK(q.dispatch() == 2);
+    CHECK(q.wait(s2, 0) == 0);
+    CHECK(q.submit(a, tx, NULL, 4) != 0);
+}
+
+
+struct Producer
+{
+    SPI_AsyncQueue* q;
+    ISPI*           bus;
+    int             done;
+    uint32_t        last;
+    uint8_t         tx[4];
+    uint8_t         rx[200][4];
+};
+
+static void count(uint32_t seq, int result, void* ctx)
+{
+    if (result == 4)
+        __atomic_add_fetch((int*)ctx, 1, __ATOMIC_RELAXED);
+}
+
+static void* produce(void* arg)
+{
+    Producer* p = (Producer*)arg;
+    for (int i=0; i<200; i++)
+    {
+        uint32_t seq;
+        while ((seq = p->q->submit(*p->bus, p->tx, p->rx[i], 4, count,
+                                   &p->done)) == 0)
+            usleep(10);
+        p->last = seq;
+    }
+    p->q->wait(p->last);
+    return NULL;
+}
+
+
+static void testThreads()
+{
+    RecordBus a, b;
+    SPI_AsyncQueue q(32);
+    Producer pa, pb;
+    pa.q = &q; pa.bus = &a; pa.done = 0;
+    pb.q = &q; pb.bus = &b; pb.done = 0;
+    for (int i=0; i<4; i++)
+        pa.tx[i] = pb.tx[i] = i;
+
+    CHECK(q.start() == 0);
+    CHECK(q.isRunning());
+    pthread_t ta, tb;
+    pthread_create(&ta, NULL, produce, &pa);
+    pthread_create(&tb, NULL, produce, &pb);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+    q.stop();
+    CHECK(!q.isRunning());
+
+    CHECK(pa.done == 200 and pb.done == 200);
+    CHECK(q.isDone(pa.last) and q.isDone(pb.last));
+    CHECK(a.lens.size() == 200 and b.lens.size() == 200);
+    CHECK(pa.rx[199][3] == 4 and pb.rx[0][0] == 1);
+    CHECK(q.callCount() + q.mergeCount() == 400);
+}
+
+
+int main()
+{
+    testSim();
+    testMerge();
+    testLimits();
+    testThreads();
+    return check_result("spi-async-test");
+}
@@ -0,0 +1,148 @@
+/*
+ *  SPI_BusMgr lock under contention.  Several threads share one bus through
+ *  their own handles and the bus checks that no two transfers overlap.  A
+ *  real-time waiter on the same CPU as the holder must still let the holder
+ *  finish and release the bus.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "spi_busmgr.h"
+#include "check.h"
+
+static const int THREADS   = 4;
+static const int TRANSFERS = 500;
+
+/* Bus that counts transfers and any that overlap. */
+struct CountBus : public ISPI
+{
+    int inside;
+    int overlaps;
+    int calls;
+
+    CountBus() : inside(0), overlaps(0), calls(0) {}
+    int openBus() {return 0;}
+    int closeBus() {return 0;}
+    int isReady() {return 1;}
+    int setBPW(int val) {return 8;}
+    int setSpeed(int val) {return 0;}
+    int setMode(int val) {return 0;}
+    uint8_t  rwByte(uint8_t bt) {return bt;}
+    uint16_t rwWord(uint16_t wd) {return wd;}
+
+    int rwData(uint8_t *data, uint8_t len)
+    {
+        if (__atomic_add_fetch(&inside, 1, __ATOMIC_SEQ_CST) != 1)
+            __atomic_add_fetch(&overlaps, 1, __ATOMIC_SEQ_CST);
+        calls++;
+        if (calls % 50 == 0)
+            usleep(100);    // Long enough for the waiters to go to sleep
+        __atomic_sub_fetch(&inside, 1, __ATOMIC_SEQ_CST);
+        return len;
+    }
+};
+
+
+static void* transfer(void* arg)
+{
+    SPI_Handle* h = (SPI_Handle*)arg;
+    uint8_t buf[4] = {0, 1, 2, 3};
+    for (int i=0; i<TRANSFERS; i++)
+        h->rwData(buf, sizeof(buf));
+    return NULL;
+}
+
+
+static void testContention()
+{
+    CountBus bus;
+    SPI_BusMgr mgr;
+    SPI_Handle* h[THREADS];
+    pthread_t t[THREADS];
+
+    for (int i=0; i<THREADS; i++)
+        h[i] = mgr.attach(bus, 1000000 * (i+1), i & 3);
+    for (int i=0; i<THREADS; i++)
+        pthread_create(&t[i], NULL, transfer, h[i]);
+    for (int i=0; i<THREADS; i++)
+        pthread_join(t[i], NULL);
+
+    CHECK(bus.overlaps == 0);
+    CHECK(bus.calls == THREADS * TRANSFERS);
+    CHECK(mgr.acquireCount() == (uint32_t)(THREADS * TRANSFERS));
+    CHECK(mgr.contendedCount() > 0);
+}
+
+
+struct Holder
+{
+    SPI_Handle* h;
+    int         held;
+};
+
+
+static void* hold(void* arg)
+{
+    Holder* p = (Holder*)arg;
+    p->h->lock();
+    __atomic_store_n(&p->held, 1, __ATOMIC_RELEASE);
+    usleep(20000);
+    p->h->unlock();
+    return NULL;
+}
+
+
+struct Waiter
+{
+    SPI_Handle* h;
+    int         realTime;
+};
+
+
+static void* waitFifo(void* arg)
+{
+    Waiter* p = (Waiter*)arg;
+    struct sched_param sp;
+    sp.sched_priority = 10;
+    p->realTime = (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0);
+    p->h->lock();
+    p->h->unlock();
+    return NULL;
+}
+
+
+static void testRealTime()
+{
+    CountBus bus;
+    SPI_BusMgr mgr;
+    Holder holder = {mgr.attach(bus), 0};
+    Waiter waiter = {mgr.attach(bus), 0};
+    pthread_t th, tw;
+
+    // Everything on one CPU, as on the BeagleBone
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    pthread_create(&th, NULL, hold, &holder);
+    while (!__atomic_load_n(&holder.held, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    pthread_create(&tw, NULL, waitFifo, &waiter);
+    pthread_join(tw, NULL);
+    pthread_join(th, NULL);
+
+    if (!waiter.realTime)
+        printf("spi-busmgr-test: no SCHED_FIFO permission, ran unprivileged\n");
+    CHECK(mgr.contendedCount() == 1);
+    CHECK(mgr.maxWait_ns() < 200000000);
+}
+
+
+int main()
+{
+    testContention();
+    testRealTime();
+    return check_result("spi-busmgr-test");
+}
@@ -6,8 +6,8 @@
  *  Class to represent BeagleBone GPIO pins based on SYSFS access.  Allows 
  *  access to functions of GPIO available through the
  *  SYSFS kernel interface in /sys/class/gpio/.  Allows seting the input/output
- *  direction and value as well as interrupt
- *  setting (future).
+ *  direction and value as well as waiting for edges on input pins using
+ *  the SYSFS edge file and poll().
  *
  *   @author     Kyle Crane
  *   @version    0.9.0
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 #include "gpio_pin.h"
 
 
@@ -39,12 +40,16 @@ public:
     int     get();
     int     set_dir(int dir);
     int     get_dir();
+    int     set_edge(int edge);
+    int     wait_edge(int timeout_ms);
+    int     get_fd();
 
     
 private:
     
     int     m_dirFd;     /**< File handle for the pin value file. */
     int		m_valFd;     /**< File handle for GPIO pin. */
+    int     m_edge;      /**< Edge last selected with set_edge(). */
 };
 
 
@@ -63,6 +68,7 @@ inline FSGPIO_Pin::FSGPIO_Pin()
 	m_valFd = -1;
 	m_dirFd = -1;
     m_dir = GPIO_IN;
+    m_edge = GPIO_EDGE_NONE;
 	m_active = 0;
 }
 
@@ -79,6 +85,7 @@ inline FSGPIO_Pin::FSGPIO_Pin(int num)
 	m_valFd = -1;
 	m_dirFd = -1;
     m_dir = GPIO_IN;
+    m_edge = GPIO_EDGE_NONE;
     
 	// Attach this pin to the requested GPIO number
 	connectGPIO(num);
@@ -205,7 +212,7 @@ inline int FSGPIO_Pin::deactivate()
         
         // Open unexport file
         std::ofstream unexportgpio(unexport_str.c_str());
-        if (unexportgpio < 0)
+        if (!unexportgpio)
             return GPIO_FILEERR;
         
         // Write GPIO number to unexport
@@ -216,7 +223,6 @@ inline int FSGPIO_Pin::deactivate()
         close(m_dirFd);
         m_dirFd = -1;
         m_active = 0;
-        return 0;
     }
 	close(m_valFd);
 	m_valFd = -1;
@@ -255,7 +261,8 @@ inline int FSGPIO_Pin::get()
 	// Rewind to the beginning of the file and read
 	// a single character.
 	lseek(m_valFd, 0L, SEEK_SET);
-	read(m_valFd, &c_val, 1);
+	if (read(m_valFd, &c_val, 1) != 1)
+		return GPIO_GENERR;
     
 	// Determine the integer value for the character value
 	if (c_val == '1')
@@ -307,4 +314,94 @@ inline int FSGPIO_Pin::get_dir()
     return m_dir;
 }
 
+
+/** @brief Select which edges of an input pin are reported by wait_edge().
+ *
+ *	@param edge: GPIO_EDGE_NONE, _RISING, _FALLING or _BOTH.
+ *	@return int: Result code.  Negative numbers indicate failure
+ */
+inline int FSGPIO_Pin::set_edge(int edge)
+{
+    std::string edgefile_str = STR_GPIO_PRE + m_sGPIONum + STR_EDGE_POST;
+    
+    // If the pin is not setup then abort with error
+    if (m_active < 1)
+        return GPIO_RDYERR;
+    
+    std::ofstream edgegpio(edgefile_str.c_str());
+    if (!edgegpio)
+        return GPIO_FILEERR;
+    
+    switch (edge)
+    {
+        case GPIO_EDGE_RISING:  edgegpio << STR_EDGE_RISING;  break;
+        case GPIO_EDGE_FALLING: edgegpio << STR_EDGE_FALLING; break;
+        case GPIO_EDGE_BOTH:    edgegpio << STR_EDGE_BOTH;    break;
+        default:                edgegpio << STR_EDGE_NONE;    break;
+    }
+    edgegpio.close();
+    if (edgegpio.fail())
+        return GPIO_FILEERR;
+    
+    m_edge = edge;
+    return GPIO_OK;
+}
+
+
+/** @brief Wait for an edge selected with set_edge().
+ *
+ *  The kernel flags the value file with POLLPRI when the edge occurs.  The
+ *  value is read back to clear the event before and after waiting.  With a
+ *  single edge selected the wait returns at once if the value read before
+ *  waiting is already the level that edge leads to, so an edge that came
+ *  between the caller's last look at the pin and the wait is not lost.  With
+ *  both edges selected the caller must check the level itself afterwards and
+ *  should use a bounded timeout.
+ *
+ *	@param timeout_ms: Longest time to wait in ms, -1 waits forever.
+ *	@return int: 1 if an edge was seen, 0 on timeout, negative on error.
+ */
+inline int FSGPIO_Pin::wait_edge(int timeout_ms)
+{
+    char            c_val;
+    struct pollfd   pfd;
+    
+    // If the pin is not setup then abort with error
+    if (m_active < 1)
+        return GPIO_RDYERR;
+    
+    pfd.fd      = m_valFd;
+    pfd.events  = POLLPRI | POLLERR;
+    pfd.revents = 0;
+    
+    lseek(m_valFd, 0L, SEEK_SET);
+    if (read(m_valFd, &c_val, 1) != 1)
+        return GPIO_GENERR;
+    
+    if ((m_edge == GPIO_EDGE_RISING and c_val == '1') or
+        (m_edge == GPIO_EDGE_FALLING and c_val == '0'))
+        return 1;
+    
+    int result = poll(&pfd, 1, timeout_ms);
+    if (result < 0)
+        return GPIO_GENERR;
+    if (result == 0)
+        return 0;
+    
+    lseek(m_valFd, 0L, SEEK_SET);
+    if (read(m_valFd, &c_val, 1) != 1)
+        return GPIO_GENERR;
+    return 1;
+}
+
+
+/** @brief Get the value file descriptor for use with poll().
+ *
+ *  @return int: The descriptor or -1 if the pin is not active.
+ */
+inline int FSGPIO_Pin::get_fd()
+{
+    return m_valFd;
+}
+
 #endif // FSGPIO_PIN_H
@@ -21,6 +21,10 @@
 #define     STR_IN           "in"
 #define     STR_HIGH         "1"
 #define     STR_LOW          "0"
+#define     STR_EDGE_NONE    "none"
+#define     STR_EDGE_RISING  "rising"
+#define     STR_EDGE_FALLING "falling"
+#define     STR_EDGE_BOTH    "both"
 
 enum GPIO_CONSTANTS
 {
@@ -32,6 +36,15 @@ enum GPIO_CONSTANTS
 };
 
 
+enum GPIO_EDGES
+{
+    GPIO_EDGE_NONE    = 0,
+    GPIO_EDGE_RISING  = 1,
+    GPIO_EDGE_FALLING = 2,
+    GPIO_EDGE_BOTH    = 3
+};
+
+
 enum GPIO_ERRORS
 {
     GPIO_OK      = 0,
@@ -39,6 +52,7 @@ enum GPIO_ERRORS
     GPIO_FILEERR = -2,
     GPIO_RDYERR  = -3,
     GPIO_RESERR  = -4,
+    GPIO_NOSUPP  = -5,
 };
 
 /** @brief Generic GPIO pin class allowing basic digital I/O functions.
@@ -111,6 +125,25 @@ public:
      *  @return int: Pin number.
      */
     virtual int get_GPIONum() {return m_GPIONum;};
+    
+    /** @brief Select which input edges are reported by wait_edge().
+     *  Optional.  Pins without edge support return GPIO_NOSUPP.
+     *  @param edge: GPIO_EDGE_NONE, _RISING, _FALLING or _BOTH.
+     *  @return int: Result code.
+     */
+    virtual int set_edge(int edge) {return GPIO_NOSUPP;};
+    
+    /** @brief Wait for an edge selected with set_edge().
+     *  Optional.  Pins without edge support return GPIO_NOSUPP.
+     *  @param timeout_ms: Longest time to wait in ms, -1 waits forever.
+     *  @return int: 1 if an edge was seen, 0 on timeout, negative on error.
+     */
+    virtual int wait_edge(int timeout_ms) {return GPIO_NOSUPP;};
+    
+    /** @brief Get a file descriptor that can be polled for edges.
+     *  @return int: Descriptor for poll() with POLLPRI, or -1 if none.
+     */
+    virtual int get_fd() {return -1;};
 };
 
 